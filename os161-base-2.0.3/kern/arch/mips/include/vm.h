@@ -116,11 +116,11 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct tlbshootdown_ack;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	paddr_t ts_paddr;		/* frame whose mappings must go */
+	struct tlbshootdown_ack *ts_ack; /* where the target reports done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -1301,6 +1301,8 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_fs.fs_data = ef;
 	ef->ef_fs.fs_ops = &emufs_fsops;
+	/* files can change on the host behind our back; don't cache names */
+	ef->ef_fs.fs_dcache = false;
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
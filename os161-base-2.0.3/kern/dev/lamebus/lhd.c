@@ -37,6 +37,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,15 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Maximum number of iovecs queued at once by lhd_io */
+#define LHD_MAXIOV      8
+
+/* Maximum number of disks lhd_lookup knows about */
+#define LHD_MAXUNITS    8
+
+static struct lhd_softc *lhd_units[LHD_MAXUNITS];
+static int lhd_sched = LHD_SCHED_CLOOK;
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +106,132 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Take the next request off the queue according to the scheduling
+ * policy, or return NULL if the queue is empty. Called with lh_lock
+ * held.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request **pp, **best = NULL, **lowest = NULL;
+	struct lhd_request *req;
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	if (lhd_sched == LHD_SCHED_FIFO) {
+		best = &lh->lh_queue;
+	}
+	else {
+		for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+			if ((*pp)->lr_sector >= lh->lh_head &&
+			    (best == NULL ||
+			     (*pp)->lr_sector < (*best)->lr_sector)) {
+				best = pp;
+			}
+			if (lowest == NULL ||
+			    (*pp)->lr_sector < (*lowest)->lr_sector) {
+				lowest = pp;
+			}
+		}
+		if (best == NULL) {
+			/* Nothing past the head: sweep again from the start */
+			best = lowest;
+		}
+	}
+
+	req = *best;
+	*best = req->lr_next;
+	req->lr_next = NULL;
+	return req;
+}
+
+/*
+ * Start the next sector of the active request, picking a new request
+ * if there is none. Called with lh_lock held and the disk idle.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request *req;
+	uint32_t sector, statval = LHD_WORKING;
+
+	if (lh->lh_active == NULL) {
+		lh->lh_active = lhd_pick(lh);
+		if (lh->lh_active == NULL) {
+			return;
+		}
+		if (lh->lh_active->lr_sector == lh->lh_head) {
+			/* Continues the previous transfer: no seek */
+			lh->lh_stats.ls_merged++;
+		}
+	}
+	req = lh->lh_active;
+	sector = req->lr_sector + req->lr_xferred;
+
+	lh->lh_stats.ls_seek += sector > lh->lh_head ?
+		sector - lh->lh_head : lh->lh_head - sector;
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card buffer.
+	 */
+	if (req->lr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->lr_buf + req->lr_xferred * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that a sector transfer has completed: copy the data out of
+ * the on-card buffer if reading, complete the request if it was the
+ * last sector or it failed, and start the next transfer. Called with
+ * lh_lock held.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *req = lh->lh_active;
+
+	KASSERT(req != NULL);
+
+	if (err == 0 && !req->lr_write) {
+		membar_load_load();
+		memcpy((char *)req->lr_buf + req->lr_xferred * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_head = req->lr_sector + req->lr_xferred + 1;
+	req->lr_xferred++;
+	if (err == 0) {
+		lh->lh_stats.ls_sectors++;
+	}
+
+	if (err != 0 || req->lr_xferred == req->lr_nsect) {
+		lh->lh_active = NULL;
+		lh->lh_stats.ls_requests++;
+		req->lr_result = err;
+		req->lr_finished = true;
+		if (req->lr_done != NULL) {
+			req->lr_done(req);
+		}
+		else {
+			wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+		}
+	}
+
+	lhd_start(lh);
 }
 
 /*
@@ -128,11 +255,96 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
+		spinlock_acquire(&lh->lh_lock);
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		spinlock_release(&lh->lh_lock);
 		break;
 	}
 }
 
+/*
+ * Return the lhd with the given unit number, or NULL.
+ */
+struct lhd_softc *
+lhd_lookup(int unit)
+{
+	if (unit < 0 || unit >= LHD_MAXUNITS) {
+		return NULL;
+	}
+	return lhd_units[unit];
+}
+
+/*
+ * Queue a request. Returns without waiting for the transfer.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **pp;
+
+	/* XXX this check can overflow */
+	if (req->lr_nsect == 0 ||
+	    req->lr_sector + req->lr_nsect > lh->lh_dev.d_blocks) {
+		return EINVAL;
+	}
+
+	req->lr_xferred = 0;
+	req->lr_finished = false;
+	req->lr_result = 0;
+	req->lr_next = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	/* Append, so that the FIFO policy serves requests in order */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next);
+	*pp = req;
+	if (lh->lh_active == NULL) {
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Wait for a request submitted without a completion callback.
+ */
+void
+lhd_wait(struct lhd_softc *lh, struct lhd_request *req)
+{
+	KASSERT(req->lr_done == NULL);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->lr_finished) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Choose the scheduling policy for all disks.
+ */
+void
+lhd_set_sched(int policy)
+{
+	KASSERT(policy == LHD_SCHED_FIFO || policy == LHD_SCHED_CLOOK);
+	lhd_sched = policy;
+}
+
+void
+lhd_getstats(struct lhd_softc *lh, struct lhd_stats *stats)
+{
+	spinlock_acquire(&lh->lh_lock);
+	*stats = lh->lh_stats;
+	spinlock_release(&lh->lh_lock);
+}
+
+void
+lhd_resetstats(struct lhd_softc *lh)
+{
+	spinlock_acquire(&lh->lh_lock);
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+	spinlock_release(&lh->lh_lock);
+}
+
 /*
  * Function called when we are open()'d.
  */
@@ -179,6 +391,101 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Can the uio be transferred directly to and from its buffers? It
+ * must be in kernel space, and each iovec must hold whole sectors.
+ */
+static
+bool
+lhd_io_isdirect(struct uio *uio)
+{
+	size_t resid = uio->uio_resid, len;
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i = 0; i < uio->uio_iovcnt && resid > 0; i++) {
+		len = uio->uio_iov[i].iov_len < resid ?
+			uio->uio_iov[i].iov_len : resid;
+		if (len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+		resid -= len;
+	}
+	return true;
+}
+
+/*
+ * Transfer a kernel-space uio: queue one request per iovec, up to
+ * LHD_MAXIOV at a time, so that the whole transfer is scheduled
+ * together, then wait for all of them.
+ */
+static
+int
+lhd_io_direct(struct lhd_softc *lh, struct uio *uio, uint32_t sector)
+{
+	struct lhd_request reqs[LHD_MAXIOV];
+	struct iovec *iov;
+	size_t len, resid;
+	unsigned i, n;
+	int result = 0;
+
+	while (uio->uio_resid > 0) {
+		n = 0;
+		resid = uio->uio_resid;
+		for (iov = uio->uio_iov;
+		     n < LHD_MAXIOV && resid > 0 &&
+		     iov < uio->uio_iov + uio->uio_iovcnt;
+		     iov++) {
+			len = iov->iov_len < resid ? iov->iov_len : resid;
+			if (len == 0) {
+				continue;
+			}
+			reqs[n].lr_sector = sector;
+			reqs[n].lr_nsect = len / LHD_SECTSIZE;
+			reqs[n].lr_buf = iov->iov_kbase;
+			reqs[n].lr_write = uio->uio_rw == UIO_WRITE;
+			reqs[n].lr_done = NULL;
+			result = lhd_submit(lh, &reqs[n]);
+			if (result) {
+				break;
+			}
+			sector += reqs[n].lr_nsect;
+			resid -= len;
+			n++;
+		}
+		for (i = 0; i < n; i++) {
+			lhd_wait(lh, &reqs[i]);
+			if (result == 0) {
+				result = reqs[i].lr_result;
+			}
+		}
+		if (result) {
+			return result;
+		}
+
+		/* Consume the transferred iovecs */
+		for (i = 0; i < n; i++) {
+			while (uio->uio_iov->iov_len == 0) {
+				uio->uio_iov++;
+				uio->uio_iovcnt--;
+			}
+			len = reqs[i].lr_nsect * LHD_SECTSIZE;
+			uio->uio_iov->iov_kbase =
+				(char *)uio->uio_iov->iov_kbase + len;
+			uio->uio_iov->iov_len -= len;
+			uio->uio_offset += len;
+			uio->uio_resid -= len;
+			if (uio->uio_iov->iov_len == 0 && uio->uio_iovcnt > 1) {
+				uio->uio_iov++;
+				uio->uio_iovcnt--;
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -187,13 +494,14 @@ int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
+	char buf[LHD_SECTSIZE];
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
-	uint32_t statval = LHD_WORKING;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,58 +515,43 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (lhd_io_isdirect(uio)) {
+		return lhd_io_direct(lh, uio, sector);
 	}
 
-	/* Loop over all the sectors we were asked to do. */
+	/*
+	 * Otherwise (e.g. user-space buffers, which cannot be touched
+	 * from the interrupt handler) go through a one-sector bounce
+	 * buffer.
+	 */
 	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(buf, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
 				return result;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		req.lr_sector = sector + i;
+		req.lr_nsect = 1;
+		req.lr_buf = buf;
+		req.lr_write = uio->uio_rw == UIO_WRITE;
+		req.lr_done = NULL;
+		result = lhd_submit(lh, &req);
 		if (result) {
 			return result;
 		}
+		lhd_wait(lh, &req);
+		if (req.lr_result) {
+			return req.lr_result;
+		}
+
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(buf, LHD_SECTSIZE, uio);
+			if (result) {
+				return result;
+			}
+		}
 	}
 
 	return 0;
@@ -284,16 +577,19 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_head = 0;
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+	if (lhdno >= 0 && lhdno < LHD_MAXUNITS) {
+		lhd_units[lhdno] = lh;
 	}
 
 	/* Set up the VFS device structure. */
@@ -31,12 +31,57 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Request scheduling policies: in arrival order, or C-LOOK (serve the
+ * pending request with the lowest sector at or past the head, then
+ * wrap around to the lowest pending sector).
+ */
+#define LHD_SCHED_FIFO   0
+#define LHD_SCHED_CLOOK  1
+
+/*
+ * Disk request. The caller fills in the public fields and passes the
+ * request to lhd_submit, which queues it and returns immediately.
+ * lr_buf must be a kernel buffer of lr_nsect sectors: the data is
+ * moved to and from the on-card buffer by the interrupt handler.
+ *
+ * When the request completes lr_result is set and lr_done is called,
+ * in interrupt context with the disk's lock held, so it must not
+ * sleep or submit other requests. If lr_done is NULL, the caller
+ * waits for completion with lhd_wait.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	void *lr_buf;			/* Kernel buffer */
+	bool lr_write;			/* Transfer direction */
+	void (*lr_done)(struct lhd_request *);	/* Completion callback */
+	void *lr_data;			/* For use by lr_done */
+	int lr_result;			/* Set on completion */
+
+	/* Private to the driver */
+	uint32_t lr_xferred;		/* Sectors transferred so far */
+	bool lr_finished;		/* Request completed */
+	struct lhd_request *lr_next;	/* Next request in the queue */
+};
+
+/*
+ * Per-disk statistics.
+ */
+struct lhd_stats {
+	uint64_t ls_requests;	/* Requests completed */
+	uint64_t ls_sectors;	/* Sectors transferred */
+	uint64_t ls_seek;	/* Sum of sector distances between commands */
+	uint64_t ls_merged;	/* Requests started right where the head was */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +96,12 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct wchan *lh_wchan;		/* For waiting in lhd_wait */
+	struct lhd_request *lh_queue;	/* Pending requests */
+	struct lhd_request *lh_active;	/* Request being transferred */
+	uint32_t lh_head;		/* Sector following the last one done */
+	struct lhd_stats lh_stats;
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +109,12 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Request queue interface */
+struct lhd_softc *lhd_lookup(int unit);
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *req);
+void lhd_wait(struct lhd_softc *lh, struct lhd_request *req);
+void lhd_set_sched(int policy);
+void lhd_getstats(struct lhd_softc *lh, struct lhd_stats *stats);
+void lhd_resetstats(struct lhd_softc *lh);
+
 #endif /* _LAMEBUS_LHD_H_ */
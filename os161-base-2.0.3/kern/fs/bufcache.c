@@ -0,0 +1,769 @@
+/*
+ * Buffer cache dei blocchi dei dischi.
+ *
+ * Tutti i campi dei buffer, la tabella hash e la lista LRU sono
+ * protetti da bc_lock. Un buffer busy ha un trasferimento in corso,
+ * effettuato senza bc_lock: non può essere riutilizzato né modificato
+ * e chi lo richiede attende su bc_cv, segnalata al termine di ogni
+ * trasferimento. Anche le operazioni eseguite direttamente sul disco,
+ * quando la cache non ha buffer disponibili, avvengono senza bc_lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <device.h>
+#include <vm.h>
+#include <bufcache.h>
+#include "opt-paging.h"
+
+#if OPT_PAGING
+#include <coremap.h>
+#endif
+
+#define BC_HASH_SIZE      256
+#define BC_BUFS_PER_FRAME (PAGE_SIZE / BUFCACHE_BLOCKSIZE)
+#define BC_IO_RETRIES     10
+#define BC_RA_QUEUE       8	/* richieste di read-ahead in attesa */
+#define BC_RA_MAXIOV      8	/* blocchi contigui letti con un'unica operazione (LHD_MAXIOV) */
+
+struct buf {
+	struct device *b_dev;
+	daddr_t b_block;
+	bool b_valid;			/* il contenuto è stato letto dal disco */
+	bool b_dirty;			/* il contenuto va scritto sul disco */
+	bool b_busy;			/* trasferimento in corso */
+	bool b_ra;			/* letto dal read-ahead e non ancora richiesto */
+	struct buf *b_hnext;		/* catena della tabella hash */
+	struct buf *b_prev, *b_next;	/* lista LRU, da bc_mru a bc_lru */
+	char *b_data;
+};
+
+static struct lock *bc_lock;
+static struct cv *bc_cv;
+static struct buf **bc_hash;
+static struct buf *bc_mru;	/* buffer usato più di recente */
+static struct buf *bc_lru;	/* buffer usato meno di recente */
+static struct bufcache_stats bc_stats;
+
+/* coda circolare delle richieste di read-ahead, servita da bc_readahead_thread */
+struct bc_rareq {
+	struct device *rr_dev;
+	unsigned rr_n;
+	daddr_t rr_blocks[BUFCACHE_RA_MAX];
+};
+static struct bc_rareq bc_raq[BC_RA_QUEUE];
+static unsigned bc_rafirst, bc_ranum;
+static struct cv *bc_racv;
+static bool bc_ra_running;
+
+static
+unsigned
+bc_hashfn(struct device *dev, daddr_t block)
+{
+	return (((uintptr_t)dev >> 4) ^ (block * 2654435761U)) % BC_HASH_SIZE;
+}
+
+/*
+ * Trasferisce un blocco tra il disco e data, ripetendo l'operazione
+ * in caso di errori di I/O.
+ */
+static
+int
+bc_devio(struct device *dev, daddr_t block, void *data, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result, tries = 0;
+
+	do {
+		uio_kinit(&iov, &ku, data, BUFCACHE_BLOCKSIZE,
+			  (off_t)block * BUFCACHE_BLOCKSIZE, rw);
+		result = DEVOP_IO(dev, &ku);
+	} while (result == EIO && ++tries < BC_IO_RETRIES);
+
+	if (result == EIO) {
+		kprintf("bufcache: block %u I/O error, giving up after %d "
+			"retries\n", block, tries);
+	}
+	return result;
+}
+
+/*
+ * Buffer ammessi in questo momento: la cache può crescere usando metà
+ * dei frame liberi oltre la soglia alta del pageout daemon; sotto tale
+ * soglia la memoria serve alle pagine user e la cache deve ridursi.
+ */
+static
+unsigned
+bc_budget(void)
+{
+#if OPT_PAGING
+	unsigned low, high, nfree, budget;
+
+	coremap_get_watermarks(&low, &high, &nfree);
+	(void)low;
+	if (nfree <= high) {
+		return BUFCACHE_MIN_BUFS;
+	}
+	budget = bc_stats.bs_nbufs + (nfree - high) / 2 * BC_BUFS_PER_FRAME;
+	if (budget < BUFCACHE_MIN_BUFS) {
+		budget = BUFCACHE_MIN_BUFS;
+	}
+	return budget < BUFCACHE_MAX_BUFS ? budget : BUFCACHE_MAX_BUFS;
+#else
+	return BUFCACHE_MAX_BUFS;
+#endif
+}
+
+static
+struct buf *
+bc_lookup(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = bc_hash[bc_hashfn(dev, block)]; b != NULL; b = b->b_hnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+bc_lru_remove(struct buf *b)
+{
+	if (b->b_prev != NULL) {
+		b->b_prev->b_next = b->b_next;
+	}
+	else {
+		bc_mru = b->b_next;
+	}
+	if (b->b_next != NULL) {
+		b->b_next->b_prev = b->b_prev;
+	}
+	else {
+		bc_lru = b->b_prev;
+	}
+	b->b_prev = b->b_next = NULL;
+}
+
+static
+void
+bc_lru_push(struct buf *b)
+{
+	b->b_prev = NULL;
+	b->b_next = bc_mru;
+	if (bc_mru != NULL) {
+		bc_mru->b_prev = b;
+	}
+	else {
+		bc_lru = b;
+	}
+	bc_mru = b;
+}
+
+static
+void
+bc_touch(struct buf *b)
+{
+	if (bc_mru != b) {
+		bc_lru_remove(b);
+		bc_lru_push(b);
+	}
+}
+
+/*
+ * Toglie il buffer dalla tabella hash e dalla lista LRU.
+ */
+static
+void
+bc_unlink(struct buf *b)
+{
+	struct buf **p;
+
+	KASSERT(!b->b_busy && !b->b_dirty);
+	for (p = &bc_hash[bc_hashfn(b->b_dev, b->b_block)]; *p != b;
+	     p = &(*p)->b_hnext) {
+		KASSERT(*p != NULL);
+	}
+	*p = b->b_hnext;
+	b->b_hnext = NULL;
+	bc_lru_remove(b);
+}
+
+static
+void
+bc_free(struct buf *b)
+{
+	kfree(b->b_data);
+	kfree(b);
+	bc_stats.bs_nbufs--;
+}
+
+/*
+ * Scrive sul disco un buffer sporco, rilasciando bc_lock durante il
+ * trasferimento. Se la scrittura fallisce il buffer resta sporco.
+ */
+static
+int
+bc_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_dirty && !b->b_busy);
+	b->b_busy = true;
+	b->b_dirty = false;
+	bc_stats.bs_ndirty--;
+	lock_release(bc_lock);
+
+	result = bc_devio(b->b_dev, b->b_block, b->b_data, UIO_WRITE);
+
+	lock_acquire(bc_lock);
+	b->b_busy = false;
+	if (result) {
+		b->b_dirty = true;
+		bc_stats.bs_ndirty++;
+	}
+	else {
+		bc_stats.bs_writebacks++;
+	}
+	cv_broadcast(bc_cv, bc_lock);
+	return result;
+}
+
+/*
+ * Toglie dalla cache il buffer usato meno di recente tra quelli non
+ * busy e lo restituisce tramite ret (NULL se sono tutti busy). Se il
+ * buffer è sporco viene prima scritto sul disco: in tal caso bc_lock è
+ * stato rilasciato e viene restituito EAGAIN, perché il chiamante deve
+ * ripetere le proprie ricerche.
+ */
+static
+int
+bc_reclaim(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	*ret = NULL;
+	for (b = bc_lru; b != NULL && b->b_busy; b = b->b_prev) {
+		/* nulla */
+	}
+	if (b == NULL) {
+		return 0;
+	}
+	if (b->b_dirty) {
+		result = bc_writeback(b);
+		return result ? result : EAGAIN;
+	}
+	bc_unlink(b);
+	bc_stats.bs_evictions++;
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Procura un buffer per il blocco block di dev, allocandone uno nuovo
+ * se il budget lo consente o riutilizzando quello usato meno di
+ * recente, e lo inserisce nella cache non ancora valido. *ret è NULL
+ * se la cache non ha memoria né buffer riutilizzabili; EAGAIN indica
+ * che bc_lock è stato rilasciato.
+ */
+static
+int
+bc_alloc(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b = NULL;
+	int result;
+
+	if (bc_stats.bs_nbufs < bc_budget()) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUFCACHE_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+			else {
+				bc_stats.bs_nbufs++;
+			}
+		}
+	}
+	if (b == NULL) {
+		result = bc_reclaim(&b);
+		if (result) {
+			*ret = NULL;
+			return result == EAGAIN ? EAGAIN : 0;
+		}
+		if (b == NULL) {
+			*ret = NULL;
+			return 0;
+		}
+	}
+
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = b->b_dirty = b->b_busy = b->b_ra = false;
+	b->b_hnext = bc_hash[bc_hashfn(dev, block)];
+	bc_hash[bc_hashfn(dev, block)] = b;
+	bc_lru_push(b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Dopo una scrittura eseguita direttamente sul disco, senza bc_lock:
+ * nel frattempo un altro thread può aver inserito in cache il blocco
+ * leggendone il contenuto precedente. Il buffer viene rimosso, a meno
+ * che sia sporco, cioè scritto dopo di noi.
+ */
+static
+void
+bc_drop_stale(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(bc_lock));
+	while ((b = bc_lookup(dev, block)) != NULL && b->b_busy) {
+		cv_wait(bc_cv, bc_lock);
+	}
+	if (b != NULL && !b->b_dirty) {
+		bc_unlink(b);
+		bc_free(b);
+	}
+}
+
+int
+bufcache_read(struct device *dev, daddr_t block, void *data)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFCACHE_BLOCKSIZE);
+
+	lock_acquire(bc_lock);
+ again:
+	b = bc_lookup(dev, block);
+	if (b != NULL) {
+		if (!b->b_valid) {
+			/* un altro thread lo sta leggendo */
+			cv_wait(bc_cv, bc_lock);
+			goto again;
+		}
+		bc_stats.bs_hits++;
+		if (b->b_ra) {
+			b->b_ra = false;
+			bc_stats.bs_prefetch_hits++;
+		}
+		memcpy(data, b->b_data, BUFCACHE_BLOCKSIZE);
+		bc_touch(b);
+		lock_release(bc_lock);
+		return 0;
+	}
+
+	result = bc_alloc(dev, block, &b);
+	if (result == EAGAIN) {
+		goto again;
+	}
+	if (b == NULL) {
+		bc_stats.bs_uncached++;
+		lock_release(bc_lock);
+		return bc_devio(dev, block, data, UIO_READ);
+	}
+	bc_stats.bs_misses++;
+
+	b->b_busy = true;
+	lock_release(bc_lock);
+	result = bc_devio(dev, block, b->b_data, UIO_READ);
+	lock_acquire(bc_lock);
+	b->b_busy = false;
+	cv_broadcast(bc_cv, bc_lock);
+	if (result) {
+		bc_unlink(b);
+		bc_free(b);
+		lock_release(bc_lock);
+		return result;
+	}
+	b->b_valid = true;
+	memcpy(data, b->b_data, BUFCACHE_BLOCKSIZE);
+	lock_release(bc_lock);
+	return 0;
+}
+
+int
+bufcache_write(struct device *dev, daddr_t block, const void *data)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFCACHE_BLOCKSIZE);
+
+	lock_acquire(bc_lock);
+ again:
+	b = bc_lookup(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(bc_cv, bc_lock);
+			goto again;
+		}
+		bc_stats.bs_hits++;
+	}
+	else {
+		result = bc_alloc(dev, block, &b);
+		if (result == EAGAIN) {
+			goto again;
+		}
+		if (b == NULL) {
+			bc_stats.bs_uncached++;
+			lock_release(bc_lock);
+			result = bc_devio(dev, block, (void *)data, UIO_WRITE);
+			lock_acquire(bc_lock);
+			bc_drop_stale(dev, block);
+			lock_release(bc_lock);
+			return result;
+		}
+		bc_stats.bs_misses++;
+	}
+
+	/* il blocco viene sovrascritto per intero: non serve leggerlo */
+	memcpy(b->b_data, data, BUFCACHE_BLOCKSIZE);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		bc_stats.bs_ndirty++;
+	}
+	bc_touch(b);
+	lock_release(bc_lock);
+	return 0;
+}
+
+/*
+ * Legge dal disco n buffer di blocchi contigui con un'unica operazione.
+ * Non ripete gli errori: chi richiederà i blocchi li leggerà di nuovo.
+ */
+static
+int
+bc_devio_run(struct device *dev, struct buf **bufs, unsigned n)
+{
+	struct iovec iov[BC_RA_MAXIOV];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(n <= BC_RA_MAXIOV);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = BUFCACHE_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)bufs[0]->b_block * BUFCACHE_BLOCKSIZE;
+	ku.uio_resid = n * BUFCACHE_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	return DEVOP_IO(dev, &ku);
+}
+
+/*
+ * Serve una richiesta di read-ahead: inserisce in cache come busy i
+ * blocchi mancanti e li legge a gruppi di blocchi contigui, rendendo
+ * disponibile ogni gruppo appena letto.
+ */
+static
+void
+bc_prefetch(struct device *dev, const daddr_t *blocks, unsigned n)
+{
+	struct buf *bufs[BUFCACHE_RA_MAX], *b;
+	unsigned i, j, run, nbufs = 0;
+	int result;
+
+	i = 0;
+	while (i < n) {
+		if (bc_lookup(dev, blocks[i]) != NULL) {
+			i++;
+			continue;
+		}
+		result = bc_alloc(dev, blocks[i], &b);
+		if (result == EAGAIN) {
+			continue;
+		}
+		if (b == NULL) {
+			break;
+		}
+		b->b_busy = true;
+		b->b_ra = true;
+		bufs[nbufs++] = b;
+		i++;
+	}
+
+	for (i = 0; i < nbufs; i += run) {
+		for (run = 1; i + run < nbufs && run < BC_RA_MAXIOV &&
+			     bufs[i + run]->b_block == bufs[i]->b_block + run;
+		     run++) {
+			/* nulla */
+		}
+		lock_release(bc_lock);
+		result = bc_devio_run(dev, bufs + i, run);
+		lock_acquire(bc_lock);
+		for (j = i; j < i + run; j++) {
+			bufs[j]->b_busy = false;
+			if (result) {
+				bc_unlink(bufs[j]);
+				bc_free(bufs[j]);
+			}
+			else {
+				bufs[j]->b_valid = true;
+				bc_stats.bs_prefetched++;
+			}
+		}
+		cv_broadcast(bc_cv, bc_lock);
+	}
+}
+
+static
+void
+bc_readahead_thread(void *unused1, unsigned long unused2)
+{
+	struct bc_rareq req;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(bc_lock);
+	for (;;) {
+		while (bc_ranum == 0) {
+			cv_wait(bc_racv, bc_lock);
+		}
+		req = bc_raq[bc_rafirst];
+		bc_rafirst = (bc_rafirst + 1) % BC_RA_QUEUE;
+		bc_ranum--;
+		bc_prefetch(req.rr_dev, req.rr_blocks, req.rr_n);
+	}
+}
+
+void
+bufcache_readahead(struct device *dev, const daddr_t *blocks, unsigned n)
+{
+	struct bc_rareq *req;
+
+	KASSERT(n <= BUFCACHE_RA_MAX);
+	if (n == 0) {
+		return;
+	}
+
+	lock_acquire(bc_lock);
+	if (bc_ra_running && bc_ranum < BC_RA_QUEUE) {
+		req = &bc_raq[(bc_rafirst + bc_ranum) % BC_RA_QUEUE];
+		req->rr_dev = dev;
+		req->rr_n = n;
+		memcpy(req->rr_blocks, blocks, n * sizeof(daddr_t));
+		bc_ranum++;
+		cv_signal(bc_racv, bc_lock);
+	}
+	lock_release(bc_lock);
+}
+
+/*
+ * Scrive i buffer sporchi di dev (di tutti i dispositivi se dev è
+ * NULL), dal meno recente. Se wait è impostato ritorna solo quando non
+ * ci sono più buffer sporchi né trasferimenti in corso per dev.
+ */
+static
+int
+bc_flush(struct device *dev, bool wait)
+{
+	struct buf *b;
+	bool busy, dirty;
+	int result;
+
+	for (;;) {
+		/*
+		 * Dopo bc_writeback il buffer è ancora nella lista, perché
+		 * era busy: si può proseguire da b->b_prev.
+		 */
+		for (b = bc_lru; b != NULL; b = b->b_prev) {
+			if ((dev == NULL || b->b_dev == dev) &&
+			    b->b_dirty && !b->b_busy) {
+				result = bc_writeback(b);
+				if (result) {
+					return result;
+				}
+			}
+		}
+		if (!wait) {
+			return 0;
+		}
+
+		busy = dirty = false;
+		for (b = bc_lru; b != NULL; b = b->b_prev) {
+			if (dev == NULL || b->b_dev == dev) {
+				busy = busy || b->b_busy;
+				dirty = dirty || b->b_dirty;
+			}
+		}
+		if (busy) {
+			cv_wait(bc_cv, bc_lock);
+		}
+		else if (!dirty) {
+			return 0;
+		}
+	}
+}
+
+int
+bufcache_sync(struct device *dev)
+{
+	int result;
+
+	lock_acquire(bc_lock);
+	result = bc_flush(dev, true);
+	lock_release(bc_lock);
+	return result;
+}
+
+void
+bufcache_invalidate(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+
+	lock_acquire(bc_lock);
+
+	/* le richieste di read-ahead in coda per dev non vanno più servite */
+	for (i = 0; i < bc_ranum; i++) {
+		if (bc_raq[(bc_rafirst + i) % BC_RA_QUEUE].rr_dev == dev) {
+			bc_raq[(bc_rafirst + i) % BC_RA_QUEUE].rr_n = 0;
+		}
+	}
+ again:
+	for (b = bc_mru; b != NULL; b = next) {
+		next = b->b_next;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(bc_cv, bc_lock);
+			goto again;
+		}
+		bc_unlink(b);
+		bc_free(b);
+	}
+	lock_release(bc_lock);
+}
+
+void
+bufcache_purge(void)
+{
+	struct buf *b, *next;
+
+	lock_acquire(bc_lock);
+	for (b = bc_mru; b != NULL; b = next) {
+		next = b->b_next;
+		if (!b->b_busy && !b->b_dirty) {
+			bc_unlink(b);
+			bc_free(b);
+		}
+	}
+	lock_release(bc_lock);
+}
+
+/*
+ * Libera i buffer oltre il budget, dal meno recente.
+ */
+static
+void
+bc_shrink(void)
+{
+	struct buf *b;
+	int result;
+
+	while (bc_stats.bs_nbufs > bc_budget()) {
+		result = bc_reclaim(&b);
+		if (result == EAGAIN) {
+			continue;
+		}
+		if (result || b == NULL) {
+			break;
+		}
+		bc_free(b);
+	}
+}
+
+/*
+ * Flusher: ogni secondo riporta la cache entro il budget, ogni
+ * BUFCACHE_FLUSH_SECS secondi scrive i buffer sporchi. Gli errori di
+ * scrittura lasciano i buffer sporchi, che verranno riprovati al giro
+ * successivo.
+ */
+static
+void
+bc_flusher(void *unused1, unsigned long unused2)
+{
+	unsigned secs = 0;
+
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		clocksleep(1);
+		lock_acquire(bc_lock);
+		if (++secs == BUFCACHE_FLUSH_SECS) {
+			secs = 0;
+			bc_flush(NULL, false);
+		}
+		bc_shrink();
+		lock_release(bc_lock);
+	}
+}
+
+void
+bufcache_getstats(struct bufcache_stats *stats)
+{
+	lock_acquire(bc_lock);
+	*stats = bc_stats;
+	stats->bs_budget = bc_budget();
+	lock_release(bc_lock);
+}
+
+void
+bufcache_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	bc_lock = lock_create("bufcache");
+	bc_cv = cv_create("bufcache");
+	bc_racv = cv_create("bufcache-ra");
+	bc_hash = kmalloc(BC_HASH_SIZE * sizeof(struct buf *));
+	if (bc_lock == NULL || bc_cv == NULL || bc_racv == NULL ||
+	    bc_hash == NULL) {
+		panic("bufcache_bootstrap: Out of memory\n");
+	}
+	for (i = 0; i < BC_HASH_SIZE; i++) {
+		bc_hash[i] = NULL;
+	}
+	bc_mru = bc_lru = NULL;
+
+	/* la cache funziona anche senza flusher: i buffer vengono scritti da bufcache_sync */
+	result = thread_fork("bufflush", NULL, bc_flusher, NULL, 0);
+	if (result) {
+		kprintf("bufcache: Cannot start the flusher: %s\n",
+			strerror(result));
+	}
+
+	/* senza il thread le richieste di read-ahead vengono ignorate */
+	bc_rafirst = bc_ranum = 0;
+	result = thread_fork("bufra", NULL, bc_readahead_thread, NULL, 0);
+	if (result) {
+		kprintf("bufcache: Cannot start read-ahead: %s\n",
+			strerror(result));
+	}
+	else {
+		bc_ra_running = true;
+	}
+}
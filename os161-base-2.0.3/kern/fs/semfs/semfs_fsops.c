@@ -189,6 +189,7 @@ semfs_create(void)
 
 	semfs->semfs_absfs.fs_data = semfs;
 	semfs->semfs_absfs.fs_ops = &semfs_fsops;
+	semfs->semfs_absfs.fs_dcache = false;
 	return semfs;
 
  fail_dirlock:
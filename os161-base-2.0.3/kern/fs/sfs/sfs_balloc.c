@@ -33,8 +33,10 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -52,40 +54,242 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 }
 
 /*
- * Allocate a block.
+ * Find a free block, starting from GOAL if it is given and otherwise
+ * from where the last search left off, and mark it in use. Starting
+ * from the cursor rather than from block 0 keeps the search from
+ * rescanning the full part of the disk every time.
  */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_bfind(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
 {
+	unsigned block;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+
+	if (goal == 0 || goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = sfs->sfs_alloccursor;
+	}
+	result = bitmap_find_clear(sfs->sfs_freemap, goal, &block);
 	if (result) {
 		return result;
 	}
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
+	bitmap_mark(sfs->sfs_freemap, block);
 	sfs->sfs_freemapdirty = true;
+	sfs->sfs_alloccursor = (block + 1) % sfs->sfs_sb.sb_nblocks;
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
-		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Reserve for SV up to SFS_RESERVE_BLOCKS free blocks starting at
+ * START. Reserved blocks are in use as far as other allocations are
+ * concerned, but are not written to disk as such.
+ */
+static
+void
+sfs_breserve(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t start)
+{
+	daddr_t block;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+	KASSERT(sv->sv_rescount == 0);
+
+	for (block = start; block < sfs->sfs_sb.sb_nblocks &&
+		     block - start < SFS_RESERVE_BLOCKS; block++) {
+		if (bitmap_isset(sfs->sfs_freemap, block)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, block);
+		bitmap_mark(sfs->sfs_resmap, block);
+	}
+	sv->sv_resblock = start;
+	sv->sv_rescount = block - start;
+	if (block > start) {
+		sfs->sfs_alloccursor = block % sfs->sfs_sb.sb_nblocks;
 	}
+}
+
+/*
+ * Give back the blocks reserved for SV.
+ */
+static
+void
+sfs_dounreserve(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+
+	for (; sv->sv_rescount > 0; sv->sv_rescount--, sv->sv_resblock++) {
+		bitmap_unmark(sfs->sfs_resmap, sv->sv_resblock);
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_resblock);
+	}
+}
+
+/*
+ * The disk is full: give back the blocks reserved for every loaded
+ * vnode so that they can be allocated after all. Returns the number
+ * of blocks given back. The caller must not hold sfs_fslock.
+ */
+static
+unsigned
+sfs_unreserve_all(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i, count = 0;
+
+	KASSERT(!lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!lock_do_i_hold(sfs->sfs_fslock));
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_fslock);
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hnext) {
+			count += sv->sv_rescount;
+			sfs_dounreserve(sfs, sv);
+		}
+	}
+	lock_release(sfs->sfs_fslock);
+	lock_release(sfs->sfs_vnlock);
+	return count;
+}
+
+/*
+ * Allocate a block, as close after GOAL as possible (0 for no
+ * preference).
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_fslock);
+	result = sfs_bfind(sfs, goal, diskblock);
+	lock_release(sfs->sfs_fslock);
+	if (result == ENOSPC && sfs_unreserve_all(sfs) > 0) {
+		lock_acquire(sfs->sfs_fslock);
+		result = sfs_bfind(sfs, goal, diskblock);
+		lock_release(sfs->sfs_fslock);
+	}
+	if (result) {
+		return result;
+	}
+
+	/* Clear block before returning it; nobody else can see it yet */
+	result = sfs_clearblock(sfs, *diskblock);
+	if (result) {
+		sfs_bfree(sfs, *diskblock);
+	}
+	return result;
+}
+
+/*
+ * Allocate a block of file SV, which wants it at GOAL: the block
+ * after the previous block of the file, or 0 if there is none (a
+ * sparse write). A file that keeps asking for the next block is being
+ * written sequentially; it is given blocks out of its reservation,
+ * and reserves the blocks following each new run it starts.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_fslock);
+	if (sv->sv_rescount > 0 && goal == sv->sv_resblock) {
+		/* Next block of the reservation; now really in use */
+		*diskblock = sv->sv_resblock++;
+		sv->sv_rescount--;
+		bitmap_unmark(sfs->sfs_resmap, *diskblock);
+		sfs->sfs_freemapdirty = true;
+	}
+	else {
+		sfs_dounreserve(sfs, sv);
+		result = sfs_bfind(sfs, goal, diskblock);
+		if (result == ENOSPC) {
+			/* Try again with the other files' reservations */
+			lock_release(sfs->sfs_fslock);
+			if (sfs_unreserve_all(sfs) == 0) {
+				return result;
+			}
+			lock_acquire(sfs->sfs_fslock);
+			result = sfs_bfind(sfs, goal, diskblock);
+		}
+		if (result) {
+			lock_release(sfs->sfs_fslock);
+			return result;
+		}
+		if (goal != 0) {
+			sfs_breserve(sfs, sv, *diskblock + 1);
+		}
+	}
+	lock_release(sfs->sfs_fslock);
 
-	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
 
+/*
+ * Give back the blocks reserved for SV, when it is truncated or
+ * nobody has it open any more.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_fslock);
+	sfs_dounreserve(sfs, sv);
+	lock_release(sfs->sfs_fslock);
+}
+
+/*
+ * Clear (HIDE true) or set again the freemap bits of reserved blocks,
+ * around writing the freemap to disk: a reservation does not survive
+ * a crash, so the blocks must be free on disk.
+ */
+void
+sfs_bhidereserved(struct sfs_fs *sfs, bool hide)
+{
+	uint8_t *freemap, *resmap;
+	uint32_t i, nbytes;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+
+	freemap = bitmap_getdata(sfs->sfs_freemap);
+	resmap = bitmap_getdata(sfs->sfs_resmap);
+	nbytes = SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks) / CHAR_BIT;
+	for (i=0; i<nbytes; i++) {
+		if (hide) {
+			freemap[i] &= ~resmap[i];
+		}
+		else {
+			freemap[i] |= resmap[i];
+		}
+	}
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	lock_acquire(sfs->sfs_fslock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_fslock);
 }
 
 /*
@@ -94,10 +298,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_fslock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_fslock);
+	return result;
 }
 
@@ -36,9 +36,13 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Allocation goal following block B, or none if B is not allocated */
+#define SFS_NEXTBLOCK(b) ((b) == 0 ? 0 : (b) + 1)
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -49,25 +53,17 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* I/O buffer for handling indirect blocks; covered by sv_lock. */
+	uint32_t *idbuf = sv->sv_idbuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
 	daddr_t idblock;
+	daddr_t goal;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +78,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/*
+			 * Put the block after the previous one, or
+			 * after the inode for the first block.
+			 */
+			if (fileblock == 0) {
+				goal = sv->sv_ino + 1;
+			}
+			else {
+				goal = SFS_NEXTBLOCK(sv->sv_i.sfi_direct[fileblock-1]);
+			}
+			result = sfs_balloc_file(sv, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -143,7 +149,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		goal = SFS_NEXTBLOCK(sv->sv_i.sfi_direct[SFS_NDIRECT-1]);
+		result = sfs_balloc_file(sv, goal, &idblock);
 		if (result) {
 			return result;
 		}
@@ -155,13 +162,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		sv->sv_dirty = true;
 
 		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		bzero(idbuf, SFS_BLOCKSIZE);
 	}
 	else {
 		/*
 		 * We already have an indirect block allocated; load it.
 		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_readblock(sfs, idblock, idbuf, SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
@@ -172,7 +179,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		if (idoff == 0) {
+			goal = idblock + 1;
+		}
+		else {
+			goal = SFS_NEXTBLOCK(idbuf[idoff-1]);
+		}
+		result = sfs_balloc_file(sv, goal, &block);
 		if (result) {
 			return result;
 		}
@@ -181,7 +194,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		idbuf[idoff] = block;
 
 		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_writeblock(sfs, idblock, idbuf, SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
@@ -198,19 +211,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim, with sv_lock held.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* I/O buffer for handling the indirect block. */
+	uint32_t *idbuf = sv->sv_idbuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
@@ -223,9 +230,10 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Any reservation followed the old last block; give it back */
+	sfs_bunreserve(sv);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -253,9 +261,8 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_readblock(sfs, idblock, idbuf, SFS_BLOCKSIZE);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 
@@ -283,9 +290,8 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		else if (iddirty) {
 			/* The indirect block is dirty; write it back */
 			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+						SFS_BLOCKSIZE);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
 		}
@@ -297,7 +303,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
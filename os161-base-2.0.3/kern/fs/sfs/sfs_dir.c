@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -95,6 +96,421 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+//
+// See kern/sfs.h for the on-disk layout. Everything here is called
+// with the directory's sv_lock held. Index blocks are read and
+// written whole through the buffer cache; the buffers they need are
+// too big for the kernel stack and live in a struct sfs_dirctx
+// allocated for each operation.
+
+struct sfs_dirctx {
+	struct sfs_dirindex dc_index;	/* the index block */
+	struct sfs_dirindex dc_old;	/* the index block before a rebuild */
+	struct sfs_dirbucket dc_bucket;	/* a bucket or free-slot block */
+	struct sfs_direntry dc_entry;	/* a directory entry */
+	bool dc_dirty;			/* dc_index needs to be written */
+};
+
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= SFS_DIRHASH_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Read a bucket block. Its count is checked, as sfsck does, so that a
+ * damaged block cannot make us walk off the end of sdb_entries; the
+ * callers then mark the index stale, and it gets rebuilt.
+ */
+static
+int
+sfs_readbucket(struct sfs_fs *sfs, daddr_t block, struct sfs_dirbucket *db)
+{
+	int result;
+
+	result = sfs_readblock(sfs, block, db, sizeof(*db));
+	if (result) {
+		return result;
+	}
+	if (db->sdb_count == 0 || db->sdb_count > SFS_DIRBUCKET_NENTRIES) {
+		kprintf("sfs: %s: directory index block %u: invalid count "
+			"%u\n", sfs->sfs_sb.sb_volname, block,
+			db->sdb_count);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Add (HASH, SLOT) to the chain starting at *HEADP, in the first block
+ * with room or in a new block put at the head of the chain.
+ */
+static
+int
+sfs_dirchain_add(struct sfs_fs *sfs, struct sfs_dirctx *ctx, uint32_t *headp,
+		 uint32_t hash, uint32_t slot)
+{
+	struct sfs_dirbucket *db = &ctx->dc_bucket;
+	daddr_t block, newblock;
+	int result;
+
+	for (block = *headp; block != 0; block = db->sdb_next) {
+		result = sfs_readbucket(sfs, block, db);
+		if (result) {
+			return result;
+		}
+		if (db->sdb_count < SFS_DIRBUCKET_NENTRIES) {
+			db->sdb_entries[db->sdb_count].sdbe_hash = hash;
+			db->sdb_entries[db->sdb_count].sdbe_slot = slot;
+			db->sdb_count++;
+			return sfs_writeblock(sfs, block, db, sizeof(*db));
+		}
+	}
+
+	/* Keep the chain's blocks together */
+	result = sfs_balloc(sfs, *headp, &newblock);
+	if (result) {
+		return result;
+	}
+	bzero(db, sizeof(*db));
+	db->sdb_next = *headp;
+	db->sdb_count = 1;
+	db->sdb_entries[0].sdbe_hash = hash;
+	db->sdb_entries[0].sdbe_slot = slot;
+	result = sfs_writeblock(sfs, newblock, db, sizeof(*db));
+	if (result) {
+		sfs_bfree(sfs, newblock);
+		return result;
+	}
+	*headp = newblock;
+	ctx->dc_dirty = true;
+	return 0;
+}
+
+/*
+ * Remove the entry for SLOT from the chain starting at *HEADP, freeing
+ * its block if it becomes empty.
+ */
+static
+int
+sfs_dirchain_remove(struct sfs_fs *sfs, struct sfs_dirctx *ctx,
+		    uint32_t *headp, uint32_t slot)
+{
+	struct sfs_dirbucket *db = &ctx->dc_bucket;
+	daddr_t block, prev, next;
+	unsigned i;
+	int result;
+
+	prev = 0;
+	for (block = *headp; block != 0; prev = block, block = db->sdb_next) {
+		result = sfs_readbucket(sfs, block, db);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<db->sdb_count; i++) {
+			if (db->sdb_entries[i].sdbe_slot == slot) {
+				break;
+			}
+		}
+		if (i == db->sdb_count) {
+			continue;
+		}
+
+		/* Found; move the last entry into its place. */
+		db->sdb_count--;
+		db->sdb_entries[i] = db->sdb_entries[db->sdb_count];
+		if (db->sdb_count > 0) {
+			return sfs_writeblock(sfs, block, db, sizeof(*db));
+		}
+
+		/* The block is empty; unlink it from the chain. */
+		next = db->sdb_next;
+		if (prev == 0) {
+			*headp = next;
+			ctx->dc_dirty = true;
+		}
+		else {
+			result = sfs_readbucket(sfs, prev, db);
+			if (result) {
+				return result;
+			}
+			db->sdb_next = next;
+			result = sfs_writeblock(sfs, prev, db, sizeof(*db));
+			if (result) {
+				return result;
+			}
+		}
+		sfs_bfree(sfs, block);
+		return 0;
+	}
+	return ENOENT;
+}
+
+/*
+ * Take any slot off the chain starting at *HEADP.
+ */
+static
+int
+sfs_dirchain_pop(struct sfs_fs *sfs, struct sfs_dirctx *ctx, uint32_t *headp,
+		 uint32_t *slot)
+{
+	struct sfs_dirbucket *db = &ctx->dc_bucket;
+	daddr_t block = *headp;
+	int result;
+
+	if (block == 0) {
+		return ENOENT;
+	}
+	result = sfs_readbucket(sfs, block, db);
+	if (result) {
+		return result;
+	}
+	db->sdb_count--;
+	*slot = db->sdb_entries[db->sdb_count].sdbe_slot;
+	if (db->sdb_count > 0) {
+		return sfs_writeblock(sfs, block, db, sizeof(*db));
+	}
+	*headp = db->sdb_next;
+	ctx->dc_dirty = true;
+	sfs_bfree(sfs, block);
+	return 0;
+}
+
+/*
+ * Free all the blocks of the chain starting at HEAD.
+ */
+static
+int
+sfs_dirchain_free(struct sfs_fs *sfs, struct sfs_dirctx *ctx, daddr_t head)
+{
+	struct sfs_dirbucket *db = &ctx->dc_bucket;
+	daddr_t block;
+	int result;
+
+	while (head != 0) {
+		result = sfs_readbucket(sfs, head, db);
+		if (result) {
+			return result;
+		}
+		block = head;
+		head = db->sdb_next;
+		sfs_bfree(sfs, block);
+	}
+	return 0;
+}
+
+/*
+ * Rebuild an out-of-date index from the directory entries. The index
+ * block is first written with empty chains and the stale flag set, so
+ * that if we fail partway it is neither trusted nor pointing at blocks
+ * we have freed.
+ */
+static
+int
+sfs_dirindex_rebuild(struct sfs_vnode *sv, struct sfs_dirctx *ctx)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *di = &ctx->dc_index;
+	struct sfs_direntry *sd = &ctx->dc_entry;
+	uint32_t hash;
+	int i, nentries, result;
+
+	ctx->dc_old = *di;
+	bzero(di, sizeof(*di));
+	di->sdi_magic = SFS_DIRIDX_MAGIC;
+	di->sdi_flags = SFS_DIRIDX_STALE;
+	result = sfs_writeblock(sfs, sv->sv_i.sfi_dirindex, di, sizeof(*di));
+	if (result) {
+		return result;
+	}
+
+	/* Errors here only leak blocks, which sfsck will find. */
+	for (i=0; i<SFS_DIRIDX_NBUCKETS; i++) {
+		sfs_dirchain_free(sfs, ctx, ctx->dc_old.sdi_buckets[i]);
+	}
+	sfs_dirchain_free(sfs, ctx, ctx->dc_old.sdi_freeslots);
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, sd);
+		if (result) {
+			return result;
+		}
+		if (sd->sfd_ino == SFS_NOINO) {
+			result = sfs_dirchain_add(sfs, ctx, &di->sdi_freeslots,
+						  0, i);
+		}
+		else {
+			sd->sfd_name[sizeof(sd->sfd_name)-1] = 0;
+			hash = sfs_dirhash(sd->sfd_name);
+			result = sfs_dirchain_add(sfs, ctx,
+				&di->sdi_buckets[hash % SFS_DIRIDX_NBUCKETS],
+				hash, i);
+		}
+		if (result) {
+			return result;
+		}
+	}
+
+	di->sdi_flags = 0;
+	di->sdi_dirsize = sv->sv_i.sfi_size;
+	ctx->dc_dirty = true;
+	return 0;
+}
+
+/*
+ * Write back the index block if it changed. If the operation failed,
+ * mark the index stale instead, since it may no longer match the
+ * directory.
+ */
+static
+void
+sfs_dirindex_close(struct sfs_vnode *sv, struct sfs_dirctx *ctx, int error)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *di = &ctx->dc_index;
+	int result;
+
+	if (error) {
+		di->sdi_flags |= SFS_DIRIDX_STALE;
+		ctx->dc_dirty = true;
+	}
+	else if (di->sdi_dirsize != sv->sv_i.sfi_size) {
+		di->sdi_dirsize = sv->sv_i.sfi_size;
+		ctx->dc_dirty = true;
+	}
+	if (ctx->dc_dirty) {
+		result = sfs_writeblock(sfs, sv->sv_i.sfi_dirindex, di,
+					sizeof(*di));
+		if (result) {
+			kprintf("sfs: %s: directory %u: cannot write index: "
+				"%s\n", sfs->sfs_sb.sb_volname, sv->sv_ino,
+				strerror(result));
+		}
+	}
+	kfree(ctx);
+}
+
+/*
+ * Load the index of a directory, rebuilding it if it is out of date.
+ * Hands back NULL if the directory has no usable index and must be
+ * searched linearly.
+ */
+static
+int
+sfs_dirindex_open(struct sfs_vnode *sv, struct sfs_dirctx **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirctx *ctx;
+	struct sfs_dirindex *di;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	*ret = NULL;
+	if (sv->sv_i.sfi_dirindex == 0 ||
+	    (sfs->sfs_sb.sb_features & SFS_FEATURE_DIRINDEX) == 0) {
+		return 0;
+	}
+
+	ctx = kmalloc(sizeof(*ctx));
+	if (ctx == NULL) {
+		return ENOMEM;
+	}
+	ctx->dc_dirty = false;
+	di = &ctx->dc_index;
+
+	result = sfs_readblock(sfs, sv->sv_i.sfi_dirindex, di, sizeof(*di));
+	if (result) {
+		kfree(ctx);
+		return result;
+	}
+	if (di->sdi_magic != SFS_DIRIDX_MAGIC) {
+		/* Not an index we know; sfsck will sort it out. */
+		kfree(ctx);
+		return 0;
+	}
+
+	if ((di->sdi_flags & SFS_DIRIDX_STALE) ||
+	    di->sdi_dirsize != sv->sv_i.sfi_size) {
+		result = sfs_dirindex_rebuild(sv, ctx);
+		if (result) {
+			kprintf("sfs: %s: directory %u: cannot rebuild "
+				"index: %s\n", sfs->sfs_sb.sb_volname,
+				sv->sv_ino, strerror(result));
+			sfs_dirindex_close(sv, ctx, result);
+			return 0;
+		}
+	}
+
+	*ret = ctx;
+	return 0;
+}
+
+/*
+ * Look up NAME through the index.
+ */
+static
+int
+sfs_dirindex_find(struct sfs_vnode *sv, struct sfs_dirctx *ctx,
+		  const char *name, uint32_t *ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirbucket *db = &ctx->dc_bucket;
+	struct sfs_direntry *sd = &ctx->dc_entry;
+	uint32_t hash;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	hash = sfs_dirhash(name);
+	block = ctx->dc_index.sdi_buckets[hash % SFS_DIRIDX_NBUCKETS];
+	for (; block != 0; block = db->sdb_next) {
+		result = sfs_readbucket(sfs, block, db);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<db->sdb_count; i++) {
+			if (db->sdb_entries[i].sdbe_hash != hash) {
+				continue;
+			}
+			if (db->sdb_entries[i].sdbe_slot >=
+			    (unsigned)sfs_dir_nentries(sv)) {
+				return EINVAL;
+			}
+			result = sfs_readdir(sv, db->sdb_entries[i].sdbe_slot,
+					     sd);
+			if (result) {
+				return result;
+			}
+			sd->sfd_name[sizeof(sd->sfd_name)-1] = 0;
+			if (sd->sfd_ino != SFS_NOINO &&
+			    !strcmp(sd->sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = db->sdb_entries[i].sdbe_slot;
+				}
+				if (ino != NULL) {
+					*ino = sd->sfd_ino;
+				}
+				return 0;
+			}
+		}
+	}
+	return ENOENT;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -104,9 +520,23 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dirctx *ctx;
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	if (emptyslot == NULL) {
+		result = sfs_dirindex_open(sv, &ctx);
+		if (result) {
+			return result;
+		}
+		if (ctx != NULL) {
+			result = sfs_dirindex_find(sv, ctx, name, ino, slot);
+			sfs_dirindex_close(sv, ctx,
+					   result == ENOENT ? 0 : result);
+			return result;
+		}
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -146,6 +576,69 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * sfs_dir_link for a directory with an index: the index says whether
+ * the name exists and where there is a free slot.
+ */
+static
+int
+sfs_dir_link_indexed(struct sfs_vnode *sv, struct sfs_dirctx *ctx,
+		     const char *name, uint32_t ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *di = &ctx->dc_index;
+	struct sfs_direntry *sd = &ctx->dc_entry;
+	uint32_t hash, freeslot;
+	int result;
+
+	result = sfs_dirindex_find(sv, ctx, name, NULL, NULL);
+	if (result != ENOENT) {
+		sfs_dirindex_close(sv, ctx, result);
+		return result==0 ? EEXIST : result;
+	}
+
+	if (strlen(name)+1 > sizeof(sd->sfd_name)) {
+		sfs_dirindex_close(sv, ctx, 0);
+		return ENAMETOOLONG;
+	}
+
+	/* Reuse a free slot if there is one, else add at the end. */
+	result = sfs_dirchain_pop(sfs, ctx, &di->sdi_freeslots, &freeslot);
+	if (result == ENOENT) {
+		freeslot = sfs_dir_nentries(sv);
+	}
+	else if (result == 0 && freeslot >= (unsigned)sfs_dir_nentries(sv)) {
+		result = EINVAL;
+	}
+	if (result && result != ENOENT) {
+		sfs_dirindex_close(sv, ctx, result);
+		return result;
+	}
+
+	bzero(sd, sizeof(*sd));
+	sd->sfd_ino = ino;
+	strcpy(sd->sfd_name, name);
+	result = sfs_writedir(sv, freeslot, sd);
+	if (result) {
+		sfs_dirindex_close(sv, ctx, result);
+		return result;
+	}
+	if (slot) {
+		*slot = freeslot;
+	}
+
+	/*
+	 * The entry is in place. If indexing it fails, the index gets
+	 * marked stale and rebuilt next time; the link still worked.
+	 */
+	hash = sfs_dirhash(name);
+	result = sfs_dirchain_add(sfs, ctx,
+				  &di->sdi_buckets[hash % SFS_DIRIDX_NBUCKETS],
+				  hash, freeslot);
+	sfs_dirindex_close(sv, ctx, result);
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -156,6 +649,15 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_dirctx *ctx;
+
+	result = sfs_dirindex_open(sv, &ctx);
+	if (result) {
+		return result;
+	}
+	if (ctx != NULL) {
+		return sfs_dir_link_indexed(sv, ctx, name, ino, slot);
+	}
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -195,14 +697,51 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct sfs_direntry sd;
+	struct sfs_dirctx *ctx;
+	uint32_t hash;
+	int result;
+
+	result = sfs_dirindex_open(sv, &ctx);
+	if (result) {
+		return result;
+	}
+	if (ctx != NULL) {
+		/* Get the name, to know which bucket the slot is in */
+		result = sfs_readdir(sv, slot, &ctx->dc_entry);
+		if (result) {
+			sfs_dirindex_close(sv, ctx, 0);
+			return result;
+		}
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (ctx == NULL) {
+		return result;
+	}
+	if (result) {
+		sfs_dirindex_close(sv, ctx, 0);
+		return result;
+	}
+
+	ctx->dc_entry.sfd_name[sizeof(ctx->dc_entry.sfd_name)-1] = 0;
+	hash = sfs_dirhash(ctx->dc_entry.sfd_name);
+	result = sfs_dirchain_remove(sfs, ctx,
+			&ctx->dc_index.sdi_buckets[hash % SFS_DIRIDX_NBUCKETS],
+			slot);
+	if (result == 0) {
+		result = sfs_dirchain_add(sfs, ctx,
+					  &ctx->dc_index.sdi_freeslots,
+					  0, slot);
+	}
+	sfs_dirindex_close(sv, ctx, result);
+	return 0;
 }
 
 /*
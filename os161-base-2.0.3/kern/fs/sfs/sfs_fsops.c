@@ -40,7 +40,9 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <vfs.h>
+#include <synch.h>
 #include <device.h>
+#include <bufcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -73,7 +75,9 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
 	char *freemapdata;
-	int result;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
 
 	/* Number of blocks in the free block bitmap. */
 	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
@@ -81,6 +85,11 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
+	/* Blocks reserved for writers are still free on disk */
+	if (rw == UIO_WRITE) {
+		sfs_bhidereserved(sfs, true);
+	}
+
 	/* For each block in the free block bitmap... */
 	for (j=0; j<freemapblocks; j++) {
 
@@ -99,28 +108,64 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-	return 0;
+
+	if (rw == UIO_WRITE) {
+		sfs_bhidereserved(sfs, false);
+	}
+	return result;
 }
 
 /*
  * Sync routine for the vnode table.
+ *
+ * VOP_FSYNC takes the vnode lock, which comes before sfs_vnlock, so
+ * take a reference to each loaded vnode under sfs_vnlock and sync
+ * them after releasing it. Inactive vnodes were synced when they
+ * became inactive.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct sfs_vnode *sv;
+	struct vnode *v;
 	unsigned i, num;
+	int result = 0;
+
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	for (i=0; i<SFS_VNHASH_SIZE && result==0; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hnext) {
+			if (sv->sv_inactive) {
+				continue;
+			}
+			result = vnodearray_add(vnodes, &sv->sv_absvn, NULL);
+			if (result) {
+				break;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	num = vnodearray_num(vnodes);
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+		v = vnodearray_get(vnodes, i);
 		VOP_FSYNC(v);
+		VOP_DECREF(v);
 	}
-	return 0;
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return result;
 }
 
 /*
@@ -130,17 +175,18 @@ static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
-	int result;
+	int result = 0;
 
+	lock_acquire(sfs->sfs_fslock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
-		if (result) {
-			return result;
+		if (result == 0) {
+			sfs->sfs_freemapdirty = false;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_fslock);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -150,17 +196,18 @@ static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
-	int result;
+	int result = 0;
 
+	lock_acquire(sfs->sfs_fslock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
-		if (result) {
-			return result;
+		if (result == 0) {
+			sfs->sfs_superdirty = false;
 		}
-		sfs->sfs_superdirty = false;
 	}
-	return 0;
+	lock_release(sfs->sfs_fslock);
+	return result;
 }
 
 /*
@@ -174,8 +221,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +256,27 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/* Everything above went to the buffer cache; now write it out. */
+	result = bufcache_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +290,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes while mounted; no lock needed. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +305,12 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_resmap != NULL) {
+		bitmap_destroy(sfs->sfs_resmap);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	lock_destroy(sfs->sfs_fslock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -270,7 +318,8 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 /*
  * Unmount code.
  *
- * VFS calls FS_SYNC on the filesystem prior to unmounting it.
+ * VFS calls FS_SYNC on the filesystem prior to unmounting it, and
+ * holds the VFS lock, so nobody can look up new files on it.
  */
 static
 int
@@ -278,18 +327,22 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_ninactive) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	sfs_inactive_purge(sfs);
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Drop our blocks from the buffer cache; sfs_sync wrote them. */
+	bufcache_invalidate(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +350,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -342,6 +394,7 @@ sfs_fs_create(void)
 	/* abstract vfs-level fs */
 	sfs->sfs_absfs.fs_data = sfs;
 	sfs->sfs_absfs.fs_ops = &sfs_fsops;
+	sfs->sfs_absfs.fs_dcache = true;
 
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
@@ -351,17 +404,31 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
-	}
+	bzero(sfs->sfs_vnhash, sizeof(sfs->sfs_vnhash));
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lrufirst = sfs->sfs_lrulast = NULL;
+	sfs->sfs_ninactive = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
+	sfs->sfs_resmap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_alloccursor = 0;
+
+	/* locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
+	sfs->sfs_fslock = lock_create("sfs_fslock");
+	if (sfs->sfs_fslock == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	return sfs;
 
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,7 +455,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -402,7 +468,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +475,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -421,22 +485,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		bufcache_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Make some simple sanity checks */
 
-	if (sfs->sfs_sb.sb_magic != SFS_MAGIC) {
+	if (sfs->sfs_sb.sb_magic != SFS_MAGIC &&
+	    sfs->sfs_sb.sb_magic != SFS_MAGIC_FEATURES) {
 		kprintf("sfs: Wrong magic number in superblock "
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		bufcache_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	/* A plain SFS_MAGIC volume predates sb_features */
+	if (sfs->sfs_sb.sb_magic == SFS_MAGIC) {
+		sfs->sfs_sb.sb_features = 0;
+	}
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unsupported features in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		bufcache_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -450,24 +528,26 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_resmap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_resmap == NULL) {
+		bufcache_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
+	lock_acquire(sfs->sfs_fslock);
 	result = sfs_freemapio(sfs, UIO_READ);
+	lock_release(sfs->sfs_fslock);
 	if (result) {
+		bufcache_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
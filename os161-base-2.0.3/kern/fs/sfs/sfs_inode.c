@@ -36,12 +36,14 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
  * Write an on-disk inode structure back out to disk.
+ * The caller holds sv_lock.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +51,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,25 +64,209 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * Allocate the in-memory parts of a vnode: the structure, its lock
+ * and its I/O buffers.
+ */
+static
+struct sfs_vnode *
+sfs_vnode_create(void)
+{
+	struct sfs_vnode *sv;
+
+	sv = kmalloc(sizeof(struct sfs_vnode));
+	if (sv == NULL) {
+		return NULL;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	sv->sv_iobuf = kmalloc(SFS_BLOCKSIZE);
+	sv->sv_idbuf = kmalloc(SFS_BLOCKSIZE);
+	if (sv->sv_lock == NULL || sv->sv_iobuf == NULL ||
+	    sv->sv_idbuf == NULL) {
+		if (sv->sv_lock != NULL) {
+			lock_destroy(sv->sv_lock);
+		}
+		kfree(sv->sv_iobuf);
+		kfree(sv->sv_idbuf);
+		kfree(sv);
+		return NULL;
+	}
+	return sv;
+}
+
+/*
+ * Free the in-memory parts of a vnode that is not (or no longer) in
+ * the vnode table.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
+	kfree(sv->sv_idbuf);
+	kfree(sv->sv_iobuf);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
+/*
+ * Vnode table. The caller holds sfs_vnlock.
+ */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASH_SIZE]; sv != NULL;
+	     sv = sv->sv_hnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned bucket = sv->sv_ino % SFS_VNHASH_SIZE;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv->sv_hnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (p = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASH_SIZE]; *p != sv;
+	     p = &(*p)->sv_hnext) {
+		if (*p == NULL) {
+			panic("sfs: %s: vnode %u not in vnode table\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+	}
+	*p = sv->sv_hnext;
+	sv->sv_hnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Inactive list. The caller holds sfs_vnlock.
+ */
+static
+void
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_inactive);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lrufirst = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrulast = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_inactive = false;
+	sfs->sfs_ninactive--;
+}
+
+static
+void
+sfs_inactive_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_inactive);
+
+	sv->sv_lruprev = NULL;
+	sv->sv_lrunext = sfs->sfs_lrufirst;
+	if (sfs->sfs_lrufirst != NULL) {
+		sfs->sfs_lrufirst->sv_lruprev = sv;
+	}
+	else {
+		sfs->sfs_lrulast = sv;
+	}
+	sfs->sfs_lrufirst = sv;
+	sv->sv_inactive = true;
+	sfs->sfs_ninactive++;
+}
+
+/*
+ * Free the least recently used inactive vnode. Inactive vnodes have
+ * been synced and nobody can reach them without sfs_vnlock, so there
+ * is nothing to write and no vnode lock to take.
+ */
+static
+void
+sfs_inactive_evict(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv = sfs->sfs_lrulast;
+
+	KASSERT(sv != NULL);
+	KASSERT(!sv->sv_dirty);
+
+	sfs_inactive_remove(sfs, sv);
+	sfs_vntable_remove(sfs, sv);
+	vnode_cleanup(&sv->sv_absvn);
+	sfs_vnode_destroy(sv);
+}
+
+/*
+ * Free all the inactive vnodes, on unmount.
+ */
+void
+sfs_inactive_purge(struct sfs_fs *sfs)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	while (sfs->sfs_ninactive > 0) {
+		sfs_inactive_evict(sfs);
+	}
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
  * This function should try to avoid returning errors other than EBUSY.
+ *
+ * When we get here nobody else holds sv_lock, since that takes a
+ * reference. Holding sfs_vnlock keeps sfs_loadvnode from handing out
+ * a new reference while we decide.
+ *
+ * A vnode that still has links is kept on the inactive list, together
+ * with the reference we were handed, rather than freed.
  */
 int
 sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,16 +276,21 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/* Nobody is writing the file any more */
+	sfs_bunreserve(sv);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
@@ -105,38 +298,35 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	/* Still linked: keep it around in case it's wanted again */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		if (sfs->sfs_ninactive >= SFS_INACTIVE_MAX) {
+			sfs_inactive_evict(sfs);
+		}
+		sfs_inactive_add(sfs, sv);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return 0;
 	}
 
+	/* No on-disk references, so discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_destroy(sv);
 
 	/* Done */
 	return 0;
@@ -144,47 +334,45 @@ sfs_reclaim(struct vnode *v)
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. The caller holds sfs_vnlock.
  */
+static
 int
-sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
-		 struct sfs_vnode **ret)
+sfs_doloadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_inactive) {
+			/* Take over the reference it was parked with */
+			sfs_inactive_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = sfs_vnode_create();
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +386,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		sfs_vnode_destroy(sv);
 		return result;
 	}
 
@@ -235,26 +423,40 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_destroy(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_raoffset = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_resblock = 0;
+	sv->sv_rescount = 0;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_inactive = false;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vntable_add(sfs, sv);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
+int
+sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		 struct sfs_vnode **ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_doloadvnode(sfs, ino, forcetype, ret);
+	lock_release(sfs->sfs_vnlock);
+	return result;
+}
+
 /*
  * Create a new filesystem object and hand back its vnode.
  */
@@ -269,7 +471,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +498,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -37,7 +37,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <vfs.h>
+#include <synch.h>
 #include <device.h>
+#include <bufcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -53,23 +55,25 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block through the buffer cache, which retries I/O
+ * errors. Writes only update the cache; the block reaches the disk
+ * when the cache is synced or flushed.
  */
 static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_rwblock(struct sfs_fs *sfs, daddr_t block, void *data, enum uio_rw rw)
 {
 	int result;
-	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	DEBUG(DB_SFS, "sfs: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", block);
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
-
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
+	if (rw == UIO_READ) {
+		result = bufcache_read(sfs->sfs_device, block, data);
+	}
+	else {
+		result = bufcache_write(sfs->sfs_device, block, data);
+	}
 	if (result == EINVAL) {
 		/*
 		 * This means the sector we requested was out of range,
@@ -80,23 +84,8 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		      sfs->sfs_sb.sb_volname);
 	}
 	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
+		kprintf("sfs: %s: block %u I/O error\n",
+			sfs->sfs_sb.sb_volname, block);
 	}
 	return result;
 }
@@ -107,13 +96,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
-
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	return sfs_rwblock(sfs, block, data, UIO_READ);
 }
 
 /*
@@ -122,13 +107,9 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
-
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	return sfs_rwblock(sfs, block, data, UIO_WRITE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,14 +131,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	/* I/O buffer for handling partial sectors; covered by sv_lock. */
+	char *iobuf = sv->sv_iobuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
@@ -169,8 +144,8 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* We're using the vnode's buffer; it had better be locked */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -187,13 +162,13 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		bzero(iobuf, SFS_BLOCKSIZE);
 	}
 	else {
 		/*
 		 * Read the block.
 		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = sfs_readblock(sfs, diskblock, iobuf, SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
@@ -211,7 +186,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * If it was a write, write back the modified block.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = sfs_writeblock(sfs, diskblock, iobuf, SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
@@ -227,15 +202,17 @@ static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
+	/* Buffer for copying in and out of the cache; covered by sv_lock. */
+	char *iobuf = sv->sv_iobuf;
+
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+
+	/* We're using the vnode's buffer; it had better be locked */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,31 +235,126 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache, so that whole-block and partial
+	 * I/O see the same copy of the block. A whole-block write does
+	 * not need to read the block first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_readblock(sfs, diskblock, iobuf, SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		return uiomove(iobuf, SFS_BLOCKSIZE, uio);
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = uiomove(iobuf, SFS_BLOCKSIZE, uio);
+	if (result) {
+		return result;
+	}
+	return sfs_writeblock(sfs, diskblock, iobuf, SFS_BLOCKSIZE);
+}
 
-	result = sfs_rwblock(sfs, uio);
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Largest read-ahead window, in blocks. It is read once per call to
+ * sfs_readahead, which copes with it changing in between.
+ */
+static volatile unsigned sfs_ramax = SFS_RA_MAX;
 
-	return result;
+int
+sfs_set_readahead(unsigned maxblocks)
+{
+	if (maxblocks > SFS_RA_MAX) {
+		return EINVAL;
+	}
+	sfs_ramax = maxblocks;
+	return 0;
+}
+
+unsigned
+sfs_get_readahead(void)
+{
+	return sfs_ramax;
+}
+
+/*
+ * Called before reading LEN bytes at byte offset POS. A read that
+ * starts at the byte where the previous one on the same vnode ended
+ * is sequential; any other read resets the window. (Comparing byte
+ * offsets rather than block numbers keeps small sequential reads
+ * within one block from looking like a seek.) When less than half a
+ * window is left ahead of the reader, ask the buffer cache to fetch
+ * the next window asynchronously, including the blocks being read now
+ * so that they too come in with large transfers, and double the
+ * window.
+ *
+ * The state lives in the vnode, not in the open file, so two readers
+ * interleaving on the same file look random to each other.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t blocks[BUFCACHE_RA_MAX];
+	daddr_t diskblock;
+	uint32_t first, last, fileblock, end, fileblocks;
+	unsigned n = 0, ramax = sfs_ramax;
+	bool sequential;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(len > 0);
+
+	sequential = pos == sv->sv_raoffset;
+	sv->sv_raoffset = pos + len;
+	if (!sequential || ramax == 0) {
+		sv->sv_raend = 0;
+		sv->sv_rawindow = 0;
+		return;
+	}
+	first = pos / SFS_BLOCKSIZE;
+	last = (pos + len - 1) / SFS_BLOCKSIZE;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MIN;
+	}
+	if (sv->sv_rawindow > ramax) {
+		sv->sv_rawindow = ramax;
+	}
+	if (sv->sv_raend >= last + 1 + sv->sv_rawindow / 2) {
+		/* Still far enough ahead */
+		return;
+	}
+
+	fileblock = sv->sv_raend > first ? sv->sv_raend : first;
+	end = last + 1 + sv->sv_rawindow;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+	if (end > fileblock + BUFCACHE_RA_MAX) {
+		end = fileblock + BUFCACHE_RA_MAX;
+	}
+
+	for (; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		/* Holes read as zeros and need no I/O */
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	sv->sv_raend = fileblock;
+	bufcache_readahead(sfs->sfs_device, blocks, n);
+
+	sv->sv_rawindow *= 2;
+	if (sv->sv_rawindow > ramax) {
+		sv->sv_rawindow = ramax;
+	}
 }
 
 /*
@@ -317,6 +389,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio->uio_offset, uio->uio_resid);
+		}
 	}
 
 	/*
@@ -414,17 +490,11 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
+	/* I/O buffer for metadata ops; covered by sv_lock. */
+	char *metaiobuf = sv->sv_iobuf;
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* We're using the vnode's buffer; it had better be locked */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -447,7 +517,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	}
 
 	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	result = sfs_readblock(sfs, diskblock, metaiobuf, SFS_BLOCKSIZE);
 	if (result) {
 		return result;
 	}
@@ -462,7 +532,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 
 		/* Write the block back */
 		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
+					metaiobuf, SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
@@ -39,6 +39,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <vfs.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -90,6 +91,97 @@ sfs_eachopendir(struct vnode *v, int openflags)
 	return 0;
 }
 
+/*
+ * Do I/O between a file and a user buffer without holding sv_lock
+ * while the user buffer is touched. Touching it can fault, and the
+ * fault handler pages in from the executable with VOP_READ, which
+ * takes the sv_lock of that file: if it were this file the lock would
+ * be taken recursively, and two threads faulting on each other's files
+ * would deadlock. So each chunk goes through a kernel buffer, which is
+ * copied to or from the user buffer with no lock held and to or from
+ * the file under sv_lock. A transfer larger than SFS_BOUNCESIZE is
+ * therefore not atomic with respect to other I/O on the file.
+ */
+static
+int
+sfs_userio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len;
+	off_t pos;
+	int result = 0;
+
+	buf = kmalloc(SFS_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		/*
+		 * Take each chunk from a single iovec, so that a short
+		 * write can be given back below.
+		 */
+		while (uio->uio_iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			KASSERT(uio->uio_iovcnt > 0);
+		}
+		len = uio->uio_iov->iov_len;
+		if (len > (size_t)uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+		pos = uio->uio_offset;
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			if (ku.uio_resid > 0) {
+				/* Give back what did not reach the file. */
+				uio->uio_iov->iov_ubase -= ku.uio_resid;
+				uio->uio_iov->iov_len += ku.uio_resid;
+				uio->uio_resid += ku.uio_resid;
+				uio->uio_offset -= ku.uio_resid;
+				break;
+			}
+			if (result) {
+				break;
+			}
+		}
+		else {
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			len -= ku.uio_resid;
+			if (len > 0) {
+				/* Pass on what was read even on error. */
+				int result2 = uiomove(buf, len, uio);
+				if (result == 0) {
+					result = result2;
+				}
+			}
+			if (result || ku.uio_resid > 0) {
+				/* error or EOF */
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -102,9 +194,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -121,9 +217,13 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -164,8 +264,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -185,16 +287,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes while the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -224,9 +323,9 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -250,8 +349,13 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,37 +393,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -329,20 +432,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
-	*ret = &newguy->sv_absvn;
+	/* Forget any cached negative entry for the name */
+	vfs_dcache_invalidate(v, name);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+
+	*ret = &newguy->sv_absvn;
 	return 0;
 }
 
@@ -361,27 +469,31 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
+	KASSERT(f != sv);
+
+	/* Directory first, then the file (see sfs.h) */
+	lock_acquire(sv->sv_lock);
+	lock_acquire(f->sv_lock);
 
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		/* and update the link count, marking the inode dirty */
+		f->sv_i.sfi_linkcount++;
+		f->sv_dirty = true;
 	}
+	lock_release(f->sv_lock);
 
-	/* and update the link count, marking the inode dirty */
-	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	if (result == 0) {
+		vfs_dcache_invalidate(dir, name);
+	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sv->sv_lock);
+	return result;
 }
 
 /*
@@ -396,31 +508,80 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	/* The directory itself can't be removed this way */
+	if (victim == sv) {
+		lock_release(sv->sv_lock);
+		VOP_DECREF(&victim->sv_absvn);
+		return EINVAL;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
+
+		vfs_dcache_invalidate(dir, name);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the victim, which takes its lock: do it unlocked.
+	 */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Lock the two directories involved in a rename. To avoid deadlock
+ * against another rename going the other way, the one with the lower
+ * inode number is always locked first. Since we don't support
+ * subdirectories the two are currently always the same, and then
+ * there is only one lock to take.
+ */
+static
+void
+sfs_lock_dirpair(struct sfs_vnode *d1, struct sfs_vnode *d2)
+{
+	if (d1 == d2) {
+		lock_acquire(d1->sv_lock);
+	}
+	else if (d1->sv_ino < d2->sv_ino) {
+		lock_acquire(d1->sv_lock);
+		lock_acquire(d2->sv_lock);
+	}
+	else {
+		lock_acquire(d2->sv_lock);
+		lock_acquire(d1->sv_lock);
+	}
+}
+
+static
+void
+sfs_unlock_dirpair(struct sfs_vnode *d1, struct sfs_vnode *d2)
+{
+	if (d1 != d2) {
+		lock_release(d2->sv_lock);
+	}
+	lock_release(d1->sv_lock);
+}
+
 /*
  * Rename a file.
  *
@@ -438,15 +599,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	sfs_lock_dirpair(sv, d2->vn_data);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_unlock_dirpair(sv, d2->vn_data);
 		return result;
 	}
 
@@ -461,6 +622,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * the new name doesn't already exist; might as well use the
 	 * existing link routine.
 	 */
+	lock_acquire(g1->sv_lock);
 	result = sfs_dir_link(sv, n2, g1->sv_ino, &slot2);
 	if (result) {
 		goto puke;
@@ -484,10 +646,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	lock_release(g1->sv_lock);
+
+	vfs_dcache_invalidate(d1, n1);
+	vfs_dcache_invalidate(d2, n2);
+
+	sfs_unlock_dirpair(sv, d2->vn_data);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -505,9 +673,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	sfs_unlock_dirpair(sv, d2->vn_data);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -525,15 +695,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +707,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +724,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
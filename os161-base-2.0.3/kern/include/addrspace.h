@@ -78,10 +78,8 @@ struct addrspace {
 #elif OPT_PAGING
 
     struct segment segments[N_SEGMENTS]; /* tabella dei segmenti */
-    union {
-        int index; /* indice utilizzato durante il caricamento dei segmenti */
-        int ignore_permissions; /* indica se ignorare i permessi*/
-    };
+    int index; /* indice utilizzato durante il caricamento dei segmenti */
+    int ignore_permissions; /* indica se ignorare i permessi, solo durante il caricamento dal file ELF */
 
     struct vnode *file; /* file ELF nel quale sono presenti i segmenti */
 
@@ -89,6 +87,10 @@ struct addrspace {
 
     struct pt *page_table; /* tabella delle pagine */
 
+    uint32_t asid; /* address space ID con cui vengono marcate le entry della TLB */
+    uint32_t asid_generation; /* generazione a cui appartiene asid, 0 se non ancora assegnato */
+    unsigned int asid_cpu; /* cpu su cui è stato assegnato asid */
+
 #endif
 
 };
@@ -143,7 +145,11 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
- *    load_page - carica la pagina contenente l'indirizzo user vaddr.
+ *    load_page - carica dal file ELF la pagina contenente l'indirizzo user vaddr nel frame di indirizzo fisico frame, tramite il suo
+ *                indirizzo kernel.
+ *
+ *    as_page_file_size - ritorna quanti byte della pagina contenente l'indirizzo user vaddr vengono letti dal file ELF da load_page:
+ *                        0 per le pagine anonime (stack e BSS), PAGE_SIZE se l'intera pagina viene sovrascritta.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -179,7 +185,8 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
 #if OPT_PAGING
 
-int load_page(struct addrspace *as, vaddr_t vaddr);
+int load_page(struct addrspace *as, vaddr_t vaddr, paddr_t frame);
+unsigned int as_page_file_size(struct addrspace *as, vaddr_t vaddr);
 
 int load_segment(struct addrspace *as, struct vnode *v,
 	     off_t offset, vaddr_t vaddr,
@@ -0,0 +1,78 @@
+#ifndef _BUFCACHE_H_
+#define _BUFCACHE_H_
+
+#include <types.h>
+
+struct device;
+
+#define BUFCACHE_BLOCKSIZE 512	/* dimensione dei blocchi in cache (SFS_BLOCKSIZE) */
+#define BUFCACHE_MIN_BUFS  32	/* buffer sempre ammessi, anche sotto pressione */
+#define BUFCACHE_MAX_BUFS  1024	/* limite massimo della cache (512 KB) */
+#define BUFCACHE_FLUSH_SECS 5	/* intervallo tra due scritture dei buffer sporchi da parte del flusher */
+#define BUFCACHE_RA_MAX    32	/* blocchi al più in una richiesta di read-ahead */
+
+/**
+ *
+ * Buffer cache dei blocchi dei dischi, indicizzata dalla coppia (dispositivo, blocco) tramite una tabella hash.
+ * I buffer sono collegati in una lista in ordine di utilizzo: quando la cache ha raggiunto il proprio budget viene
+ * riutilizzato il buffer usato meno di recente (LRU). Le scritture sono write-back: il blocco viene scritto sul disco
+ * da bufcache_sync, dal flusher (un thread del kernel che ogni BUFCACHE_FLUSH_SECS secondi scrive i buffer sporchi)
+ * oppure quando il buffer viene scelto per essere riutilizzato.
+ *
+ * Il budget dipende dai frame liberi della coremap: la cache cresce finché ci sono frame liberi oltre la soglia alta del
+ * pageout daemon e, quando i frame liberi scendono sotto tale soglia, il flusher la riduce a BUFCACHE_MIN_BUFS buffer.
+ *
+ * Le operazioni di I/O avvengono senza il lock della cache: durante il trasferimento il buffer è marcato busy e chi lo
+ * richiede attende su una condition variable.
+ *
+ * Il read-ahead è asincrono: le richieste vengono accodate e servite da un thread del kernel, che inserisce in cache
+ * i blocchi mancanti e li legge raggruppando i blocchi contigui in un'unica operazione di I/O. Un blocco richiesto
+ * mentre il read-ahead lo sta leggendo viene atteso invece di essere letto una seconda volta.
+ *
+ * Functions:
+ *     bufcache_bootstrap - Alloca la tabella hash e le strutture di sincronizzazione e avvia il flusher e il thread del
+ *                        read-ahead.
+ *
+ *     bufcache_read - Copia in data il contenuto del blocco block di dev, leggendolo dal disco se non è in cache.
+ *
+ *     bufcache_write - Copia data nel buffer del blocco block di dev e lo marca sporco; se la cache non può allocare un
+ *                      buffer il blocco viene scritto direttamente sul disco.
+ *
+ *     bufcache_readahead - Accoda la lettura degli n blocchi blocks di dev, se non sono già in cache, e ritorna senza
+ *                          attenderla. Se la coda è piena la richiesta viene scartata.
+ *
+ *     bufcache_sync - Scrive sul disco i buffer sporchi di dev (di tutti i dispositivi se dev è NULL).
+ *
+ *     bufcache_invalidate - Rimuove dalla cache i buffer di dev, che non devono essere sporchi: va invocata dopo
+ *                           bufcache_sync, quando il file system viene smontato.
+ *
+ *     bufcache_purge - Rimuove dalla cache tutti i buffer puliti, ad esempio per misurare le prestazioni del disco a
+ *                      cache fredda.
+ *
+ *     bufcache_getstats - Restituisce le statistiche della cache.
+ *
+ */
+
+struct bufcache_stats {
+	unsigned long long bs_hits;		/* letture e scritture servite da un buffer presente */
+	unsigned long long bs_misses;		/* blocchi non presenti in cache */
+	unsigned long long bs_writebacks;	/* buffer sporchi scritti sul disco */
+	unsigned long long bs_evictions;	/* buffer riutilizzati o liberati per rispettare il budget */
+	unsigned long long bs_uncached;		/* operazioni eseguite direttamente sul disco per mancanza di memoria */
+	unsigned long long bs_prefetched;	/* blocchi letti dal read-ahead */
+	unsigned long long bs_prefetch_hits;	/* blocchi letti dal read-ahead e poi richiesti */
+	unsigned bs_nbufs;			/* buffer presenti */
+	unsigned bs_ndirty;			/* buffer sporchi */
+	unsigned bs_budget;			/* buffer ammessi in questo momento */
+};
+
+void bufcache_bootstrap(void);
+int bufcache_read(struct device *dev, daddr_t block, void *data);
+int bufcache_write(struct device *dev, daddr_t block, const void *data);
+void bufcache_readahead(struct device *dev, const daddr_t *blocks, unsigned n);
+int bufcache_sync(struct device *dev);
+void bufcache_invalidate(struct device *dev);
+void bufcache_purge(void);
+void bufcache_getstats(struct bufcache_stats *stats);
+
+#endif /* _BUFCACHE_H_ */
@@ -0,0 +1,67 @@
+#ifndef _CM_POLICY_H_
+#define _CM_POLICY_H_
+
+#include <types.h>
+struct cm_entry;
+
+/**
+ *
+ * Politiche di sostituzione delle pagine utilizzate dalla coremap per scegliere il frame vittima dello swap-out.
+ * Ogni politica è descritta da una struct cm_policy contenente il nome con cui può essere selezionata e le funzioni
+ * invocate dalla coremap, sempre con coremap_lock acquisito:
+ *
+ *     activate - Invocata quando la politica diventa attiva, per ricostruire il proprio stato a partire dalla coremap.
+ *
+ *     select_victim - Restituisce l'indice del frame da cui effettuare lo swap-out, -1 se nessun frame è adatto.
+ *                     Deve scegliere solo frame per cui CM_EVICTABLE sia vero.
+ *
+ *     on_access - La pagina contenuta nel frame index è stata caricata in TLB.
+ *
+ *     on_alloc - Il frame index ha iniziato a contenere una pagina user.
+ *
+ *     on_free - Il frame index ha smesso di contenere la sua pagina user (rilascio oppure scelta come vittima).
+ *
+ * Le politiche disponibili sono:
+ *
+ *     fifo - Viene scelta la pagina caricata in memoria da più tempo, i frame sono collegati in ordine di allocazione tramite
+ *            i campi next e prev della cm_entry, inutilizzati dal buddy allocator finché il frame è occupato.
+ *
+ *     clock - Second chance, preferendo le pagine pulite che possono essere scartate senza scriverle nello swap file.
+ *
+ *     lru - Approssimazione di LRU: i frame sono collegati, come in fifo, in ordine di ultimo caricamento in TLB; la pagina
+ *           in testa alla lista ancora referenziata riceve una seconda possibilità e viene spostata in coda.
+ *
+ *     random - Viene scelta una pagina a caso.
+ *
+ */
+
+struct cm_policy {
+    const char* name;
+    void (*activate)(struct cm_entry* coremap, unsigned int npages);
+    int (*select_victim)(struct cm_entry* coremap, unsigned int npages);
+    void (*on_access)(struct cm_entry* coremap, unsigned int index);
+    void (*on_alloc)(struct cm_entry* coremap, unsigned int index);
+    void (*on_free)(struct cm_entry* coremap, unsigned int index);
+};
+
+// i frame interni a un blocco hanno nframes = 0, in tal caso si avanza di un frame
+#define CM_STEP(coremap, i) ((coremap)[i].nframes ? (coremap)[i].nframes : 1)
+
+// il frame contiene una pagina user, di un solo address space oppure condivisa copy-on-write?
+#define CM_USER(coremap, i) ((coremap)[i].pt_entry != NULL || (coremap)[i].sharers != NULL)
+
+// il frame contiene una pagina user che può essere scelta come vittima?
+#define CM_EVICTABLE(coremap, i) ((coremap)[i].occ && !(coremap)[i].fixed && (coremap)[i].pins == 0 && CM_USER(coremap, i))
+
+// la pagina contenuta nel frame user i è sporca? Le pagine che condividono un frame sono tutte pulite o tutte sporche
+#define CM_DIRTY(coremap, i) \
+    ((coremap)[i].pt_entry != NULL ? (coremap)[i].pt_entry->dirty : (coremap)[i].sharers->entry->dirty)
+
+extern const struct cm_policy cm_policy_fifo;
+extern const struct cm_policy cm_policy_clock;
+extern const struct cm_policy cm_policy_lru;
+extern const struct cm_policy cm_policy_random;
+
+extern const struct cm_policy* const cm_policies[]; /* terminato da NULL */
+
+#endif
@@ -3,6 +3,11 @@
 
 #include <types.h>
 struct pt_entry;
+
+#define CM_MAX_ORDER 19 /* ordine massimo di un blocco del buddy allocator (2^19 frame) */
+#define CM_NO_FRAME (-1)
+#define CM_NO_SLOT (-1)
+
 /**
  *
  * Array di cm_entry cioè una struttura dati contenente informazioni riguardanti il relativo frame. Ogni elemento dell'array rappresentra lo stato del corrispettivo frame.
@@ -10,13 +15,30 @@ struct pt_entry;
  * Nel caso in cui un processo kernel richieda di allocare un blocco contiguo di frame, il primo elemento del blocco contiguo conterrà la dimensione del blocco.
  * Lo stesso ragionamento viene applicato per i blocchi contigui di frame liberi.
  *
+ * I frame liberi sono gestiti da un buddy allocator: ogni blocco libero ha dimensione 2^order frame ed è allineato (rispetto al primo frame
+ * gestibile) alla propria dimensione. I blocchi liberi dello stesso ordine sono collegati in una lista doppiamente concatenata tramite i campi
+ * next e prev, in modo che allocazione e rilascio costino O(log n) e la fusione dei blocchi liberi avvenga solo con il blocco "buddy".
+ *
  */
 
+struct cm_sharer {
+    struct pt_entry* entry;        /* pagina che condivide il frame copy-on-write */
+    struct cm_sharer* next;
+};
+
 struct cm_entry {
     uint32_t occ : 1;      /* indica se il frame sia occupato o meno */
     uint32_t fixed : 1;    /* indica se si possa effettuare swap-out del frame */
     uint32_t nframes : 20; /* quanti frame contigui a questo sono stati allocati o sono liberi */
+    uint32_t order : 5;    /* ordine del blocco libero di cui il frame è in testa */
+    uint32_t ref : 1;      /* bit di riferimento software, impostato a ogni caricamento in TLB della pagina contenuta */
+    uint16_t refs;         /* pagine di address space diversi che condividono il frame copy-on-write; se maggiore di 1 pt_entry è NULL */
+    uint16_t pins;         /* fault in corso sulle pagine che condividono il frame: finché è diverso da 0 il frame non è swappable */
+    struct cm_sharer* sharers;    /* pagine che condividono il frame copy-on-write, NULL se il frame non è condiviso */
     struct pt_entry* pt_entry;    /* entry della Page Table che contiene questo frame, tale campo è diverso da NULL se il frame corrispondente appartiene a un address space */
+    int32_t swap_slot;     /* porzione dello swap file che contiene una copia aggiornata della pagina pulita contenuta nel frame, CM_NO_SLOT se assente */
+    int32_t next;          /* blocco libero successivo dello stesso ordine, CM_NO_FRAME se assente; se il frame è occupato può essere usato dalla politica di sostituzione */
+    int32_t prev;          /* blocco libero precedente dello stesso ordine, CM_NO_FRAME se assente; se il frame è occupato può essere usato dalla politica di sostituzione */
 };
 
 /**
@@ -27,13 +49,27 @@ struct cm_entry {
  *
  *     coremap_bootstrap - Inizializza la struttura, il parametro firstpaddr rappresenta l'indirizzo fisico dell'inizio del primo frame libero.
  *
- *     get_user_frame -  Restituisce l'indirizzo fisico dell'inizio di un frame libero.
+ *     get_user_frame -  Restituisce tramite il parametro frame l'indirizzo fisico dell'inizio di un frame libero.
  *                       Nel caso nessun frame sia libero, effettua lo swap-out di un frame vittima. Una volta trovato, il corrispettivo elemento nell’array coremap conterrà il valore descritto dal parametro entry.
+ *                       Se zero è vero il frame viene restituito azzerato, preferendo quelli del pool mantenuto dal thread pagezero; altrimenti il
+ *                       chiamante ne sovrascrive l'intero contenuto (swap-in, copia, pagina interamente caricata dal file ELF).
+ *                       Se non esistono né frame liberi né vittime, ma alcuni frame user sono temporaneamente non swappable (fault o swap-out
+ *                       in corso), attende su una wait channel che un frame venga liberato o reso swappable.
+ *                       Ritorna 0 se non si verificano errori, ENOSPC se il file di swap è pieno, ENOMEM se nessun frame può essere liberato.
+ *
+ *     get_free_user_frame - Come get_user_frame, senza azzerare il frame e senza effettuare swap-out: restituisce 0 se nessun frame è libero.
  *
- *     get_kernel_frame - Restituisce l'indirizzo fisico dell'inizio del blocco di frame liberi contigui di dimensione num.
+ *     get_kernel_frame - Restituisce l'indirizzo fisico dell'inizio del blocco di frame liberi contigui e azzerati di dimensione num.
  *                        Nel caso in cui il parametro num valga 1, e non vi siano frame liberi, viene effettuato lo swap-out di un frame vittima.
+ *                        Come get_user_frame attende che un frame venga liberato o reso swappable, ma solo se il chiamante può dormire
+ *                        (nessuno spinlock acquisito, fuori da un interrupt handler); ritorna 0 se il blocco non può essere allocato.
  *
- *     free_frame - Marca il frame o la sequenza di frame contigui, che iniziano dall'indirizzo fisico addr, come liberi. Durante questa fase gli interrupt vengono disabilitati per garantire l’atomicità dell’operazione.
+ *     free_frame - Marca il frame o la sequenza di frame contigui, che iniziano dall'indirizzo fisico addr, come liberi, restituendoli al buddy allocator e fondendoli con i rispettivi buddy liberi.
+ *                  Durante questa fase gli interrupt vengono disabilitati per garantire l’atomicità dell’operazione.
+ *
+ *     free_user_frame - Rilascia la pagina descritta da entry, che viene letta con coremap_lock acquisito e resa invalida: se è nello swap
+ *                       file ne rilascia la porzione, se il suo frame è condiviso copy-on-write entry smette di condividerlo, altrimenti
+ *                       libera il frame (lasciandolo all'evictor se ne è in corso lo swap-out).
  *
  *     coremap_shutdown - Termina il funzionamento della coremap.
  *
@@ -41,21 +77,126 @@ struct cm_entry {
  *
  *     coremap_set_fixed - Imposta il frame rappresentato dall'elemento in posizione index come non adatto allo-swap out.
  *
+ *     coremap_set_mapped - Il frame rappresentato dall'elemento in posizione index è stato appena inserito in TLB: lo rende adatto allo swap-out
+ *                          e imposta il suo bit di riferimento.
+ *
+ *     coremap_fix_resident - Attende il termine di un eventuale swap-out della pagina descritta da entry, dormendo su una delle wait
+ *                            channel scelte in base al frame e svegliate al termine dello swap-out; se la pagina è ancora in memoria
+ *                            rende il suo frame non adatto allo swap-out, ne imposta il bit di riferimento e ritorna true, altrimenti
+ *                            (pagina nello swap file o scartata perché pulita) ritorna false.
+ *
+ *     coremap_try_fix_resident - Come coremap_fix_resident, ma senza attendere né impostare il bit di riferimento: se la pagina è vittima
+ *                                di uno swap-out ritorna subito false.
+ *
+ *     coremap_share - La pagina descritta da entry, in memoria in un frame fixed tramite coremap_fix_resident, viene condivisa copy-on-write
+ *                     con la pagina copy di un altro address space, che deve già descrivere lo stesso frame: incrementa il contatore dei
+ *                     riferimenti del frame e rilascia il frame fissato. Ritorna ENOMEM se non è possibile registrare copy tra le pagine
+ *                     che condividono il frame; anche in tal caso il frame viene rilasciato.
+ *
+ *     coremap_is_shared - Ritorna true se il frame index è condiviso copy-on-write da più address space.
+ *
+ *     coremap_copy_on_write - La pagina descritta da entry, il cui frame è stato fissato dal fault in corso, sta per essere modificata: se il
+ *                             frame è ancora condiviso la copia in un nuovo frame fixed, assegnandolo a entry, altrimenti entry ne è già
+ *                             tornata proprietaria. Se gli altri address space rilasciano il frame durante la copia, il nuovo frame viene
+ *                             liberato ed entry mantiene quello originale. Ritorna 0 se non si verificano errori.
+ *
+ *     coremap_map_zero - La pagina anonima descritta da entry, non ancora scritta, viene mappata sul frame azzerato condiviso: alla prima
+ *                        scrittura coremap_copy_on_write le assegna un frame privato.
+ *
+ *     coremap_set_swap_copy - La pagina contenuta nel frame index è appena stata letta dalla porzione slot dello swap file, di cui
+ *                             eredita il riferimento: finché la pagina non viene modificata la porzione ne è una copia aggiornata.
+ *
+ *     coremap_set_dirty - La pagina descritta da entry, in memoria in un frame fixed, sta per essere modificata: la marca come sporca e
+ *                         rilascia l'eventuale sua copia nello swap file.
+ *
+ *     coremap_set_policy - Seleziona la politica di sostituzione delle pagine di nome name (vedi cm_policy.h), ritorna EINVAL se non esiste.
+ *
+ *     coremap_get_policy - Restituisce il nome della politica di sostituzione attiva.
+ *
+ *     coremap_start_pageout - Avvia il pageout daemon e il thread pagezero, ritorna 0 se non si verificano errori.
+ *
+ *     coremap_stop_pageout - Termina il pageout daemon e il thread pagezero e ne attende la terminazione.
+ *
+ *     coremap_set_watermarks - Imposta le soglie di frame liberi del pageout daemon: viene svegliato quando i frame liberi scendono sotto low
+ *                              e libera frame finché non raggiungono high. Ritorna EINVAL se low > high; con low pari a 0 il daemon non interviene mai.
+ *
+ *     coremap_get_watermarks - Restituisce le soglie del pageout daemon e il numero attuale di frame liberi.
+ *
+ *     coremap_get_discards - Restituisce il numero di pagine pulite scartate dallo swap-out rendendone invalida la entry della Page
+ *                            Table, dall'avvio: permette alla Page Table di stimare quante entry popolate siano diventate invalide.
+ *
+ * La vittima dello swap-out viene scelta dalla politica di sostituzione attiva, di default clock (second chance), che preferisce
+ * le pagine pulite: non vengono scritte nello swap file, ma ricaricate dal file ELF o dalla copia che vi si trova già. Insieme a una vittima sporca vengono scritte nello swap file, con un'unica
+ * operazione, anche le pagine sporche e non referenziate adiacenti nello stesso address space (cluster di swap-out), i cui frame tornano liberi.
+ *
+ * Dopo una fork le pagine in memoria sono condivise tra padre e figlio e mappate in sola lettura: un frame condiviso ha pt_entry NULL,
+ * elenca in sharers le pagine che lo condividono e viene copiato alla prima scrittura. Quando rimane un solo riferimento il frame torna
+ * subito di proprietà della pagina rimasta. Un frame condiviso può essere scelto come vittima: le pagine che lo condividono vengono rimosse
+ * dalla memoria insieme, scrivendolo in un'unica porzione dello swap file il cui contatore dei riferimenti vale quanto le pagine, come
+ * accade per le pagine già nello swap file al momento della fork. Poiché più fault possono fissare contemporaneamente un frame condiviso,
+ * questi lo fissano tramite il contatore pins invece che tramite fixed, che per un frame condiviso indica uno swap-out in corso.
+ * Allo stesso modo le pagine dello stack e del BSS lette prima di essere scritte condividono
+ * un unico frame azzerato, riservato durante il bootstrap e mai liberato, che non occupa né memoria né spazio nello swap file.
+ *
+ * Lo swap-out avviene di norma nel pageout daemon, un thread del kernel che mantiene il numero di frame liberi tra le due soglie;
+ * solo se non esistono frame liberi il thread che li richiede effettua lo swap-out in modo sincrono. Il thread pagezero mantiene invece
+ * un pool di frame liberi già azzerati, prelevati solo quando i frame liberi superano high_watermark.
+ *
+ * La coremap è protetta da uno spinlock. Le allocazioni di un singolo frame sono servite da un magazine di frame riservati
+ * alla cpu corrente, che viene ricaricato e svuotato a blocchi dal buddy allocator: nel caso comune non si accede a strutture condivise.
+ * Quando il buddy allocator è vuoto, i magazine di tutte le cpu vengono svuotati prima di ricorrere a uno swap-out.
+ *
  */
 
 void coremap_create(unsigned int npages);
 
 bool coremap_bootstrap(paddr_t firstpaddr);
 
-paddr_t get_user_frame(struct pt_entry* entry);
+int get_user_frame(struct pt_entry* entry, bool zero, paddr_t* frame);
+
+paddr_t get_free_user_frame(struct pt_entry* entry);
 
 paddr_t get_kernel_frame(unsigned int num);
 
 void free_frame(paddr_t addr);
 
+void free_user_frame(struct pt_entry* entry);
+
 void coremap_shutdown(void);
 
 void coremap_set_fixed(unsigned int index);
 
 void coremap_set_unfixed(unsigned int index);
+
+void coremap_set_mapped(unsigned int index);
+
+bool coremap_fix_resident(struct pt_entry* entry);
+
+bool coremap_try_fix_resident(struct pt_entry* entry);
+
+int coremap_share(struct pt_entry* entry, struct pt_entry* copy);
+
+bool coremap_is_shared(unsigned int index);
+
+int coremap_copy_on_write(struct pt_entry* entry);
+
+void coremap_map_zero(struct pt_entry* entry);
+
+void coremap_set_swap_copy(unsigned int index, unsigned int slot);
+
+void coremap_set_dirty(struct pt_entry* entry);
+
+int coremap_set_policy(const char* name);
+
+const char* coremap_get_policy(void);
+
+int coremap_start_pageout(void);
+
+void coremap_stop_pageout(void);
+
+int coremap_set_watermarks(unsigned int low, unsigned int high);
+
+void coremap_get_watermarks(unsigned int* low, unsigned int* high, unsigned int* free);
+
+unsigned int coremap_get_discards(void);
 #endif
\ No newline at end of file
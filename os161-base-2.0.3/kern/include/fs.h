@@ -37,11 +37,16 @@ struct vnode; /* in vnode.h */
  * Abstract file system. (Or device accessible as a file.)
  *
  * fs_data is a pointer to filesystem-specific data.
+ *
+ * fs_dcache is set by filesystems whose name lookups may be cached by
+ * the VFS layer (see vfs_dcache_* in vfs.h). Such a filesystem must
+ * not modify the name passed to VOP_LOOKUP.
  */
 
 struct fs {
 	void *fs_data;
 	const struct fs_ops *fs_ops;
+	bool fs_dcache;
 };
 
 /*
@@ -37,6 +37,7 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+#define SFS_MAGIC_FEATURES 0xabadf002   /* same, with sb_features in use */
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
@@ -49,6 +50,9 @@
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
+#define SFS_DIRIDX_MAGIC  0xd1c7da7a    /* magic number of a directory index */
+#define SFS_DIRIDX_NBUCKETS 124         /* hash buckets in a directory index */
+#define SFS_DIRBUCKET_NENTRIES 63       /* entries per bucket block */
 
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
@@ -67,6 +71,16 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/*
+ * Optional on-disk features, in sb_features. A volume that uses any
+ * of them has SFS_MAGIC_FEATURES instead of SFS_MAGIC, so that tools
+ * and kernels that predate sb_features refuse it rather than
+ * corrupting it; ones that know sb_features refuse a volume with
+ * bits they do not know. A volume with SFS_MAGIC has no features.
+ */
+#define SFS_FEATURE_DIRINDEX 0x1        /* directories may be indexed */
+#define SFS_FEATURES_KNOWN   (SFS_FEATURE_DIRINDEX)
+
 /*
  * On-disk superblock
  */
@@ -74,7 +88,8 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* */
+	uint32_t reserved[117];			/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +101,8 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirindex;			/* Directory index block, or 0 */
+	uint32_t sfi_waste[128-4-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -97,5 +113,53 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Directory index.
+ *
+ * On a volume with SFS_FEATURE_DIRINDEX, a directory whose inode has
+ * a nonzero sfi_dirindex also has a hash index of its entries;
+ * otherwise it is searched linearly. The entries themselves are
+ * always in the directory's data as usual; the index only maps names
+ * to slot numbers. It must be kept up to date by everything that
+ * changes the directory, which is why older kernels must refuse the
+ * volume.
+ *
+ * The index block holds the head of a chain of bucket blocks for each
+ * hash bucket, plus the head of a chain listing the free slots of the
+ * directory. A name goes in bucket SFS_DIRHASH(name) %
+ * SFS_DIRIDX_NBUCKETS; a bucket block holds (hash, slot) pairs. Bucket
+ * blocks are never empty: a block whose last entry is removed is
+ * freed. Entries of the free-slot chain have hash 0.
+ *
+ * sdi_dirsize is the size of the directory when the index was last
+ * updated; if it doesn't match sfi_size, or SFS_DIRIDX_STALE is set
+ * (e.g. by sfsck after it changed the directory), the index is out of
+ * date and the kernel rebuilds it before use.
+ *
+ * SFS_DIRHASH is the 32-bit FNV-1a hash of the name's bytes.
+ */
+#define SFS_DIRIDX_STALE  0x1           /* sdi_flags: must be rebuilt */
+#define SFS_DIRHASH_BASIS 2166136261U
+#define SFS_DIRHASH_PRIME 16777619U
+
+struct sfs_dirindex {
+	uint32_t sdi_magic;			/* SFS_DIRIDX_MAGIC */
+	uint32_t sdi_flags;			/* SFS_DIRIDX_* */
+	uint32_t sdi_dirsize;			/* sfi_size of the directory */
+	uint32_t sdi_freeslots;			/* free-slot chain, or 0 */
+	uint32_t sdi_buckets[SFS_DIRIDX_NBUCKETS]; /* bucket chains, or 0 */
+};
+
+struct sfs_dirbucket_entry {
+	uint32_t sdbe_hash;			/* SFS_DIRHASH of the name */
+	uint32_t sdbe_slot;			/* slot in the directory */
+};
+
+struct sfs_dirbucket {
+	uint32_t sdb_next;			/* next block in chain, or 0 */
+	uint32_t sdb_count;			/* entries in use */
+	struct sfs_dirbucket_entry sdb_entries[SFS_DIRBUCKET_NENTRIES];
+};
+
 
 #endif /* _KERN_SFS_H_ */
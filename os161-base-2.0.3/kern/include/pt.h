@@ -3,6 +3,7 @@
 
 #include <types.h>
 #include <synch.h>
+#include <vm.h>
 #define TABLE_SIZE 1024
 
 #define GET_EXT_INDEX(addr) ( addr >> 22 )
@@ -12,18 +13,41 @@
 
 #define PAGE_NOT_FOUND 1
 
+#define PT_MAX_BUSY 16 /* fault risolti contemporaneamente nello stesso address space */
+#define PT_TRIM_DISCARDS 64 /* pagine pulite scartate dallo swap-out dopo cui le Page Table di secondo livello vuote vengono cercate */
+
+/* ogni Page Table di secondo livello occupa esattamente un frame allineato: da una pt_entry si risale all'inizio della tabella e alla sua posizione */
+#define PT_ROW_BASE(entry) ((struct pt_entry*)((vaddr_t)(entry) & PAGE_FRAME))
+#define PT_ROW_INDEX(entry) ((unsigned int)((entry) - PT_ROW_BASE(entry)))
+
 struct pt_entry /* secondo livello */
 {
     unsigned int frame_no : 20; /* indica di quale numero di frame si tratta oppure se swp = 1 indica l’indice (offset nel file swap / 4096) nel quale il frame si trovi all’interno dello swap*/
     unsigned int valid : 1;     /* indica se questa entry è valida (il frame corrispondente è utilizzabile) */
     unsigned int swp : 1;       /* indica se la pagina si trovi nello swap file */
     bool swapping : 1;          /* indica se la pagina sia stata scelta come vittima per lo swap-out */
+    unsigned int dirty : 1;     /* indica se la pagina sia stata modificata dopo essere stata caricata dal file ELF o dallo swap file; finché è pulita viene mappata in sola lettura */
+    unsigned int prefetched : 1; /* indica se la pagina sia stata caricata in TLB da un fault su una pagina vicina e da allora non abbia causato TLB fault */
+};
+
+struct pt_row /* Page Table di secondo livello allocata */
+{
+    unsigned int index;             /* posizione nella Page Table di primo livello */
+    unsigned int live;              /* entry popolate, cioè rese valide dal processo e non ancora trovate invalide */
+    uint32_t map[TABLE_SIZE / 32];  /* bitmap delle entry popolate */
 };
 
 struct pt /* primo livello */
 {
     struct pt_entry** table;     /* vettore di puntatori a Page Table di secondo livello */
-    struct lock* pt_lock; /* permette ad un thread del processo di avere un accesso esclusivo alla Page Table */
+    struct pt_row* rows;         /* indice compatto delle Page Table di secondo livello allocate */
+    unsigned int nrows;          /* Page Table di secondo livello allocate */
+    unsigned int rows_size;      /* capacità del vettore rows */
+    struct lock* pt_lock; /* protegge la struttura della Page Table e l'insieme delle pagine occupate */
+    struct cv* busy_cv;   /* segnala il rilascio di una pagina occupata */
+    vaddr_t busy[PT_MAX_BUSY]; /* pagine su cui è in corso la risoluzione di un fault */
+    unsigned int nbusy;   /* pagine occupate */
+    unsigned int trim_discards; /* valore di coremap_get_discards all'ultima visita delle entry popolate */
 };
 
 /**
@@ -42,17 +66,37 @@ struct pt /* primo livello */
  * Funzioni:
  *     pt_create - Crea la Page Table e la restituisce.
  *
- *     pt_get_frame_from_page  - Trova, mediante la Page Table table, l’indirizzo del frame corrispondente alla pagina che ha come indirizzo logico fault_addr e lo scrive nel parametro frame_addr; se il frame non è presente in memoria lo carica da memoria secondaria tramite la funzione load_frame; ritorna 0 se non vi sono stati errori durante questo processo.
+ *     pt_get_frame_from_page  - Trova, mediante la Page Table table, l’indirizzo del frame corrispondente alla pagina che ha come indirizzo logico fault_addr e lo scrive nel parametro frame_addr; se il frame non è presente in memoria lo carica da memoria secondaria tramite la funzione load_frame; se write è vero la pagina viene marcata come sporca, dopo averla copiata in un nuovo frame se condivisa con un altro address space. Tramite il parametro writable indica se la pagina possa essere mappata in scrittura, cioè se sia sporca e non condivisa; ritorna 0 se non vi sono stati errori durante questo processo.
  *
- *     pt_copy - Crea una copia profonda della Page Table old in un'altra già creata e passata tramite il parametro new; ritorna 0 se non vi sono stati errori durante la copia.
+ *     pt_fix_resident_pages - Cerca, tra le n pagine successive a quella di indirizzo logico addr nella stessa Page Table di secondo livello,
+ *                             quelle in memoria che non sono vittima di uno swap-out e ne rende i frame non adatti allo swap-out; ne scrive
+ *                             gli indirizzi logici in pages, gli indirizzi dei frame in frames e se possano essere mappate in scrittura in
+ *                             writable, ritornandone il numero. Tali frame vanno resi di nuovo swappable tramite coremap_set_unfixed dopo
+ *                             averli scritti in TLB.
+ *
+ *     pt_copy - Crea una copia della Page Table old in un'altra già creata e passata tramite il parametro new, condividendo copy-on-write le pagine in memoria; ritorna 0 se non vi sono stati errori durante la copia.
  *
  *     pt_destroy  -  Distrugge la page table.
  *
+ * pt_get_frame_from_page mantiene pt_lock solo per consultare e aggiornare la struttura della Page Table: la pagina viene marcata come
+ * occupata e il lock rilasciato prima di caricarla, così che i fault su pagine diverse (anche di thread diversi dello stesso processo)
+ * procedano in parallelo, mentre un fault sulla stessa pagina attende su busy_cv che il primo termini. Le pagine lette in anticipo
+ * dallo swap file vengono occupate insieme a quella del fault, pt_fix_resident_pages salta le pagine occupate e pt_copy attende che
+ * non vi siano pagine occupate.
+ *
+ * pt_copy e pt_destroy visitano solo le entry popolate delle Page Table di secondo livello allocate, tramite l'indice rows, così che il
+ * loro costo dipenda dalle pagine effettivamente usate dal processo. Una entry resa invalida dallo swap-out di una pagina pulita rimane
+ * marcata come popolata finché una visita non la trova invalida; una Page Table di secondo livello senza entry popolate viene liberata.
+ * Oltre che da pt_copy, le entry popolate vengono visitate da pt_get_frame_from_page quando, dall'ultima visita, lo swap-out ha
+ * scartato almeno PT_TRIM_DISCARDS pagine pulite (di qualsiasi processo) e nessun fault è in corso nell'address space.
+ *
  */
 
 struct pt* pt_create(void);
 
-int pt_get_frame_from_page(struct pt* table, vaddr_t addr, paddr_t* frame_addr);
+int pt_get_frame_from_page(struct pt* table, vaddr_t addr, bool write, paddr_t* frame_addr, bool* writable);
+
+unsigned int pt_fix_resident_pages(struct pt* table, vaddr_t addr, unsigned int n, vaddr_t* pages, paddr_t* frames, bool* writable);
 
 int pt_copy(struct pt* old, struct pt* new);
 
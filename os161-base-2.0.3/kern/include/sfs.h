@@ -48,14 +48,77 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each vnode has a sleep lock, sv_lock, covering the in-memory inode,
+ * the vnode's I/O buffers, and the contents of the file or directory.
+ * Each volume has sfs_vnlock, covering the table of loaded vnodes, and
+ * sfs_fslock, covering the freemap and the superblock. The buffer
+ * cache locks itself. The locks are acquired in this order:
+ *
+ *	directory sv_lock
+ *	file sv_lock
+ *	sfs_vnlock
+ *	sfs_fslock
+ *
+ * Changes to a directory invalidate the VFS name cache before the
+ * directory's sv_lock is released; the name cache's own lock nests
+ * inside the vnode locks.
+ *
+ * No sv_lock is held while a user buffer is touched: a page fault
+ * there pages in from the executable through VOP_READ, which takes the
+ * sv_lock of the executable. Demand paging thus comes before every SFS
+ * lock in the order above. sfs_read and sfs_write bounce user I/O
+ * through a kernel buffer of SFS_BOUNCESIZE bytes for this reason, and
+ * the kernel addresses used by the VM system's own reads never fault.
+ *
+ * When two directories must be held at once (rename), the one with the
+ * lower inode number is locked first. The inode type never changes
+ * after the vnode is loaded and may be checked without sv_lock.
+ *
+ * Loaded vnodes are kept in a hash table keyed by inode number. When
+ * the last reference to a vnode that still has links goes away, the
+ * vnode is synced and parked on an LRU list of inactive vnodes instead
+ * of being freed, so that opening the file again does not have to
+ * rebuild it. An inactive vnode keeps the vnode refcount of 1 that
+ * sfs_reclaim was handed; sfs_loadvnode passes it on to the next user.
+ * The hash chains, the LRU list and sv_inactive are covered by
+ * sfs_vnlock rather than sv_lock.
+ *
+ * A file that is being written sequentially gets a run of blocks
+ * reserved after the block it just allocated, so that it stays
+ * contiguous while other files grow at the same time. Reserved blocks
+ * are marked in sfs_freemap, so nobody else allocates them, and in
+ * sfs_resmap; they are left out when the freemap is written to disk.
+ * sv_resblock and sv_rescount are covered by sfs_fslock.
+ */
+
+#define SFS_VNHASH_SIZE  64	/* buckets in the vnode hash table */
+#define SFS_INACTIVE_MAX 32	/* inactive vnodes kept per volume */
+#define SFS_RESERVE_BLOCKS 8	/* blocks reserved for a sequential writer */
+#define SFS_BOUNCESIZE (8 * SFS_BLOCKSIZE) /* chunk size for user I/O */
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* protects everything below */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	char *sv_iobuf;                 /* buffer for partial-block I/O */
+	uint32_t *sv_idbuf;             /* buffer for the indirect block */
+	off_t sv_raoffset;              /* byte where the last read ended */
+	uint32_t sv_raend;              /* first block not yet read ahead */
+	unsigned sv_rawindow;           /* read-ahead window; 0 if not sequential */
+	struct sfs_vnode *sv_hnext;     /* next in hash chain */
+	struct sfs_vnode *sv_lruprev;   /* inactive list, towards most recent */
+	struct sfs_vnode *sv_lrunext;   /* inactive list, towards least recent */
+	bool sv_inactive;               /* no references; on the inactive list */
+	daddr_t sv_resblock;            /* next reserved block */
+	unsigned sv_rescount;           /* reserved blocks left */
 };
 
 /*
@@ -63,12 +126,20 @@ struct sfs_vnode {
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct lock *sfs_fslock;        /* protects superblock and freemap */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* vnodes loaded into memory */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnhash */
+	struct sfs_vnode *sfs_lrufirst; /* most recently inactive vnode */
+	struct sfs_vnode *sfs_lrulast;  /* least recently inactive vnode */
+	unsigned sfs_ninactive;         /* vnodes on the inactive list */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct bitmap *sfs_resmap;      /* blocks reserved but not yet used */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	daddr_t sfs_alloccursor;        /* where to look for a free block */
 };
 
 /*
@@ -76,5 +147,15 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Read-ahead window limits, in blocks. sfs_set_readahead sets the
+ * largest window (0 disables read-ahead).
+ */
+#define SFS_RA_MIN 4
+#define SFS_RA_MAX 32
+
+int sfs_set_readahead(unsigned maxblocks);
+unsigned sfs_get_readahead(void);
+
 
 #endif /* _SFS_H_ */
@@ -5,12 +5,25 @@
 #include <vm.h>
 
 struct pt_entry;
+struct bitmap;
 
-#define SWAP_MAX 9 * 1024 * 1024 / PAGE_SIZE
+#define SWAP_MAX 9 * 1024 * 1024 / PAGE_SIZE /* porzioni del backend file */
+#define SWAP_DEVICE_MAX (1 << 20) /* porzioni al più utilizzate su un disco: indirizzabili dal campo frame_no della pt_entry */
+#define SWAP_GROUP_SIZE 32 /* porzioni del file rappresentate da un bit della bitmap di riepilogo */
+#define SWAP_FILE_NAME "emu0:/SWAPFILE"
+#define SWAP_BACKEND_FILE "file" /* nome del backend che utilizza SWAP_FILE_NAME; gli altri nomi indicano un disco lhd */
+#define SWAP_CLUSTER 4 /* pagine trasferite al più con un'unica operazione di I/O (EMU_MAXIO / PAGE_SIZE) */
 
 struct swap_file{
-    struct vnode* file;     /* Rappresenta il file utilizzato per effettuare lo swap-in o lo swap-out delle pagine*/
-    uint8_t refs[SWAP_MAX]; /* Arrai il cui indici rappresentano una porzione del file che può contenere una pagina e i cui elementi rappresentano il contatore di riferimenti a tale pagina. Se 0 la porzione è libera.  */
+    struct vnode* file;     /* Rappresenta il file (o il disco) utilizzato per effettuare lo swap-in o lo swap-out delle pagine*/
+    char backend[16];       /* Nome del backend: SWAP_BACKEND_FILE oppure il nome del disco (es. lhd1) */
+    unsigned int nslots;    /* Porzioni del file che possono contenere una pagina */
+    uint8_t* refs;          /* Arrai il cui indici rappresentano una porzione del file che può contenere una pagina e i cui elementi rappresentano il contatore di riferimenti a tale pagina. Se 0 la porzione è libera.  */
+    struct bitmap* slots;   /* Un bit per ogni porzione del file, impostato se la porzione è occupata */
+    struct bitmap* full;    /* Bitmap di riepilogo: un bit per ogni gruppo di SWAP_GROUP_SIZE porzioni, impostato se sono tutte occupate */
+    unsigned int hint;      /* Gruppo da cui partirà la ricerca della prossima porzione libera */
+    unsigned int used;      /* Porzioni occupate */
+    unsigned int peak;      /* Massimo numero di porzioni occupate contemporaneamente */
 };
 
 struct lock* swap_lock; /* Utilizzato per sincronizzare gli accessi alla struttura dati*/
@@ -20,23 +33,47 @@ struct lock* swap_lock; /* Utilizzato per sincronizzare gli accessi alla struttu
  * Functions:
  *     swap_init  -  Inizializza il sistema di swap allocando la struct swap_file e il lock necessario per rendere gli accessi alla struttura sincronizzati. Apre il file di swap. Ritorna 0 se non si verificano errori.
  *
+ *     swap_set_backend - Sostituisce il backend dello swap: SWAP_BACKEND_FILE per il file SWAP_FILE_NAME, di SWAP_MAX porzioni, oppure il nome
+ *                        di un disco lhd (es. lhd1), utilizzato come partizione di swap tramite il suo dispositivo raw: le pagine vengono
+ *                        trasferite con DEVOP_IO senza passare per un file system e il numero di porzioni dipende dalla dimensione del disco.
+ *                        Può essere invocata solo quando lo swap è vuoto, ad esempio al boot tramite il comando swap del menu;
+ *                        ritorna EBUSY se lo swap contiene pagine, un errore di vfs_open se il disco non esiste.
+ *
+ *     swap_get_backend - Restituisce il nome del backend attivo e il numero di porzioni tramite nslots.
+ *
  *     swap_get  -  Legge il blocco allocato nel file in posizione index, decrementa il contatore dei riferimenti e scrive il blocco in memoria all'indirizzo logico del kernel address; se address è NULL il contatore dei riferimenti viene decrementato comunque, ma non avviene alcuna scrittura in memoria; restituisce 0 se non si verificano errori.
  *
- *     swap_set  -  Legge il blocco di memoria all'indirizzo address e lo scrive nel file utilizzando la prima posizione libera, imposta il relativo contatore a 1, ritorna la posizione nel file tramite il parametro index; restituisce 0 se non si verificano errori.
+ *     swap_set  -  Legge il blocco di memoria all'indirizzo address e lo scrive nel file utilizzando una posizione libera, imposta il relativo contatore a 1, ritorna la posizione nel file tramite il parametro index; restituisce 0 se non si verificano errori, ENOSPC se il file di swap è pieno.
+ *                  La posizione libera viene cercata nella bitmap di riepilogo a partire dall'ultimo gruppo utilizzato e poi nella bitmap delle porzioni
+ *                  all'interno del primo gruppo non pieno, quindi senza scandire l'array refs.
+ *
+ *     swap_get_cluster - Legge con un'unica operazione le n porzioni contigue che iniziano da index negli n indirizzi addresses,
+ *                        senza modificare i contatori dei riferimenti.
+ *
+ *     swap_set_cluster - Come swap_set, ma scrive con un'unica operazione le n pagine agli indirizzi addresses in n porzioni contigue del file,
+ *                        ritornando la prima tramite il parametro index.
  *
  *     swap_inc_ref - Incrementa il contatore dei riferimenti al frame rappresentato dall'indice index dell'array refs della struct swap_file.
  *
- *     swap_close - Chiude il file di swap e dealloca la struct swap_file.
+ *     swap_close - Chiude il file di swap, aggiorna le statistiche sull'occupazione e dealloca la struct swap_file.
  *
- *     load_from_swap - Permette di effettuare lo swap-in della pagina descritta nella struct pt_entry.
+ *     load_from_swap - Permette di effettuare lo swap-in della pagina descritta nella struct pt_entry. Le pagine successive nella stessa
+ *                      Page Table di secondo livello, che si trovano nelle porzioni successive del file, vengono lette con la stessa
+ *                      operazione se esistono frame liberi in cui caricarle, al più ahead, che il chiamante deve aver occupato
+ *                      nella Page Table (vedi pt.h). Le pagine caricate sono pulite e le porzioni lette
+ *                      rimangono riservate come loro copia (vedi coremap_set_swap_copy).
  */
 
 int swap_init(void);
+int swap_set_backend(const char* name);
+const char* swap_get_backend(unsigned int* nslots);
 int swap_get(vaddr_t address, unsigned int index);
 int swap_set(vaddr_t address, unsigned int* index);
+int swap_get_cluster(vaddr_t* addresses, unsigned int index, unsigned int n);
+int swap_set_cluster(vaddr_t* addresses, unsigned int n, unsigned int* index);
 void swap_inc_ref(unsigned int index);
 void swap_close(void);
 
-int load_from_swap(struct pt_entry* entry);
+int load_from_swap(struct pt_entry* entry, unsigned int ahead);
 
 #endif
\ No newline at end of file
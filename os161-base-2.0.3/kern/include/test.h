@@ -87,6 +87,8 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int fsreadbench(int, char **);
+int fsconcbench(int, char **);
 
 /* other tests */
 int kmalloctest(int, char **);
@@ -94,6 +96,10 @@ int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
+int lhdbench(int, char **);
+
+/* VM tests */
+int coremaptest(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
@@ -183,6 +183,44 @@ int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Name lookup cache, used by vfs_lookup on filesystems that set
+ * fs_dcache. Such filesystems must call vfs_dcache_invalidate after
+ * every change to a name in a directory, while still holding the
+ * directory locked.
+ *
+ *    vfs_dcache_lookup     - Look up NAME in DIR. On a hit, return true
+ *                            and the vnode (incref'd) in RET, or NULL if
+ *                            the name is known not to exist. On a miss,
+ *                            return false and a generation number to
+ *                            pass to vfs_dcache_enter.
+ *
+ *    vfs_dcache_enter      - Record the result of a lookup that missed;
+ *                            VN is NULL if the name does not exist.
+ *
+ *    vfs_dcache_invalidate - Forget NAME in DIR.
+ *
+ *    vfs_dcache_purge      - Forget everything on FS (before unmount).
+ */
+
+struct vfs_dcache_stats {
+	unsigned long long ds_hits;		/* lookups answered with a vnode */
+	unsigned long long ds_neghits;		/* lookups answered with ENOENT */
+	unsigned long long ds_misses;		/* lookups passed to the filesystem */
+	unsigned long long ds_invalidations;	/* entries dropped by a change */
+	unsigned long long ds_evictions;	/* entries dropped to make room */
+	unsigned ds_entries;			/* entries in the cache */
+};
+
+void vfs_dcache_bootstrap(void);
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *gen);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_dcache_invalidate(struct vnode *dir, const char *name);
+void vfs_dcache_purge(struct fs *fs);
+void vfs_dcache_getstats(struct vfs_dcache_stats *stats);
+
 /*
  * Array of vnodes.
  */
@@ -194,8 +232,9 @@ DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global lock for the VFS layer: it protects the device and mount
+ * table and bootfs, and serializes emufs. SFS no longer depends on it and uses its own per-volume and
+ * per-vnode locks (see sfs.h).
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -12,11 +12,34 @@
 #define page_faults_from_elf        7
 #define page_faults_from_swap       8
 #define swap_file_writes            9
+#define frame_cache_hits            10              /* allocazioni di frame servite dal magazine della cpu */
+#define frame_cache_misses          11              /* allocazioni di frame che hanno ricaricato il magazine dal pool globale */
+#define swap_slots_used             12              /* porzioni dello swap file occupate allo shutdown */
+#define swap_slots_peak             13              /* massimo numero di porzioni dello swap file occupate contemporaneamente */
+#define swap_cluster_writes         14              /* operazioni di scrittura nello swap file, swap_file_writes / swap_cluster_writes = dimensione media di un cluster */
+#define swap_pages_read_ahead       15              /* pagine lette dallo swap file in anticipo durante lo swap-in di un'altra pagina */
+#define pageout_wakeups             16              /* attivazioni del pageout daemon */
+#define pageout_pages               17              /* pagine rimosse dalla memoria dal pageout daemon */
+#define swap_writes_avoided         18              /* vittime pulite rimosse dalla memoria senza scriverle nello swap file */
+#define cow_faults                  19              /* pagine condivise dopo una fork copiate alla prima scrittura */
+#define tlb_prefetches              20              /* entry caricate in TLB per le pagine in memoria vicine a quella che ha causato un fault */
+#define tlb_prefetch_refaults       21              /* pagine caricate in anticipo che hanno comunque causato un TLB fault */
+#define zero_page_mappings          22              /* page fault in lettura di pagine anonime risolti mappando il frame azzerato condiviso */
+#define zero_pool_hits              23              /* frame azzerati richiesti e prelevati dal pool del thread pagezero */
+#define zero_pool_misses            24              /* frame azzerati richiesti e azzerati durante l'allocazione perché il pool era vuoto */
+#define swap_file_reads             25              /* pagine lette dallo swap, comprese quelle lette in anticipo */
+#define swap_read_ns                26              /* tempo trascorso nelle letture dal backend dello swap, in nanosecondi */
+#define swap_write_ns               27              /* tempo trascorso nelle scritture nel backend dello swap, in nanosecondi */
+#define tlb_shootdowns              28              /* frame invalidati anche nelle TLB delle altre cpu tramite IPI */
+
+#define VM_STATS_N                  29
 
 
 
 void inc_counter(unsigned int position);
 
+void add_counter(unsigned int position, unsigned long long value);
+
 void print_stats(void);
 
 
@@ -4,18 +4,60 @@
 #include <types.h>
 #include <machine/tlb.h>
 
+struct addrspace;
+
+#define TLB_FAULT_AROUND_DEFAULT 4               /* pagine vicine caricate in TLB a ogni fault */
+#define TLB_FAULT_AROUND_MAX     (NUM_TLB / 4)   /* oltre questo limite il fault-around rimuove dalla TLB troppe entry utili */
+
 /**
  *
  * Funzioni:
  *
+ *     tlb_bootstrap - Crea il lock che serializza gli shootdown; va invocata prima di avviare le altre cpu.
+ *
+ *     tlb_activate - Rende as l'address space attivo sulla cpu corrente impostandone l'ASID in EntryHi; se l'ASID di as appartiene a una
+ *                    generazione precedente gliene assegna uno nuovo, iniziando una nuova generazione quando gli ASID sono esauriti.
+ *                    La TLB della cpu viene svuotata solo se contiene entry di una generazione precedente.
+ *
+ *     tlb_invalidate_as - Segna come invalide le entry della TLB della cpu corrente relative all'address space as. Le entry valide di
+ *                         as si trovano solo nella TLB della cpu su cui è attivo, perché tlb_activate gli assegna un nuovo ASID
+ *                         quando cambia cpu.
+ *
  *     tlb_get_rr_victim - Sceglie una entry della TLB da sostituire mediante una politica Round-Robin e ne restituisce l'indice.
  *
- *     invalidate_entry_by_paddr - Segna come invalida, se esiste, la entry della TLB riferita al frame che contiene l'indirizzo paddr.
+ *     tlb_insert - Scrive nella TLB il mapping della pagina di indirizzo logico vaddr nel frame paddr, in scrittura se writable è vero,
+ *                  con l'ASID attivo, sostituendo l'eventuale entry già presente per vaddr, altrimenti una entry libera o quella scelta da tlb_get_rr_victim.
+ *                  Ritorna true se è stata utilizzata una entry libera. Va invocata con gli interrupt disabilitati.
+ *
+ *     invalidate_entry_by_paddr - Segna come invalide le entry della TLB della cpu corrente riferite al frame che contiene l'indirizzo
+ *                                 paddr, in qualunque address space. Va invocata con gli interrupt disabilitati.
+ *
+ *     tlb_shootdown - Come invalidate_entry_by_paddr, ma sulle TLB di tutte le cpu: invia un IPI alle altre cpu e attende che abbiano
+ *                     invalidato le entry, un solo shootdown alla volta. Va invocata senza spinlock acquisiti e può dormire.
+ *
+ *     tlb_set_fault_around - Imposta il numero di pagine successive, già in memoria, che vengono caricate in TLB insieme a quella che ha
+ *                            causato un fault (0 disabilita il fault-around); ritorna EINVAL se n supera TLB_FAULT_AROUND_MAX.
+ *
+ *     tlb_get_fault_around - Restituisce il numero di pagine caricate in TLB dal fault-around.
  *
  */
 
+void tlb_bootstrap(void);
+
+void tlb_activate(struct addrspace* as);
+
+void tlb_invalidate_as(struct addrspace* as);
+
 int tlb_get_rr_victim(void);
 
+bool tlb_insert(vaddr_t vaddr, paddr_t paddr, bool writable);
+
 void invalidate_entry_by_paddr(paddr_t paddr);
 
+void tlb_shootdown(paddr_t paddr);
+
+int tlb_set_fault_around(unsigned int n);
+
+unsigned int tlb_get_fault_around(void);
+
 #endif /* _VM_TLB_H_ */
\ No newline at end of file
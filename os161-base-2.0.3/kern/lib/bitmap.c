@@ -131,6 +131,43 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+/*
+ * Find the first clear bit at or after START, wrapping around to the
+ * beginning of the bitmap, without marking it. Words with all bits
+ * set are skipped as a whole.
+ */
+int
+bitmap_find_clear(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned bitno, ix, n, skip;
+        WORD_TYPE mask;
+
+        KASSERT(start < b->nbits);
+
+        bitno = start;
+        for (n = 0; n < b->nbits; n += skip) {
+                bitmap_translate(bitno, &ix, &mask);
+                if (mask == 1 && b->v[ix] == WORD_ALLBITS) {
+                        skip = BITS_PER_WORD;
+                        if (skip > b->nbits - bitno) {
+                                skip = b->nbits - bitno;
+                        }
+                }
+                else if ((b->v[ix] & mask) == 0) {
+                        *index = bitno;
+                        return 0;
+                }
+                else {
+                        skip = 1;
+                }
+                bitno += skip;
+                if (bitno == b->nbits) {
+                        bitno = 0;
+                }
+        }
+        return ENOSPC;
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
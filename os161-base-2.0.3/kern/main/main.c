@@ -50,6 +50,11 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-sfs.h"
+
+#if OPT_SFS
+#include <bufcache.h>
+#endif
 
 
 /*
@@ -126,6 +131,9 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+#if OPT_SFS
+	bufcache_bootstrap();
+#endif
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -45,6 +45,18 @@
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-paging.h"
+
+#if OPT_SFS
+#include <bufcache.h>
+#endif
+
+#if OPT_PAGING
+#include <coremap.h>
+#include <cm_policy.h>
+#include <vm_tlb.h>
+#include <swapfile.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -497,6 +509,171 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	struct vfs_dcache_stats stats;
+	unsigned long long lookups;
+
+	(void)nargs;
+	(void)args;
+
+	vfs_dcache_getstats(&stats);
+	lookups = stats.ds_hits + stats.ds_neghits + stats.ds_misses;
+	kprintf("Name cache: %u entries\n", stats.ds_entries);
+	kprintf("    hits %llu  negative hits %llu  misses %llu  "
+		"hit rate %llu%%\n", stats.ds_hits, stats.ds_neghits,
+		stats.ds_misses, lookups ?
+		(stats.ds_hits + stats.ds_neghits) * 100 / lookups : 0);
+	kprintf("    invalidations %llu  evictions %llu\n",
+		stats.ds_invalidations, stats.ds_evictions);
+	return 0;
+}
+
+#if OPT_PAGING
+/*
+ * Command for selecting the page replacement policy.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	unsigned i;
+
+	if (nargs == 2) {
+		if (coremap_set_policy(args[1]) == 0) {
+			return 0;
+		}
+		kprintf("vmpolicy: %s: no such policy\n", args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmpolicy [policy]\n");
+		return EINVAL;
+	}
+
+	kprintf("Current policy: %s\nAvailable policies:",
+		coremap_get_policy());
+	for (i=0; cm_policies[i] != NULL; i++) {
+		kprintf(" %s", cm_policies[i]->name);
+	}
+	kprintf("\n");
+	return nargs == 1 ? 0 : EINVAL;
+}
+
+/*
+ * Command for setting the pageout daemon watermarks.
+ */
+static
+int
+cmd_vmwatermarks(int nargs, char **args)
+{
+	unsigned low, high, nfree;
+
+	if (nargs == 3) {
+		if (coremap_set_watermarks(atoi(args[1]), atoi(args[2]))) {
+			kprintf("vmwm: low watermark must not exceed high "
+				"watermark\n");
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmwm [low high]\n");
+		return EINVAL;
+	}
+
+	coremap_get_watermarks(&low, &high, &nfree);
+	kprintf("Pageout watermarks: low %u high %u (free frames: %u)\n",
+		low, high, nfree);
+	return 0;
+}
+
+/*
+ * Command for setting how many resident pages are preloaded into
+ * the TLB on each fault.
+ */
+static
+int
+cmd_vmfaultaround(int nargs, char **args)
+{
+	if (nargs == 2) {
+		if (tlb_set_fault_around(atoi(args[1]))) {
+			kprintf("vmfa: at most %u pages\n",
+				TLB_FAULT_AROUND_MAX);
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmfa [npages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Fault-around: %u pages\n", tlb_get_fault_around());
+	return 0;
+}
+
+/*
+ * Command for selecting the swap backend: the swap file on emu0 or
+ * a raw lhd disk. Meant to be given on the boot command line, before
+ * any page has been swapped out.
+ */
+static
+int
+cmd_swap(int nargs, char **args)
+{
+	const char *backend;
+	unsigned nslots;
+	int result;
+
+	if (nargs == 2) {
+		result = swap_set_backend(args[1]);
+		if (result) {
+			kprintf("swap: %s: %s\n", args[1], strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: swap [%s | lhdN]\n", SWAP_BACKEND_FILE);
+		return EINVAL;
+	}
+
+	backend = swap_get_backend(&nslots);
+	kprintf("Swap backend: %s (%u slots, %u KB)\n", backend, nslots,
+		nslots * (PAGE_SIZE / 1024));
+	return 0;
+}
+#endif
+
+#if OPT_SFS
+/*
+ * Command for printing the buffer cache statistics.
+ */
+static
+int
+cmd_bufcachestats(int nargs, char **args)
+{
+	struct bufcache_stats stats;
+	unsigned long long lookups;
+
+	(void)nargs;
+	(void)args;
+
+	bufcache_getstats(&stats);
+	lookups = stats.bs_hits + stats.bs_misses;
+	kprintf("Buffer cache: %u buffers (%u dirty), budget %u\n",
+		stats.bs_nbufs, stats.bs_ndirty, stats.bs_budget);
+	kprintf("    hits %llu  misses %llu  hit rate %llu%%\n",
+		stats.bs_hits, stats.bs_misses,
+		lookups ? stats.bs_hits * 100 / lookups : 0);
+	kprintf("    writebacks %llu  evictions %llu  uncached %llu\n",
+		stats.bs_writebacks, stats.bs_evictions, stats.bs_uncached);
+	kprintf("    read ahead %llu  (%llu used)  window %u blocks\n",
+		stats.bs_prefetched, stats.bs_prefetch_hits,
+		sfs_get_readahead());
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -580,6 +757,14 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if OPT_SFS
+	"[fsrb] SFS sequential read bench    ",
+	"[fscb] SFS concurrency bench        ",
+#endif
+#if OPT_PAGING
+	"[cmt] Coremap alloc latency test    ",
+#endif
+	"[lhdb] Disk scheduling benchmark    ",
 	NULL
 };
 
@@ -604,6 +789,16 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[dc] Name cache stats               ",
+#if OPT_SFS
+	"[bc] Buffer cache stats             ",
+#endif
+#if OPT_PAGING
+	"[vmpolicy] Page replacement policy  ",
+	"[vmwm] Pageout daemon watermarks    ",
+	"[vmfa] TLB fault-around pages       ",
+	"[swap] Swap backend                 ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -655,6 +850,16 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "dc",		cmd_dcachestats },
+#if OPT_SFS
+	{ "bc",		cmd_bufcachestats },
+#endif
+#if OPT_PAGING
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "vmwm",	cmd_vmwatermarks },
+	{ "vmfa",	cmd_vmfaultaround },
+	{ "swap",	cmd_swap },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -709,6 +914,18 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+#if OPT_SFS
+	{ "fsrb",	fsreadbench },
+	{ "fscb",	fsconcbench },
+#endif
+
+#if OPT_PAGING
+	/* VM tests */
+	{ "cmt",	coremaptest },
+#endif
+
+	/* disk driver tests */
+	{ "lhdb",	lhdbench },
 
 	{ NULL, NULL }
 };
@@ -309,12 +309,16 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
+	/*
+	 * With OPT_PAGING the segments are loaded on demand by vm_fault,
+	 * which must honour their permissions from now on.
+	 */
 	result = as_complete_load(as);
 	if (result) {
 		return result;
 	}
-#endif
 
 	*entrypoint = eh.e_entry;
 
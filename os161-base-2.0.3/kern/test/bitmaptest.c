@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -40,7 +41,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, j;
 
 	(void)nargs;
 	(void)args;
@@ -89,6 +90,17 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	for (i=0; i<TESTSIZE; i+=37) {
+		for (j=0; j<TESTSIZE && !data[(i+j)%TESTSIZE]; j++);
+		if (j == TESTSIZE) {
+			KASSERT(bitmap_find_clear(b, i, &x)==ENOSPC);
+		}
+		else {
+			KASSERT(bitmap_find_clear(b, i, &x)==0);
+			KASSERT(x == (unsigned)(i+j)%TESTSIZE);
+		}
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -100,6 +112,7 @@ bitmaptest(int nargs, char **args)
 		KASSERT(bitmap_isset(b, i));
 		KASSERT(data[i]==0);
 	}
+	KASSERT(bitmap_find_clear(b, TESTSIZE-1, &x)==ENOSPC);
 
 	kprintf("Bitmap test complete\n");
 	return 0;
@@ -0,0 +1,140 @@
+/*
+ * Test di latenza per l'allocatore di frame della coremap.
+ *
+ * Misura il tempo medio di allocazione e rilascio di frame singoli e di
+ * blocchi contigui di frame (come richiesti da get_kernel_frame(num)),
+ * anche in presenza di frammentazione. I tempi sono assoluti: il test
+ * non dispone di un termine di confronto.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <test.h>
+
+#define CMT_NFRAMES  32
+#define CMT_ROUNDS   32
+
+/*
+ * Verifica che gli n blocchi di num frame non si sovrappongano.
+ */
+static
+int
+cmt_check(const char *name, const paddr_t *frames, unsigned n, unsigned num)
+{
+	paddr_t size = num * PAGE_SIZE;
+	unsigned i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (frames[i] < frames[j] + size &&
+			    frames[j] < frames[i] + size) {
+				kprintf("cmt: %s: blocks at 0x%x and 0x%x "
+					"overlap\n", name, frames[i], frames[j]);
+				return EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+static
+unsigned long
+cmt_elapsed_ns(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec duration;
+
+	timespec_sub(after, before, &duration);
+	return duration.tv_sec * 1000000000UL + duration.tv_nsec;
+}
+
+/*
+ * Alloca e rilascia ROUNDS volte NFRAMES blocchi di num frame; se
+ * interleave è impostato rilascia prima i blocchi di indice pari e poi
+ * quelli di indice dispari, in modo da frammentare la memoria libera.
+ */
+static
+int
+cmt_run(const char *name, unsigned num, bool interleave)
+{
+	paddr_t frames[CMT_NFRAMES];
+	struct timespec before, after;
+	unsigned long alloc_ns = 0, free_ns = 0, ops = 0;
+	unsigned i, j, round;
+	int result;
+
+	for (round = 0; round < CMT_ROUNDS; round++) {
+		gettime(&before);
+		for (i = 0; i < CMT_NFRAMES; i++) {
+			frames[i] = get_kernel_frame(num);
+			if (frames[i] == 0) {
+				kprintf("cmt: %s: allocation of %u frames "
+					"failed\n", name, num);
+				for (j = 0; j < i; j++) {
+					free_frame(frames[j]);
+				}
+				return ENOMEM;
+			}
+			KASSERT((frames[i] & PAGE_FRAME) == frames[i]);
+		}
+		gettime(&after);
+		alloc_ns += cmt_elapsed_ns(&before, &after);
+		result = cmt_check(name, frames, CMT_NFRAMES, num);
+
+		gettime(&before);
+		if (interleave) {
+			for (i = 0; i < CMT_NFRAMES; i += 2) {
+				free_frame(frames[i]);
+			}
+			for (i = 1; i < CMT_NFRAMES; i += 2) {
+				free_frame(frames[i]);
+			}
+		}
+		else {
+			for (i = 0; i < CMT_NFRAMES; i++) {
+				free_frame(frames[i]);
+			}
+		}
+		gettime(&after);
+		free_ns += cmt_elapsed_ns(&before, &after);
+		ops += CMT_NFRAMES;
+		if (result) {
+			return result;
+		}
+	}
+
+	kprintf("cmt: %-24s alloc %6lu ns/op   free %6lu ns/op\n",
+		name, alloc_ns / ops, free_ns / ops);
+	return 0;
+}
+
+int
+coremaptest(int nargs, char **args)
+{
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting coremap allocation latency test...\n");
+
+	result = cmt_run("1 frame", 1, false);
+	if (!result) {
+		result = cmt_run("1 frame, fragmented", 1, true);
+	}
+	if (!result) {
+		result = cmt_run("2 frames", 2, false);
+	}
+	if (!result) {
+		result = cmt_run("3 frames, fragmented", 3, true);
+	}
+	if (!result) {
+		result = cmt_run("4 frames", 4, false);
+	}
+
+	kprintf("Coremap allocation latency test %s\n",
+		result ? "failed" : "done");
+	return result;
+}
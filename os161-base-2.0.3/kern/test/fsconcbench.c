@@ -0,0 +1,194 @@
+/*
+ * Benchmark di scalabilità di SFS con più thread.
+ *
+ * Ogni thread scrive e poi rilegge un proprio file di kb KB sul file
+ * system indicato, a blocchi di FSCB_CHUNK byte. Il carico viene
+ * eseguito con 1, 2 e 4 thread, riportando il tempo e il throughput
+ * complessivo: con i lock per vnode e per volume thread che lavorano
+ * su file diversi procedono in parallelo, per cui su una configurazione
+ * di sys161 con più CPU il throughput cresce con il numero di thread.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FSCB_CHUNK      4096
+#define FSCB_MAXTHREADS 4
+#define FSCB_DEFAULTKB  256	/* per thread */
+
+static const char *fscb_fs;
+static unsigned fscb_nchunks;
+static struct semaphore *fscb_donesem;
+static volatile int fscb_errors;
+
+static
+void
+fscb_name(char *buf, size_t len, unsigned long num)
+{
+	snprintf(buf, len, "%s:fscb%lu.tmp", fscb_fs, num);
+}
+
+/*
+ * Esegue il trasferimento di tutti i blocchi del file aperto vn.
+ */
+static
+int
+fscb_pass(struct vnode *vn, char *buf, unsigned long num, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	for (i = 0; i < fscb_nchunks; i++) {
+		if (rw == UIO_WRITE) {
+			memset(buf, num + i, FSCB_CHUNK);
+		}
+		uio_kinit(&iov, &ku, buf, FSCB_CHUNK,
+			  (off_t)i * FSCB_CHUNK, rw);
+		result = rw == UIO_WRITE ? VOP_WRITE(vn, &ku)
+					 : VOP_READ(vn, &ku);
+		if (result == 0 && ku.uio_resid > 0) {
+			result = rw == UIO_WRITE ? ENOSPC : EIO;
+		}
+		if (result) {
+			return result;
+		}
+		if (rw == UIO_READ && buf[FSCB_CHUNK - 1] != (char)(num + i)) {
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+static
+void
+fscb_thread(void *buf, unsigned long num)
+{
+	char path[64];
+	struct vnode *vn;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	fscb_name(path, sizeof(path), num);
+	result = vfs_open(path, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result == 0) {
+		result = fscb_pass(vn, buf, num, UIO_WRITE);
+		if (result == 0) {
+			result = fscb_pass(vn, buf, num, UIO_READ);
+		}
+		vfs_close(vn);
+	}
+	if (result) {
+		kprintf("fscb: thread %lu: %s\n", num, strerror(result));
+		fscb_errors++;
+	}
+	V(fscb_donesem);
+}
+
+static
+int
+fscb_run(unsigned nthreads, char **bufs)
+{
+	struct timespec before, after, duration;
+	unsigned long long ns;
+	char path[64];
+	unsigned i;
+	int result;
+
+	fscb_errors = 0;
+	gettime(&before);
+	for (i = 0; i < nthreads; i++) {
+		result = thread_fork("fscb", NULL, fscb_thread, bufs[i], i);
+		if (result) {
+			panic("fscb: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		P(fscb_donesem);
+	}
+	gettime(&after);
+
+	for (i = 0; i < nthreads; i++) {
+		fscb_name(path, sizeof(path), i);
+		vfs_remove(path);
+	}
+	if (fscb_errors) {
+		return EIO;
+	}
+
+	timespec_sub(&after, &before, &duration);
+	ns = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	/* ogni blocco viene scritto e letto una volta */
+	kprintf("fscb: %u thread%s %6llu ms  %5llu KB/s\n", nthreads,
+		nthreads == 1 ? " " : "s", ns / 1000000,
+		2ULL * nthreads * fscb_nchunks * (FSCB_CHUNK / 1024) *
+		1000000000ULL / ns);
+	return 0;
+}
+
+int
+fsconcbench(int nargs, char **args)
+{
+	char *bufs[FSCB_MAXTHREADS];
+	unsigned kb = FSCB_DEFAULTKB, nthreads, i;
+	int result = 0;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fscb filesystem [kb]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		kb = atoi(args[2]);
+	}
+	fscb_nchunks = kb / (FSCB_CHUNK / 1024);
+	if (fscb_nchunks == 0) {
+		kprintf("fscb: file size must be at least %u KB\n",
+			FSCB_CHUNK / 1024);
+		return EINVAL;
+	}
+	fscb_fs = args[1];
+
+	fscb_donesem = sem_create("fscb", 0);
+	if (fscb_donesem == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < FSCB_MAXTHREADS; i++) {
+		bufs[i] = kmalloc(FSCB_CHUNK);
+		if (bufs[i] == NULL) {
+			while (i-- > 0) {
+				kfree(bufs[i]);
+			}
+			sem_destroy(fscb_donesem);
+			return ENOMEM;
+		}
+	}
+
+	kprintf("Starting SFS concurrency benchmark on %s (%u KB per "
+		"thread)...\n", fscb_fs, fscb_nchunks * (FSCB_CHUNK / 1024));
+	for (nthreads = 1; nthreads <= FSCB_MAXTHREADS; nthreads *= 2) {
+		result = fscb_run(nthreads, bufs);
+		if (result) {
+			break;
+		}
+	}
+
+	for (i = 0; i < FSCB_MAXTHREADS; i++) {
+		kfree(bufs[i]);
+	}
+	sem_destroy(fscb_donesem);
+	kprintf("SFS concurrency benchmark %s\n", result ? "failed" : "done");
+	return result;
+}
@@ -0,0 +1,189 @@
+/*
+ * Benchmark per la coda di richieste del disco lhd.
+ *
+ * Un thread scrive in sequenza pagine consecutive all'inizio del disco,
+ * come bigfile che estende un file, mentre altri thread leggono e
+ * scrivono pagine in posizioni casuali della seconda metà, come lo
+ * swap-in e lo swap-out. Lo stesso carico viene eseguito servendo le
+ * richieste in ordine di arrivo e con C-LOOK, riportando tempo,
+ * throughput e distanza media percorsa dalla testina per settore.
+ *
+ * Il test sovrascrive il contenuto del disco: non usarlo sul disco
+ * che contiene il file system o lo swap in uso.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vm.h>
+#include <lamebus/lhd.h>
+#include <test.h>
+
+#define LHDB_PAGESECT   (PAGE_SIZE / LHD_SECTSIZE)
+#define LHDB_SEQPAGES   128	/* pagine scritte dal thread sequenziale */
+#define LHDB_NRANDOM    3	/* thread che simulano lo swap */
+#define LHDB_RANDPAGES  64	/* pagine trasferite da ogni thread casuale */
+
+static struct lhd_softc *lhdb_disk;
+static struct semaphore *lhdb_donesem;
+static int lhdb_errors;
+
+/*
+ * Trasferisce la pagina che inizia dal settore sector.
+ */
+static
+int
+lhdb_page(void *buf, uint32_t sector, bool write)
+{
+	struct lhd_request req;
+	int result;
+
+	req.lr_sector = sector;
+	req.lr_nsect = LHDB_PAGESECT;
+	req.lr_buf = buf;
+	req.lr_write = write;
+	req.lr_done = NULL;
+	result = lhd_submit(lhdb_disk, &req);
+	if (result) {
+		return result;
+	}
+	lhd_wait(lhdb_disk, &req);
+	return req.lr_result;
+}
+
+static
+void
+lhdb_sequential(void *buf, unsigned long unused)
+{
+	unsigned i;
+
+	(void)unused;
+	for (i = 0; i < LHDB_SEQPAGES; i++) {
+		if (lhdb_page(buf, i * LHDB_PAGESECT, true)) {
+			lhdb_errors++;
+			break;
+		}
+	}
+	V(lhdb_donesem);
+}
+
+static
+void
+lhdb_random(void *buf, unsigned long npages)
+{
+	unsigned i, page;
+
+	for (i = 0; i < LHDB_RANDPAGES; i++) {
+		page = npages / 2 + random() % (npages - npages / 2);
+		if (lhdb_page(buf, page * LHDB_PAGESECT, i % 2 == 0)) {
+			lhdb_errors++;
+			break;
+		}
+	}
+	V(lhdb_donesem);
+}
+
+static
+int
+lhdb_run(const char *name, int policy, void **bufs, unsigned npages)
+{
+	struct timespec before, after, duration;
+	struct lhd_stats stats;
+	unsigned long long ns;
+	unsigned i;
+	int result;
+
+	lhd_set_sched(policy);
+	lhd_resetstats(lhdb_disk);
+	lhdb_errors = 0;
+
+	gettime(&before);
+	result = thread_fork("lhdb-seq", NULL, lhdb_sequential, bufs[0], 0);
+	if (result) {
+		return result;
+	}
+	for (i = 0; i < LHDB_NRANDOM; i++) {
+		result = thread_fork("lhdb-rand", NULL, lhdb_random,
+				     bufs[i + 1], npages);
+		if (result) {
+			panic("lhdb: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < LHDB_NRANDOM + 1; i++) {
+		P(lhdb_donesem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	ns = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	lhd_getstats(lhdb_disk, &stats);
+	if (stats.ls_sectors == 0) {
+		return EIO;
+	}
+
+	kprintf("lhdb: %-6s %6llu ms  %5llu KB/s  seek %5llu sectors/cmd  "
+		"%llu/%llu requests merged\n", name, ns / 1000000,
+		stats.ls_sectors * LHD_SECTSIZE / 1024 * 1000000000ULL / ns,
+		stats.ls_seek / stats.ls_sectors,
+		stats.ls_merged, stats.ls_requests);
+	return lhdb_errors ? EIO : 0;
+}
+
+int
+lhdbench(int nargs, char **args)
+{
+	void *bufs[LHDB_NRANDOM + 1];
+	unsigned npages, i;
+	int result = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: lhdb unit\n");
+		kprintf("Overwrites the contents of lhd<unit>.\n");
+		return EINVAL;
+	}
+
+	lhdb_disk = lhd_lookup(atoi(args[1]));
+	if (lhdb_disk == NULL) {
+		kprintf("lhdb: no such disk lhd%s\n", args[1]);
+		return ENODEV;
+	}
+	npages = lhdb_disk->lh_dev.d_blocks / LHDB_PAGESECT;
+	if (npages < 2 * LHDB_SEQPAGES) {
+		kprintf("lhdb: lhd%s is too small\n", args[1]);
+		return EINVAL;
+	}
+
+	lhdb_donesem = sem_create("lhdb", 0);
+	if (lhdb_donesem == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < LHDB_NRANDOM + 1; i++) {
+		bufs[i] = kmalloc(PAGE_SIZE);
+		if (bufs[i] == NULL) {
+			while (i-- > 0) {
+				kfree(bufs[i]);
+			}
+			sem_destroy(lhdb_donesem);
+			return ENOMEM;
+		}
+		memset(bufs[i], i, PAGE_SIZE);
+	}
+
+	kprintf("Starting lhd scheduling benchmark on lhd%s...\n", args[1]);
+	if (lhdb_run("fifo", LHD_SCHED_FIFO, bufs, npages) ||
+	    lhdb_run("c-look", LHD_SCHED_CLOOK, bufs, npages)) {
+		kprintf("lhdb: I/O error\n");
+		result = EIO;
+	}
+	lhd_set_sched(LHD_SCHED_CLOOK);
+
+	for (i = 0; i < LHDB_NRANDOM + 1; i++) {
+		kfree(bufs[i]);
+	}
+	sem_destroy(lhdb_donesem);
+	kprintf("lhd scheduling benchmark %s\n", result ? "failed" : "done");
+	return result;
+}
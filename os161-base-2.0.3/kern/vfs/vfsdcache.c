@@ -0,0 +1,322 @@
+/*
+ * Cache dei nomi del VFS (dcache).
+ *
+ * Associa la coppia (directory, nome) al vnode trovato da VOP_LOOKUP,
+ * oppure all'assenza del nome (voce negativa), così che vfs_lookup non
+ * debba scorrere la directory a ogni ricerca. Vengono memorizzati solo
+ * nomi di un singolo componente e solo per i file system che lo
+ * consentono (fs_dcache), i quali invalidano le voci toccate da ogni
+ * modifica di una directory con vfs_dcache_invalidate.
+ *
+ * Ogni voce tiene un riferimento alla directory e al vnode trovato. Le
+ * voci sono in una tabella hash e in una lista LRU, limitata a
+ * DC_MAXENTRIES voci; tutto è protetto da dc_lock. I riferimenti delle
+ * voci rimosse vengono rilasciati dopo aver lasciato dc_lock, perché
+ * VOP_DECREF può entrare nel file system.
+ *
+ * dc_gen cresce a ogni invalidazione: una ricerca fallita in cache
+ * inserisce il risultato di VOP_LOOKUP solo se nel frattempo nessuna
+ * voce è stata invalidata, altrimenti potrebbe inserire un nome appena
+ * rimosso o non vedere un file appena creato.
+ */
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <fs.h>
+#include <vnode.h>
+#include <vfs.h>
+
+#define DC_HASH_SIZE  64
+#define DC_MAXENTRIES 128
+
+struct dcentry {
+	struct vnode *de_dir;
+	struct vnode *de_vn;		/* NULL per una voce negativa */
+	char *de_name;
+	struct dcentry *de_hnext;	/* catena della tabella hash */
+	struct dcentry *de_prev, *de_next; /* lista LRU, da dc_mru a dc_lru */
+};
+
+static struct lock *dc_lock;
+static struct dcentry *dc_hash[DC_HASH_SIZE];
+static struct dcentry *dc_mru;	/* voce usata più di recente */
+static struct dcentry *dc_lru;	/* voce usata meno di recente */
+static unsigned dc_gen;
+static struct vfs_dcache_stats dc_stats;
+
+static
+unsigned
+dc_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % DC_HASH_SIZE;
+}
+
+static
+struct dcentry **
+dc_find(struct vnode *dir, const char *name)
+{
+	struct dcentry **p;
+
+	for (p = &dc_hash[dc_hashfn(dir, name)]; *p != NULL;
+	     p = &(*p)->de_hnext) {
+		if ((*p)->de_dir == dir && !strcmp((*p)->de_name, name)) {
+			break;
+		}
+	}
+	return p;
+}
+
+static
+void
+dc_lru_remove(struct dcentry *de)
+{
+	if (de->de_prev != NULL) {
+		de->de_prev->de_next = de->de_next;
+	}
+	else {
+		dc_mru = de->de_next;
+	}
+	if (de->de_next != NULL) {
+		de->de_next->de_prev = de->de_prev;
+	}
+	else {
+		dc_lru = de->de_prev;
+	}
+	de->de_prev = de->de_next = NULL;
+}
+
+static
+void
+dc_lru_push(struct dcentry *de)
+{
+	de->de_prev = NULL;
+	de->de_next = dc_mru;
+	if (dc_mru != NULL) {
+		dc_mru->de_prev = de;
+	}
+	else {
+		dc_lru = de;
+	}
+	dc_mru = de;
+}
+
+/*
+ * Toglie dalla cache la voce puntata da p e la accoda a *freelist, da
+ * cui dc_release la libererà senza dc_lock.
+ */
+static
+void
+dc_unlink(struct dcentry **p, struct dcentry **freelist)
+{
+	struct dcentry *de = *p;
+
+	*p = de->de_hnext;
+	dc_lru_remove(de);
+	de->de_hnext = *freelist;
+	*freelist = de;
+	dc_stats.ds_entries--;
+}
+
+static
+void
+dc_release(struct dcentry *freelist)
+{
+	struct dcentry *de;
+
+	KASSERT(!lock_do_i_hold(dc_lock));
+
+	while (freelist != NULL) {
+		de = freelist;
+		freelist = de->de_hnext;
+		if (de->de_vn != NULL) {
+			VOP_DECREF(de->de_vn);
+		}
+		VOP_DECREF(de->de_dir);
+		kfree(de->de_name);
+		kfree(de);
+	}
+}
+
+/*
+ * Solo i nomi di un singolo componente su un file system che lo
+ * consente possono stare in cache.
+ */
+static
+bool
+dc_cacheable(struct vnode *dir, const char *name)
+{
+	return dir->vn_fs != NULL && dir->vn_fs->fs_dcache &&
+		name[0] != 0 && strchr(name, '/') == NULL;
+}
+
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dc_lock = lock_create("vfs_dcache");
+	if (dc_lock == NULL) {
+		panic("vfs: Could not create the name cache lock\n");
+	}
+	for (i = 0; i < DC_HASH_SIZE; i++) {
+		dc_hash[i] = NULL;
+	}
+	dc_mru = dc_lru = NULL;
+	dc_gen = 0;
+}
+
+/*
+ * Cerca name in dir. Se la voce è presente ritorna true e in *ret il
+ * vnode, con un riferimento in più, oppure NULL se il nome non esiste.
+ * Altrimenti ritorna false e in *gen la generazione da passare a
+ * vfs_dcache_enter.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		  unsigned *gen)
+{
+	struct dcentry *de;
+
+	if (!dc_cacheable(dir, name)) {
+		*gen = 0;
+		return false;
+	}
+
+	lock_acquire(dc_lock);
+	de = *dc_find(dir, name);
+	if (de == NULL) {
+		dc_stats.ds_misses++;
+		*gen = dc_gen;
+		lock_release(dc_lock);
+		return false;
+	}
+
+	if (de->de_vn != NULL) {
+		dc_stats.ds_hits++;
+		VOP_INCREF(de->de_vn);
+	}
+	else {
+		dc_stats.ds_neghits++;
+	}
+	*ret = de->de_vn;
+	dc_lru_remove(de);
+	dc_lru_push(de);
+	lock_release(dc_lock);
+	return true;
+}
+
+/*
+ * Inserisce il risultato di una ricerca fallita in cache: vn è il
+ * vnode trovato, NULL se il nome non esiste.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *de, *freelist = NULL;
+
+	if (!dc_cacheable(dir, name)) {
+		return;
+	}
+
+	de = kmalloc(sizeof(struct dcentry));
+	if (de == NULL) {
+		return;
+	}
+	de->de_name = kstrdup(name);
+	if (de->de_name == NULL) {
+		kfree(de);
+		return;
+	}
+	de->de_dir = dir;
+	de->de_vn = vn;
+
+	lock_acquire(dc_lock);
+	if (gen != dc_gen || *dc_find(dir, name) != NULL) {
+		/* la directory è cambiata, o un altro thread ha già inserito il nome */
+		lock_release(dc_lock);
+		kfree(de->de_name);
+		kfree(de);
+		return;
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	if (dc_stats.ds_entries >= DC_MAXENTRIES) {
+		dc_unlink(dc_find(dc_lru->de_dir, dc_lru->de_name), &freelist);
+		dc_stats.ds_evictions++;
+	}
+	de->de_hnext = dc_hash[dc_hashfn(dir, name)];
+	dc_hash[dc_hashfn(dir, name)] = de;
+	dc_lru_push(de);
+	dc_stats.ds_entries++;
+	lock_release(dc_lock);
+
+	dc_release(freelist);
+}
+
+/*
+ * Rimuove la voce di name in dir, da chiamare a ogni creazione,
+ * rimozione o cambio di nome. Il chiamante ha un riferimento a dir e,
+ * se il nome esiste, al suo vnode, per cui rilasciare quelli della
+ * voce non può distruggere alcun vnode.
+ */
+void
+vfs_dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry **p, *freelist = NULL;
+
+	lock_acquire(dc_lock);
+	dc_gen++;
+	p = dc_find(dir, name);
+	if (*p != NULL) {
+		dc_unlink(p, &freelist);
+		dc_stats.ds_invalidations++;
+	}
+	lock_release(dc_lock);
+
+	dc_release(freelist);
+}
+
+/*
+ * Rimuove tutte le voci di fs, prima di smontarlo: altrimenti i loro
+ * riferimenti lo terrebbero occupato.
+ */
+void
+vfs_dcache_purge(struct fs *fs)
+{
+	struct dcentry **p, *freelist = NULL;
+	unsigned i;
+
+	lock_acquire(dc_lock);
+	dc_gen++;
+	for (i = 0; i < DC_HASH_SIZE; i++) {
+		p = &dc_hash[i];
+		while (*p != NULL) {
+			if ((*p)->de_dir->vn_fs == fs) {
+				dc_unlink(p, &freelist);
+			}
+			else {
+				p = &(*p)->de_hnext;
+			}
+		}
+	}
+	lock_release(dc_lock);
+
+	dc_release(freelist);
+}
+
+void
+vfs_dcache_getstats(struct vfs_dcache_stats *stats)
+{
+	lock_acquire(dc_lock);
+	*stats = dc_stats;
+	lock_release(dc_lock);
+}
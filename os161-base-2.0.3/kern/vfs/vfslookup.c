@@ -246,11 +246,15 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The VFS lock protects the device table and bootfs while we
+	 * pick the starting vnode; the reference we get keeps it alive
+	 * after that, and the filesystem does its own locking.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -268,7 +272,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -276,25 +279,34 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	if (vfs_dcache_lookup(startvn, path, retval, &gen)) {
+		VOP_DECREF(startvn);
+		return *retval == NULL ? ENOENT : 0;
+	}
+
 	result = VOP_LOOKUP(startvn, path, retval);
+	if (result == 0) {
+		vfs_dcache_enter(startvn, path, *retval, gen);
+	}
+	else if (result == ENOENT) {
+		vfs_dcache_enter(startvn, path, NULL, gen);
+	}
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
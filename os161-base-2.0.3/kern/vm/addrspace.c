@@ -35,11 +35,10 @@
 #include <proc.h>
 
 #if OPT_PAGING
-#include <spl.h>
-#include <mips/tlb.h>
+#include <vm_tlb.h>
 #include <vfs.h>
 #include <vnode.h>
-#include <vm_stats.h>
+#include <uio.h>
 #include <current.h>
 #endif
 /*
@@ -72,6 +71,9 @@ as_create(void) {
     as->active = true;
 
     as->index = 0;
+    as->ignore_permissions = 0;
+    as->asid_generation = 0;  // l'ASID viene assegnato alla prima attivazione
+    as->asid_cpu = 0;
 #endif
     return as;
 }
@@ -100,6 +102,8 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
     newas->active = true;
     // page_table_copy
     err = pt_copy(old->page_table, newas->page_table);
+    // le pagine ora condivise con il figlio potrebbero essere mappate in scrittura nella TLB del padre
+    tlb_invalidate_as(old);
     if (err != 0) {
         as_destroy(newas);
         *ret = NULL;
@@ -128,7 +132,6 @@ void as_destroy(struct addrspace *as) {
 
 void as_activate(void) {
 #if OPT_PAGING
-    int i, spl;
     struct addrspace *as;
 
     as = proc_getas();
@@ -136,15 +139,8 @@ void as_activate(void) {
         return;
     }
 
-    /* Disable interrupts on this CPU while frobbing the TLB. */
-    spl = splhigh();
-    inc_counter(tlb_invalidations);
-
-    for (i = 0; i < NUM_TLB; i++) {
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-    }
-
-    splx(spl);
+    // le entry degli altri address space rimangono nella TLB, distinte tramite l'ASID
+    tlb_activate(as);
 #else
     struct addrspace *as;
 
@@ -252,9 +248,11 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
 }
 
 #if OPT_PAGING
-int load_page(struct addrspace *as, vaddr_t vaddr) {
+int load_page(struct addrspace *as, vaddr_t vaddr, paddr_t frame) {
     int i = 0, err = 0;
     unsigned int first_offset = 0, f_size, m_size;
+    struct iovec iov;
+    struct uio u;
     for (i = 0; i < N_SEGMENTS; i++) {
         if (vaddr >= as->segments[i].p_vaddr && vaddr < as->segments[i].p_vaddr + as->segments[i].p_memsz)
             break;
@@ -288,12 +286,42 @@ int load_page(struct addrspace *as, vaddr_t vaddr) {
     // calcolo quantità da leggere da file
     f_size = (m_size > as->segments[i].p_file_end - first_offset) ? as->segments[i].p_file_end - first_offset : m_size;
     
-    as_prepare_load(as);
-    err = load_segment(as, as->file, first_offset, vaddr, m_size, f_size, as->segments[i].executable);
-    as_complete_load(as);
+    /*
+     * La lettura avviene direttamente nel frame, tramite il suo indirizzo kernel: non passando per l'indirizzo user
+     * non causa un fault annidato sulla pagina che si sta caricando.
+     */
+    uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(frame) + (~PAGE_FRAME & vaddr)), f_size, first_offset, UIO_READ);
+    err = VOP_READ(as->file, &u);
     if(err)
         return err;    
+    if (u.uio_resid != 0) {
+        kprintf("ELF: short read on segment - file truncated?\n");
+        return ENOEXEC;
+    }
     
     return 0;
 }
+
+unsigned int as_page_file_size(struct addrspace *as, vaddr_t vaddr) {
+    int i;
+    unsigned int first_offset, m_size;
+    if (vaddr >= PROJECT_STACK_MIN_ADDRESS)
+        return 0;
+    for (i = 0; i < N_SEGMENTS; i++) {
+        if (vaddr >= as->segments[i].p_vaddr && vaddr < as->segments[i].p_vaddr + as->segments[i].p_memsz)
+            break;
+    }
+
+    KASSERT(i < N_SEGMENTS);
+
+    // stessi calcoli di load_page
+    vaddr = vaddr & PAGE_FRAME;
+    if( vaddr < as->segments[i].p_vaddr )  // se l'inizio di pagina non appartiene al segmento
+        vaddr = as->segments[i].p_vaddr;
+    m_size = PAGE_SIZE - (~PAGE_FRAME & vaddr);
+    first_offset = as->segments[i].p_file_start + (vaddr - as->segments[i].p_vaddr);
+    if ( first_offset >= as->segments[i].p_file_end )  // BSS
+        return 0;
+    return (m_size > as->segments[i].p_file_end - first_offset) ? as->segments[i].p_file_end - first_offset : m_size;
+}
 #endif
@@ -0,0 +1,236 @@
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <cm_policy.h>
+#include <pt.h>
+#include <vm_tlb.h>
+
+#define LRU_CLEAN_WINDOW 4 /* pagine non referenziate esaminate dalla politica lru in cerca di una pagina pulita */
+
+/*
+ * FIFO e LRU: i frame che contengono una pagina user sono collegati in una lista doppiamente concatenata tramite i campi
+ * next e prev della cm_entry, dalla testa (pagina meno recente) alla coda (pagina più recente). Le due politiche non sono
+ * mai attive contemporaneamente e activate ricostruisce la lista.
+ */
+static int32_t list_head = CM_NO_FRAME;
+static int32_t list_tail = CM_NO_FRAME;
+
+static void list_append(struct cm_entry* coremap, unsigned int index) {
+    coremap[index].next = CM_NO_FRAME;
+    coremap[index].prev = list_tail;
+    if (list_tail != CM_NO_FRAME)
+        coremap[list_tail].next = index;
+    else
+        list_head = index;
+    list_tail = index;
+}
+
+static void list_remove(struct cm_entry* coremap, unsigned int index) {
+    if (coremap[index].prev != CM_NO_FRAME)
+        coremap[coremap[index].prev].next = coremap[index].next;
+    else
+        list_head = coremap[index].next;
+    if (coremap[index].next != CM_NO_FRAME)
+        coremap[coremap[index].next].prev = coremap[index].prev;
+    else
+        list_tail = coremap[index].prev;
+    coremap[index].next = coremap[index].prev = CM_NO_FRAME;
+}
+
+// il frame è nella lista? I frame vittima di uno swap-out in corso ne sono stati tolti; un frame condiviso è fixed solo durante lo swap-out
+static bool list_member(struct cm_entry* coremap, unsigned int index) {
+    return coremap[index].occ && CM_USER(coremap, index) &&
+           !(coremap[index].pt_entry != NULL ? coremap[index].pt_entry->swapping : coremap[index].fixed);
+}
+
+// l'ordine di allocazione e di accesso delle pagine già presenti non è noto: vengono accodate in ordine di frame
+static void list_activate(struct cm_entry* coremap, unsigned int npages) {
+    unsigned int i;
+    list_head = list_tail = CM_NO_FRAME;
+    for (i = 0; i < npages; i += CM_STEP(coremap, i)) {
+        if (list_member(coremap, i))
+            list_append(coremap, i);
+    }
+}
+
+/*
+ * FIFO: i frame sono accodati in ordine di allocazione; viene scelto il primo frame della lista che possa essere scelto
+ * come vittima.
+ */
+static int fifo_select_victim(struct cm_entry* coremap, unsigned int npages) {
+    int32_t i;
+    (void)npages;
+    for (i = list_head; i != CM_NO_FRAME; i = coremap[i].next) {
+        if (CM_EVICTABLE(coremap, i))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Clock (second chance): la lancetta percorre la coremap e a ogni frame referenziato toglie il bit di riferimento,
+ * invalidando la relativa entry della TLB, così che un nuovo accesso alla pagina causi un TLB reload che lo reimposti.
+ * Durante il primo giro viene scelta la prima pagina non referenziata e pulita (ricaricabile dal file ELF senza scrittura
+ * nello swap file); se non ne esistono viene scelta la prima pagina non referenziata incontrata.
+ */
+static unsigned int clock_hand = 0;
+
+static void clock_activate(struct cm_entry* coremap, unsigned int npages) {
+    (void)coremap;
+    if (clock_hand >= npages)
+        clock_hand = 0;
+}
+
+static int clock_select_victim(struct cm_entry* coremap, unsigned int npages) {
+    unsigned int scanned = 0, step;
+    int victim = -1, dirty_victim = -1;
+    while (scanned < 2 * npages && victim == -1) {
+        step = CM_STEP(coremap, clock_hand);
+        scanned += step;
+        clock_hand = (clock_hand + step) % npages;
+        if (!CM_EVICTABLE(coremap, clock_hand))
+            continue;
+        if (coremap[clock_hand].ref) {  // seconda possibilità
+            coremap[clock_hand].ref = false;
+            // solo nella TLB di questa cpu: gli accessi tramite le entry di altre cpu non reimpostano ref, costa solo precisione
+            invalidate_entry_by_paddr(clock_hand * PAGE_SIZE);
+            continue;
+        }
+        if (!CM_DIRTY(coremap, clock_hand))
+            victim = clock_hand;
+        else if (dirty_victim == -1)
+            dirty_victim = clock_hand;
+        if (victim == -1 && scanned >= npages)  // dopo un giro completo mi accontento di una pagina sporca
+            victim = dirty_victim;
+    }
+    if (victim == -1)
+        victim = dirty_victim;
+    return victim;
+}
+
+static void ref_on_access(struct cm_entry* coremap, unsigned int index) {
+    coremap[index].ref = true;
+}
+
+static void ref_on_alloc(struct cm_entry* coremap, unsigned int index) {
+    coremap[index].ref = false;
+}
+
+/*
+ * LRU: i frame sono in ordine di ultimo caricamento in TLB, a ogni TLB reload il frame viene spostato in coda. Una pagina
+ * usata senza TLB miss non viene spostata: per questo una pagina in testa alla lista con il bit di riferimento impostato
+ * riceve una seconda possibilità, come in clock, e viene spostata in coda dopo aver tolto il bit e invalidato la sua entry
+ * della TLB. Viene scelta la prima pagina non referenziata, preferendo una pagina pulita tra le prime LRU_CLEAN_WINDOW.
+ * Ogni selezione esamina la testa della lista invece dell'intera coremap: il costo è proporzionale alle pagine
+ * referenziate dall'ultima selezione.
+ */
+static void lru_on_alloc(struct cm_entry* coremap, unsigned int index) {
+    ref_on_alloc(coremap, index);
+    list_append(coremap, index);
+}
+
+static void lru_on_access(struct cm_entry* coremap, unsigned int index) {
+    coremap[index].ref = true;
+    if (list_member(coremap, index) && list_tail != (int32_t)index) {
+        list_remove(coremap, index);
+        list_append(coremap, index);
+    }
+}
+
+static int lru_select_victim(struct cm_entry* coremap, unsigned int npages) {
+    int32_t i, next;
+    unsigned int scanned = 0, candidates = 0;
+    int victim = -1;
+    // le pagine spostate in coda hanno ref = false: al più due passate della lista
+    for (i = list_head; i != CM_NO_FRAME && scanned < 2 * npages && candidates < LRU_CLEAN_WINDOW; i = next) {
+        next = coremap[i].next;
+        scanned++;
+        if (!CM_EVICTABLE(coremap, i))
+            continue;
+        if (coremap[i].ref) {  // seconda possibilità
+            coremap[i].ref = false;
+            invalidate_entry_by_paddr(i * PAGE_SIZE);  // solo sulla cpu corrente, come in clock_select_victim
+            if (next == CM_NO_FRAME)  // è già in coda: non c'è altro da esaminare
+                next = i;
+            else {
+                list_remove(coremap, i);
+                list_append(coremap, i);
+            }
+            continue;
+        }
+        candidates++;
+        if (victim == -1 || (CM_DIRTY(coremap, victim) && !CM_DIRTY(coremap, i)))
+            victim = i;
+        if (!CM_DIRTY(coremap, victim))
+            break;
+    }
+    return victim;
+}
+
+/*
+ * Random: la ricerca di un frame che possa essere scelto come vittima parte da un frame casuale.
+ */
+static int random_select_victim(struct cm_entry* coremap, unsigned int npages) {
+    unsigned int i, start = random() % npages;
+    for (i = 0; i < npages; i++) {
+        if (CM_EVICTABLE(coremap, (start + i) % npages))
+            return (start + i) % npages;
+    }
+    return -1;
+}
+
+static void no_activate(struct cm_entry* coremap, unsigned int npages) {
+    (void)coremap;
+    (void)npages;
+}
+
+static void no_hook(struct cm_entry* coremap, unsigned int index) {
+    (void)coremap;
+    (void)index;
+}
+
+const struct cm_policy cm_policy_fifo = {
+    .name = "fifo",
+    .activate = list_activate,
+    .select_victim = fifo_select_victim,
+    .on_access = no_hook,
+    .on_alloc = list_append,
+    .on_free = list_remove,
+};
+
+const struct cm_policy cm_policy_clock = {
+    .name = "clock",
+    .activate = clock_activate,
+    .select_victim = clock_select_victim,
+    .on_access = ref_on_access,
+    .on_alloc = ref_on_alloc,
+    .on_free = no_hook,
+};
+
+const struct cm_policy cm_policy_lru = {
+    .name = "lru",
+    .activate = list_activate,
+    .select_victim = lru_select_victim,
+    .on_access = lru_on_access,
+    .on_alloc = lru_on_alloc,
+    .on_free = list_remove,
+};
+
+const struct cm_policy cm_policy_random = {
+    .name = "random",
+    .activate = no_activate,
+    .select_victim = random_select_victim,
+    .on_access = no_hook,
+    .on_alloc = no_hook,
+    .on_free = no_hook,
+};
+
+const struct cm_policy* const cm_policies[] = {
+    &cm_policy_fifo,
+    &cm_policy_clock,
+    &cm_policy_lru,
+    &cm_policy_random,
+    NULL
+};
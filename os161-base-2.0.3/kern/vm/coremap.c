@@ -10,220 +10,1226 @@
 #include <vm_tlb.h>
 #include <pt.h>
 #include <current.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <vm_stats.h>
+#include <platform/maxcpus.h>
+#include <cm_policy.h>
+#include <wchan.h>
 
-#define MAX_ATTEMPTS 5
+#define CM_MAGAZINE_SIZE  8 /* frame singoli riservati al più da ogni cpu */
+#define CM_MAGAZINE_BATCH 4 /* frame spostati in un colpo solo tra il magazine e il buddy allocator */
+
+#define CM_LOW_WATERMARK  16 /* frame liberi sotto i quali viene svegliato il pageout daemon */
+#define CM_HIGH_WATERMARK 32 /* frame liberi che il pageout daemon cerca di raggiungere */
+
+#define CM_ZERO_POOL_SIZE 32 /* frame già azzerati mantenuti dal thread pagezero */
+#define CM_ZERO_POOL_LOW  16 /* frame azzerati sotto i quali viene svegliato il thread pagezero */
+
+#define CM_SWAPOUT_WCHANS 16 /* wait channel su cui si attende il termine di uno swap-out, scelte in base al frame */
+
+/* stato dei thread del kernel della coremap (pageout daemon e pagezero) */
+#define PAGEOUT_NONE     0 /* non ancora avviato */
+#define PAGEOUT_RUNNING  1
+#define PAGEOUT_STOPPING 2 /* deve terminare */
+#define PAGEOUT_STOPPED  3
+
+/*
+ * Magazine di frame singoli riservati a una cpu. I frame contenuti sono marcati come occupati e fixed, con pt_entry
+ * NULL, quindi non sono visibili né al buddy allocator né alla selezione della vittima. Il magazine è acceduto dalla cpu a
+ * cui appartiene senza acquisire coremap_lock; lock, mai conteso se non da magazine_drain, permette a un'altra cpu di
+ * svuotarlo prima di ricorrere a uno swap-out. Va acquisito prima di coremap_lock.
+ */
+struct cm_magazine {
+    struct spinlock lock;                   /* protegge nframes e frames */
+    unsigned int nframes;                   /* frame presenti nel magazine */
+    unsigned int frames[CM_MAGAZINE_SIZE];  /* indici dei frame riservati */
+    unsigned long long hits;                /* allocazioni servite direttamente dal magazine */
+    unsigned long long misses;              /* allocazioni che hanno richiesto una ricarica dal pool globale */
+};
 
 static struct cm_entry* coremap = NULL;
 static unsigned int npages = 0;
 static unsigned int first_page = 0;
+static unsigned int zero_frame = 0; /* frame azzerato mappato in sola lettura dalle pagine anonime finché non vengono scritte */
+static int32_t free_area[CM_MAX_ORDER + 1]; /* teste delle liste dei blocchi liberi per ordine */
+static struct cm_magazine magazines[MAXCPUS]; /* un magazine per ogni struct cpu, indicizzato da c_number */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER; /* protegge la coremap e il buddy allocator */
+static const struct cm_policy* policy = &cm_policy_clock; /* politica di sostituzione attiva */
+static unsigned int nfree = 0; /* frame liberi nel buddy allocator (esclusi quelli nei magazine) */
+static unsigned int low_watermark = CM_LOW_WATERMARK;
+static unsigned int high_watermark = CM_HIGH_WATERMARK;
+static int pageout_state = PAGEOUT_NONE;
+static struct wchan* pageout_wchan = NULL; /* il pageout daemon attende qui che i frame liberi scendano sotto low_watermark */
+static struct wchan* pageout_done_wchan = NULL; /* coremap_stop_pageout attende qui la terminazione del daemon */
+static unsigned int daemons = 0; /* thread del kernel della coremap non ancora terminati */
+static unsigned int zero_pool[CM_ZERO_POOL_SIZE]; /* frame liberi già azzerati, riservati come quelli dei magazine */
+static unsigned int zero_pool_n = 0;
+static struct wchan* zero_wchan = NULL; /* il thread pagezero attende qui che il pool debba essere riempito */
+static struct wchan* swapout_wchans[CM_SWAPOUT_WCHANS]; /* coremap_fix_resident attende qui il termine dello swap-out della pagina */
+static struct wchan* frame_wchan = NULL; /* get_user_frame attende qui che un frame venga liberato o diventi swappable */
+static unsigned int frame_waiters = 0;
+static unsigned int frame_events = 0; /* frame liberati o resi swappable: un evento avvenuto prima dell'attesa non viene perso */
+static unsigned int frame_holds = 0; /* frame user fissati da un fault, uno swap-out o il fault-around in corso: il rilascio genera un evento */
+static unsigned int discards = 0; /* pagine pulite scartate dallo swap-out, la cui entry della Page Table è diventata invalida */
+
+/*
+ * Gli indici dei buddy sono calcolati rispetto a first_page, in modo che
+ * i blocchi siano allineati alla propria dimensione anche se i frame
+ * occupati dal kernel durante il bootstrap non sono una potenza di due.
+ */
+#define BUDDY_OF(page, order) (first_page + (((page) - first_page) ^ (1U << (order))))
+
+// ordine del blocco allineato più grande che inizia da page e contiene al più n frame
+static unsigned int max_order(unsigned int page, unsigned int n) {
+    unsigned int order = 0;
+    while (order < CM_MAX_ORDER &&
+           ((page - first_page) & (1U << order)) == 0 &&
+           (2U << order) <= n)
+        order++;
+    return order;
+}
 
+static void push_block(unsigned int page, unsigned int order) {
+    coremap[page].occ = false;
+    coremap[page].fixed = false;
+    coremap[page].pt_entry = NULL;
+    coremap[page].nframes = 1 << order;
+    coremap[page].order = order;
+    coremap[page].prev = CM_NO_FRAME;
+    coremap[page].next = free_area[order];
+    nfree += 1 << order;
+    if (free_area[order] != CM_NO_FRAME)
+        coremap[free_area[order]].prev = page;
+    free_area[order] = page;
+}
+
+static void remove_block(unsigned int page) {
+    unsigned int order = coremap[page].order;
+    if (coremap[page].prev != CM_NO_FRAME)
+        coremap[coremap[page].prev].next = coremap[page].next;
+    else
+        free_area[order] = coremap[page].next;
+    if (coremap[page].next != CM_NO_FRAME)
+        coremap[coremap[page].next].prev = coremap[page].prev;
+    coremap[page].next = coremap[page].prev = CM_NO_FRAME;
+    coremap[page].nframes = 0;
+    nfree -= 1 << order;
+}
+
+// il frame page è in testa a un blocco libero di ordine order?
+static bool is_free_block(unsigned int page, unsigned int order) {
+    return page + (1U << order) <= npages && !coremap[page].occ &&
+           coremap[page].nframes == (1U << order) && coremap[page].order == order;
+}
+
+// restituisce al buddy allocator il blocco page di ordine order, fondendolo con i buddy liberi
+static void free_block(unsigned int page, unsigned int order) {
+    unsigned int i, buddy;
+    for (i = page; i < page + (1U << order); i++) {
+        coremap[i].occ = false;
+        coremap[i].fixed = false;
+        coremap[i].nframes = 0;
+        coremap[i].pt_entry = NULL;
+    }
+    while (order < CM_MAX_ORDER) {
+        buddy = BUDDY_OF(page, order);
+        if (!is_free_block(buddy, order))
+            break;
+        remove_block(buddy);
+        if (buddy < page)
+            page = buddy;
+        order++;
+    }
+    push_block(page, order);
+}
+
+// restituisce al buddy allocator una sequenza di n frame che inizia da page
+static void free_range(unsigned int page, unsigned int n) {
+    unsigned int order;
+    while (n > 0) {
+        order = max_order(page, n);
+        free_block(page, order);
+        page += 1 << order;
+        n -= 1 << order;
+    }
+}
+
+// preleva dal buddy allocator un blocco di num frame contigui, ritorna CM_NO_FRAME se non esiste
+static int alloc_range(unsigned int num) {
+    unsigned int order = 0, k, page;
+    while ((1U << order) < num)
+        order++;
+    if (order > CM_MAX_ORDER)
+        return CM_NO_FRAME;
+    for (k = order; k <= CM_MAX_ORDER && free_area[k] == CM_NO_FRAME; k++);
+    if (k > CM_MAX_ORDER)
+        return CM_NO_FRAME;
+
+    page = free_area[k];
+    remove_block(page);
+    while (k > order) {  // divido il blocco restituendo la metà superiore
+        k--;
+        push_block(page + (1 << k), k);
+    }
+    if (num < (1U << order))  // i frame in eccesso tornano liberi
+        free_range(page + num, (1 << order) - num);
+    if (nfree < low_watermark && pageout_state == PAGEOUT_RUNNING)
+        wchan_wakeone(pageout_wchan, &coremap_lock);
+    return page;
+}
+
+
+// imposta il campo swapping delle pagine che condividono il frame index
+static void mark_sharers_swapping(unsigned int index, bool swapping) {
+    struct cm_sharer* s;
+    for (s = coremap[index].sharers; s != NULL; s = s->next)
+        s->entry->swapping = swapping;
+}
 
-static int get_victim() {
-    static int prev_victim = 0;
-    int victim = (prev_victim + coremap[prev_victim].nframes) % (npages);
-    bool loop = false;
-    while (!(coremap[victim].occ && !coremap[victim].fixed && coremap[victim].pt_entry != NULL)) {
-        if (loop) return -1;
-        victim = (victim + coremap[victim].nframes) % (npages);
-        if (victim == prev_victim)
-            loop = true;
+// è rimasta una sola pagina a condividere il frame index: ne torna proprietaria. Ritorna l'elemento della lista da deallocare
+static struct cm_sharer* own_last_sharer(unsigned int index) {
+    struct cm_sharer* s = coremap[index].sharers;
+    KASSERT(coremap[index].refs == 1 && s != NULL && s->next == NULL);
+    coremap[index].pt_entry = s->entry;
+    coremap[index].sharers = NULL;
+    if (coremap[index].pins > 0) {  // il fault in corso sulla pagina rimasta mantiene il frame non swappable
+        coremap[index].pins = 0;
+        coremap[index].fixed = true;
     }
-    prev_victim = victim;
+    return s;
+}
+
+/*
+ * La pagina entry smette di condividere il frame index. Se rimane una sola pagina questa torna proprietaria del frame, a meno che
+ * non sia in corso lo swap-out del frame, che aggiorna tutte le pagine rimaste. Ritorna gli elementi della lista da deallocare
+ * tramite free_sharers, dopo aver rilasciato coremap_lock: kfree può restituire un frame alla coremap.
+ */
+static struct cm_sharer* drop_sharer(unsigned int index, struct pt_entry* entry) {
+    struct cm_sharer **p, *s;
+    for (p = &coremap[index].sharers; *p != NULL && (*p)->entry != entry; p = &(*p)->next);
+    KASSERT(*p != NULL);
+    s = *p;
+    *p = s->next;
+    s->next = NULL;
+    coremap[index].refs--;
+    if (coremap[index].refs == 1 && !coremap[index].fixed)
+        s->next = own_last_sharer(index);
+    return s;
+}
+
+static void free_sharers(struct cm_sharer* s) {
+    struct cm_sharer* next;
+    for (; s != NULL; s = next) {
+        next = s->next;
+        kfree(s);
+    }
+}
+
+// un frame user fissato temporaneamente non lo è più, perché rilasciato oppure passato a un altro uso
+static void hold_released(void) {
+    KASSERT(frame_holds > 0);
+    frame_holds--;
+}
+
+// rilascia un frame fissato da un fault: un frame condiviso può essere fissato da più fault contemporaneamente
+static void unpin(unsigned int index) {
+    if (index == zero_frame)  // non viene mai fissato da fix_resident
+        return;
+    hold_released();
+    if (coremap[index].pins > 0)
+        coremap[index].pins--;
+    else
+        coremap[index].fixed = false;
+}
+
+// sceglie la vittima dello swap-out tramite la politica attiva e la rende non adatta a un altro swap-out
+static int get_victim(void) {
+    int victim = policy->select_victim(coremap, npages);
+    if (victim == -1)
+        return -1;
+    KASSERT(CM_EVICTABLE(coremap, victim));
+    policy->on_free(coremap, victim);
     coremap[victim].fixed = true;
-    coremap[victim].pt_entry->swapping = true;
+    frame_holds++;
+    if (coremap[victim].pt_entry != NULL)
+        coremap[victim].pt_entry->swapping = true;
+    else
+        mark_sharers_swapping(victim, true);
+    /*
+     * Da qui un TLB fault sulla pagina attende la fine dello swap-out, ma una entry già presente in TLB (per esempio caricata dal
+     * fault-around) permetterebbe ancora di scrivere nel frame durante la copia nello swap file: la scrittura andrebbe persa.
+     * La entry viene rimossa subito dalla TLB di questa cpu e, dopo il rilascio di coremap_lock, da quelle delle altre con tlb_shootdown.
+     */
+    invalidate_entry_by_paddr(victim * PAGE_SIZE);
     return victim;
 }
 
+// lo swap-out del frame è terminato o annullato: sveglia i thread in attesa della pagina che conteneva
+static void swapout_done(unsigned int frame) {
+    if (swapout_wchans[frame % CM_SWAPOUT_WCHANS] != NULL)
+        wchan_wakeall(swapout_wchans[frame % CM_SWAPOUT_WCHANS], &coremap_lock);
+}
+
+// un frame è stato liberato o è diventato swappable: sveglia i thread in attesa di allocarne uno
+static void frame_available(void) {
+    frame_events++;
+    if (frame_waiters > 0)
+        wchan_wakeall(frame_wchan, &coremap_lock);
+}
+
 void coremap_create(unsigned int n_pages) {
     npages = n_pages;
     coremap = kmalloc(npages * sizeof(struct cm_entry));
 }
 
 bool coremap_bootstrap(paddr_t firstpaddr) {
-    unsigned int i = 0;
+    unsigned int i = 0, order;
     if (!coremap)
         return false;
     
     first_page = firstpaddr / PAGE_SIZE;  // firstpaddr è l'indirizzo fisico del primo frame libero
 
-    KASSERT(npages > first_page);
+    KASSERT(npages > first_page + 1);
+
+    // il frame azzerato condiviso viene sottratto al buddy allocator come quelli rubati durante il bootstrap: non verrà mai rilasciato
+    zero_frame = first_page++;
+    bzero((void *)PADDR_TO_KVADDR(zero_frame * PAGE_SIZE), PAGE_SIZE);
 
     for (i = 0; i < first_page; i++) {
         coremap[i].occ = true;
         coremap[i].fixed = true;
         coremap[i].nframes = 0;
+        coremap[i].order = 0;
         coremap[i].pt_entry = NULL;
+        coremap[i].refs = 1;
+        coremap[i].pins = 0;
+        coremap[i].sharers = NULL;
+        coremap[i].swap_slot = CM_NO_SLOT;
+        coremap[i].next = coremap[i].prev = CM_NO_FRAME;
     }
     for (; i < npages; i++) {
         coremap[i].occ = false;
         coremap[i].fixed = false;
         coremap[i].nframes = 0;
+        coremap[i].order = 0;
         coremap[i].pt_entry = NULL;
+        coremap[i].refs = 0;
+        coremap[i].pins = 0;
+        coremap[i].sharers = NULL;
+        coremap[i].swap_slot = CM_NO_SLOT;
+        coremap[i].next = coremap[i].prev = CM_NO_FRAME;
     }
-
     coremap[0].nframes = first_page;
-    coremap[first_page].nframes = npages - first_page;
+    policy->activate(coremap, npages);
+
+    for (order = 0; order <= CM_MAX_ORDER; order++)
+        free_area[order] = CM_NO_FRAME;
+    nfree = 0;
+    for (i = 0; i < MAXCPUS; i++)
+        spinlock_init(&magazines[i].lock);
+
+    // suddivido i frame liberi nei blocchi allineati più grandi possibili
+    i = first_page;
+    while (i < npages) {
+        order = max_order(i, npages - i);
+        push_block(i, order);
+        i += 1 << order;
+    }
     return true;
 }
 
-static paddr_t get_n_frames(unsigned int num, struct pt_entry* entry) {
-    
-    paddr_t addr = 0;
-    uint32_t i = first_page, residual, page;
-    bool found = false;
-    int spl;
-    spl = splhigh();
-    if (coremap == NULL) {
-        splx(spl);
-        return 0;
+static void reserve_frames(unsigned int page, unsigned int num, struct pt_entry* entry) {
+    unsigned int i;
+    coremap[page].nframes = num;
+    for (i = page; i < page + num; i++) {
+        coremap[i].occ = true;
+        coremap[i].fixed = true;
+        coremap[i].pt_entry = entry;
+        coremap[i].ref = false;
+        coremap[i].refs = 1;
+        coremap[i].pins = 0;
+        coremap[i].sharers = NULL;
+        coremap[i].swap_slot = CM_NO_SLOT;
     }
-    while (i < npages && !found) {
-        if (!coremap[i].occ && coremap[i].nframes >= num)
-            found = true;
-        else
-            i += coremap[i].nframes;
+}
+
+// preleva un frame dal magazine della cpu corrente, ricaricandolo dal pool globale se vuoto
+static int magazine_get(void) {
+    struct cm_magazine* mag;
+    int page;
+    int spl = splhigh();  // il thread non può cambiare cpu mentre usa il magazine
+
+    mag = &magazines[curcpu->c_number];
+    spinlock_acquire(&mag->lock);
+    if (mag->nframes > 0)
+        mag->hits++;
+    else {
+        mag->misses++;
+        spinlock_acquire(&coremap_lock);
+        while (mag->nframes < CM_MAGAZINE_BATCH && (page = alloc_range(1)) != CM_NO_FRAME) {
+            reserve_frames(page, 1, NULL);
+            mag->frames[mag->nframes++] = page;
+        }
+        spinlock_release(&coremap_lock);
     }
+    page = mag->nframes > 0 ? (int)mag->frames[--mag->nframes] : CM_NO_FRAME;
+    spinlock_release(&mag->lock);
+    splx(spl);
+    return page;
+}
 
-    if (!found && num != 1) {
-        splx(spl);
-        return 0;
-    } else if (!found) {
-        int err = 0;
-        bool victim_free = false;
-        unsigned int swap_index;
-        i = get_victim();
-        splx(spl);
-
-        if ((int)i == -1) {
-            return 0;
+// inserisce un frame riservato nel magazine della cpu corrente, svuotandolo parzialmente nel pool globale se pieno
+static void magazine_put(unsigned int page) {
+    struct cm_magazine* mag;
+    int spl = splhigh();
+
+    mag = &magazines[curcpu->c_number];
+    spinlock_acquire(&mag->lock);
+    if (mag->nframes == CM_MAGAZINE_SIZE) {
+        spinlock_acquire(&coremap_lock);
+        while (mag->nframes > CM_MAGAZINE_SIZE - CM_MAGAZINE_BATCH)
+            free_range(mag->frames[--mag->nframes], 1);
+        spinlock_release(&coremap_lock);
+    }
+    mag->frames[mag->nframes++] = page;
+    spinlock_release(&mag->lock);
+    splx(spl);
+}
+
+// restituisce al buddy allocator i frame dei magazine di tutte le cpu, ritornandone il numero
+static unsigned int magazine_drain(void) {
+    struct cm_magazine* mag;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < MAXCPUS; i++) {
+        mag = &magazines[i];
+        spinlock_acquire(&mag->lock);
+        if (mag->nframes > 0) {
+            spinlock_acquire(&coremap_lock);
+            for (; mag->nframes > 0; n++)
+                free_range(mag->frames[--mag->nframes], 1);
+            spinlock_release(&coremap_lock);
         }
+        spinlock_release(&mag->lock);
+    }
+    return n;
+}
 
-        err = swap_set(PADDR_TO_KVADDR(i * PAGE_SIZE), &swap_index);
-        if (err) {
-            spl = splhigh();
-            coremap[i].fixed = false;
-            coremap[i].pt_entry->swapping = false;
-            splx(spl);
-            return 0;
+// il frame che contiene la pagina descritta da entry può essere aggiunto al cluster di swap-out di una vittima adiacente?
+static int cluster_frame(struct pt_entry* entry) {
+    unsigned int frame;
+    if (!entry->valid || entry->swp || entry->swapping || !entry->dirty)
+        return -1;
+    frame = entry->frame_no;
+    // frame_no è affidabile solo se la coremap conferma che il frame appartiene a entry
+    if (frame < first_page || frame >= npages || coremap[frame].pt_entry != entry ||
+        !CM_EVICTABLE(coremap, frame) || coremap[frame].ref)
+        return -1;
+    return frame;
+}
+
+static void add_to_cluster(unsigned int frame) {
+    policy->on_free(coremap, frame);
+    coremap[frame].fixed = true;
+    frame_holds++;
+    coremap[frame].pt_entry->swapping = true;
+    invalidate_entry_by_paddr(frame * PAGE_SIZE);  // come in get_victim
+}
+
+/*
+ * Costruisce il cluster di swap-out della vittima sporca victim: le pagine sporche, non referenziate e adiacenti nella
+ * stessa Page Table di secondo livello vengono scelte anch'esse come vittime, in modo da scriverle con un'unica operazione in
+ * porzioni contigue dello swap file. Restituisce in frames i frame del cluster in ordine di indirizzo virtuale e ne
+ * ritorna il numero.
+ */
+static unsigned int get_cluster(unsigned int victim, unsigned int* frames) {
+    struct pt_entry* row = PT_ROW_BASE(coremap[victim].pt_entry);
+    unsigned int lo, hi, n = 1, k;
+    int frame;
+    lo = hi = PT_ROW_INDEX(coremap[victim].pt_entry);
+    while (n < SWAP_CLUSTER && hi + 1 < TABLE_SIZE && (frame = cluster_frame(&row[hi + 1])) != -1) {
+        add_to_cluster(frame);
+        hi++;
+        n++;
+    }
+    while (n < SWAP_CLUSTER && lo > 0 && (frame = cluster_frame(&row[lo - 1])) != -1) {
+        add_to_cluster(frame);
+        lo--;
+        n++;
+    }
+    for (k = lo; k <= hi; k++)
+        frames[k - lo] = row[k].frame_no;
+    return n;
+}
+
+// lo swap-out del frame non è avvenuto: la pagina rimane in memoria
+static void release_victim(unsigned int frame) {
+    coremap[frame].fixed = false;
+    hold_released();
+    if (coremap[frame].pt_entry != NULL) {
+        coremap[frame].pt_entry->swapping = false;
+        policy->on_alloc(coremap, frame);
+    } else  // il frame vittima è stato liberato durante lo swap-out
+        free_range(frame, 1);
+    swapout_done(frame);
+    frame_available();
+}
+
+/*
+ * Swap-out del frame condiviso copy-on-write victim, invocata con coremap_lock acquisito: tutte le pagine che lo condividono
+ * vengono rimosse dalla memoria insieme. Se le pagine sono pulite e non hanno una copia nello swap file vengono scartate; altrimenti
+ * il frame viene scritto in una porzione dello swap file (o se ne riutilizza la copia aggiornata), il cui contatore dei riferimenti
+ * viene portato al numero di pagine prima che queste vengano aggiornate. Le pagine che smettono di condividere il frame durante la
+ * scrittura rilasciano il proprio riferimento al termine. Il frame viene poi assegnato a entry.
+ */
+static int evict_shared(struct pt_entry* entry, unsigned int victim, unsigned int* ret) {
+    struct cm_sharer *s, *nodes = NULL;
+    vaddr_t address = PADDR_TO_KVADDR(victim * PAGE_SIZE);
+    unsigned int slot = 0, n = coremap[victim].refs, left = 0, k;
+    bool dirty = CM_DIRTY(coremap, victim);
+    bool reused = coremap[victim].swap_slot != CM_NO_SLOT;  // una pagina sporca non ha una copia nello swap file
+    bool drop = !dirty && !reused;
+    int err = 0;
+
+    if (reused)  // il riferimento della coremap alla copia passa alle pagine
+        slot = coremap[victim].swap_slot;
+    spinlock_release(&coremap_lock);
+
+    tlb_shootdown(victim * PAGE_SIZE);
+    if (!drop) {
+        if (dirty)
+            err = swap_set_cluster(&address, 1, &slot);
+        for (k = 1; !err && k < n; k++)
+            swap_inc_ref(slot);
+    }
+
+    spinlock_acquire(&coremap_lock);
+    if (err) {  // le pagine rimangono in memoria
+        mark_sharers_swapping(victim, false);
+        coremap[victim].fixed = false;
+        hold_released();
+        if (coremap[victim].refs == 0)  // tutte le pagine hanno smesso di condividere il frame
+            free_range(victim, 1);
+        else {
+            if (coremap[victim].refs == 1)
+                nodes = own_last_sharer(victim);
+            policy->on_alloc(coremap, victim);
         }
-        spl = splhigh();
-        //mentre effettuo la swap un processo in fase di disrtuzione potrebbe aver eseguito una free sul frame vittima
-        if (coremap[i].pt_entry != NULL) {
-            invalidate_entry_by_paddr(coremap[i].pt_entry->frame_no << 12);
-            coremap[i].pt_entry->frame_no = swap_index;
-            coremap[i].pt_entry->swp = true;
-            coremap[i].pt_entry->swapping = false;
-        } else
-            victim_free = true;
-        coremap[i].pt_entry = entry;
-        splx(spl);
-        if (victim_free)
-            swap_get((vaddr_t) NULL, swap_index);
-        addr = (paddr_t)(i * PAGE_SIZE);
-        bzero((void*)PADDR_TO_KVADDR(addr), PAGE_SIZE);
-        return addr;
-    }
-    page = i;
-    
-    // page adesso conterrà il primo frame libero
-    // aggiorno la tabella
-    residual = coremap[page].nframes - num;
+        swapout_done(victim);
+        frame_available();
+        spinlock_release(&coremap_lock);
+        free_sharers(nodes);
+        return err;
+    }
+    for (s = coremap[victim].sharers; s != NULL; s = s->next) {
+        if (drop) {
+            s->entry->valid = false;
+            discards++;
+        } else {
+            s->entry->frame_no = slot;
+            s->entry->swp = true;
+        }
+        s->entry->swapping = false;
+        left++;
+    }
+    nodes = coremap[victim].sharers;
+    coremap[victim].sharers = NULL;
+    coremap[victim].refs = 1;
+    coremap[victim].swap_slot = CM_NO_SLOT;
+    swapout_done(victim);
+    coremap[victim].pt_entry = entry;
+    if (entry != NULL)  // il frame rimane fissato per il fault di entry
+        policy->on_alloc(coremap, victim);
+    else
+        hold_released();
+    if (!dirty)
+        inc_counter(swap_writes_avoided);
+    spinlock_release(&coremap_lock);
+    free_sharers(nodes);
+    for (k = left; !drop && k < n; k++)  // riferimenti delle pagine che hanno smesso di condividere il frame
+        swap_get((vaddr_t) NULL, slot);
+    *ret = victim;
+    return 0;
+}
 
-    if (residual && page + num < npages)
-        coremap[page + num].nframes = residual;
-    coremap[page].nframes = num;
+/*
+ * Libera un frame effettuando lo swap-out di una vittima e lo assegna a entry, ritornandone l'indice tramite ret.
+ * I frame delle altre pagine del cluster vengono restituiti al buddy allocator.
+ */
+static int evict(struct pt_entry* entry, unsigned int* ret, unsigned int* nevicted) {
+    int err = 0;
+    bool freed[SWAP_CLUSTER];
+    unsigned int frames[SWAP_CLUSTER];
+    vaddr_t addresses[SWAP_CLUSTER];
+    unsigned int swap_index, n = 0, k;
+    int i;
 
+    spinlock_acquire(&coremap_lock);
+    i = get_victim();
+    if (i == -1) {
+        spinlock_release(&coremap_lock);
+        return ENOMEM;
+    }
 
-    for (i = page; i < page + num; i++){
-        coremap[i].occ = true;
-        coremap[i].fixed = true;
+    if (coremap[i].pt_entry == NULL) {  // frame condiviso copy-on-write
+        *nevicted = 1;
+        return evict_shared(entry, i, ret);
+    }
+
+    if (!coremap[i].pt_entry->dirty) {
+        /*
+         * La pagina non è stata modificata dopo il caricamento: non serve scriverla nello swap file. Se è stata caricata
+         * dallo swap file la porzione letta è ancora una sua copia aggiornata, altrimenti verrà ricaricata dal file ELF
+         * (o azzerata, se appartiene allo stack).
+         */
+        if (coremap[i].swap_slot != CM_NO_SLOT) {
+            coremap[i].pt_entry->frame_no = coremap[i].swap_slot;
+            coremap[i].pt_entry->swp = true;
+            coremap[i].swap_slot = CM_NO_SLOT;
+        } else {
+            coremap[i].pt_entry->valid = false;
+            discards++;
+        }
+        coremap[i].pt_entry->swapping = false;
+        swapout_done(i);
         coremap[i].pt_entry = entry;
+        if (entry != NULL)
+            policy->on_alloc(coremap, i);
+        else
+            hold_released();
+        inc_counter(swap_writes_avoided);
+        spinlock_release(&coremap_lock);
+        tlb_shootdown(i * PAGE_SIZE);  // prima che il frame venga riutilizzato
+        *ret = i;
+        *nevicted = 1;
+        return 0;
     }
-    splx(spl);
-    addr = (paddr_t)(page * PAGE_SIZE);
-    bzero((void*)PADDR_TO_KVADDR(addr), PAGE_SIZE*num);
-    return addr;    
+    KASSERT(coremap[i].swap_slot == CM_NO_SLOT);  // la copia nello swap file viene rilasciata quando la pagina diventa sporca
+    n = get_cluster(i, frames);
+    spinlock_release(&coremap_lock);
+
+    for (k = 0; k < n; k++) {
+        tlb_shootdown(frames[k] * PAGE_SIZE);  // prima della copia nello swap file
+        addresses[k] = PADDR_TO_KVADDR(frames[k] * PAGE_SIZE);
+    }
+    err = swap_set_cluster(addresses, n, &swap_index);
+    if (err == ENOSPC && n > 1) {  // non esistono porzioni contigue sufficienti: viene scritta solo la vittima
+        spinlock_acquire(&coremap_lock);
+        for (k = 0; k < n; k++) {
+            if (frames[k] != (unsigned int)i)
+                release_victim(frames[k]);
+        }
+        spinlock_release(&coremap_lock);
+        frames[0] = i;
+        addresses[0] = PADDR_TO_KVADDR(i * PAGE_SIZE);
+        n = 1;
+        err = swap_set_cluster(addresses, n, &swap_index);
+    }
+    if (err) {
+        spinlock_acquire(&coremap_lock);
+        for (k = 0; k < n; k++)
+            release_victim(frames[k]);
+        spinlock_release(&coremap_lock);
+        return err;
+    }
+    spinlock_acquire(&coremap_lock);
+    for (k = 0; k < n; k++) {
+        //mentre effettuo la swap un processo in fase di disrtuzione potrebbe aver eseguito una free sul frame vittima
+        freed[k] = coremap[frames[k]].pt_entry == NULL;
+        if (!freed[k]) {
+            coremap[frames[k]].pt_entry->frame_no = swap_index + k;
+            coremap[frames[k]].pt_entry->swp = true;
+            coremap[frames[k]].pt_entry->swapping = false;
+        }
+        swapout_done(frames[k]);
+        if (frames[k] != (unsigned int)i) {
+            free_range(frames[k], 1);
+            hold_released();
+        }
+    }
+    if (n > 1)  // i frame delle altre pagine del cluster sono tornati liberi
+        frame_available();
+    coremap[i].pt_entry = entry;
+    if (entry != NULL)
+        policy->on_alloc(coremap, i);
+    else
+        hold_released();
+    spinlock_release(&coremap_lock);
+    for (k = 0; k < n; k++) {
+        if (freed[k])
+            swap_get((vaddr_t) NULL, swap_index + k);
+    }
+    *ret = i;
+    *nevicted = n;
+    return 0;
 }
 
-paddr_t get_user_frame(struct pt_entry* entry) {
-    paddr_t ret;
-    for (int i = 0; i < MAX_ATTEMPTS; i++) {
-        ret = get_n_frames(1, entry);
-        if (ret)
-            return ret;
-        thread_yield();
+// preleva un frame già azzerato dal pool, svegliando il thread pagezero se il pool si sta svuotando
+static int zero_pool_get(void) {
+    int page = CM_NO_FRAME;
+    spinlock_acquire(&coremap_lock);
+    if (zero_pool_n > 0)
+        page = zero_pool[--zero_pool_n];
+    if (zero_pool_n < CM_ZERO_POOL_LOW && pageout_state == PAGEOUT_RUNNING)
+        wchan_wakeone(zero_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+    return page;
+}
+
+// riserva num frame contigui del buddy allocator per entry
+static int reserve_block(unsigned int num, struct pt_entry* entry) {
+    int found;
+    spinlock_acquire(&coremap_lock);
+    found = alloc_range(num);
+    if (found != CM_NO_FRAME)
+        reserve_frames(found, num, entry);
+    spinlock_release(&coremap_lock);
+    return found;
+}
+
+// ritorna 0 e l'indirizzo fisico del blocco tramite ret se non ci sono stati errori; se can_evict è falso non effettua swap-out
+static int get_n_frames(unsigned int num, struct pt_entry* entry, bool can_evict, bool zero, paddr_t* ret) {
+    
+    unsigned int victim, nevicted;
+    int found, err;
+    bool zeroed = false;
+    if (coremap == NULL) {
+        return ENOMEM;
+    }
+    if (num == 1) {
+        found = zero ? zero_pool_get() : CM_NO_FRAME;
+        zeroed = found != CM_NO_FRAME;
+        if (found == CM_NO_FRAME)
+            found = magazine_get();
+        if (found == CM_NO_FRAME && !zero)  // i frame azzerati sono comunque liberi: meglio di uno swap-out
+            found = zero_pool_get();
+        if (found == CM_NO_FRAME && magazine_drain() > 0)  // i frame riservati alle altre cpu sono liberi
+            found = magazine_get();
+        if (found != CM_NO_FRAME && entry != NULL) {
+            spinlock_acquire(&coremap_lock);
+            coremap[found].pt_entry = entry;
+            frame_holds++;  // il frame rimane fissato finché la pagina non viene mappata
+            policy->on_alloc(coremap, found);
+            spinlock_release(&coremap_lock);
+        }
+    } else {
+        KASSERT(entry == NULL);  // solo i frame singoli contengono pagine user
+        found = reserve_block(num, entry);
+        if (found == CM_NO_FRAME && magazine_drain() > 0)  // i frame restituiti possono ricomporre un blocco
+            found = reserve_block(num, entry);
+    }
+
+    if (found == CM_NO_FRAME && (num != 1 || !can_evict)) {
+        return ENOMEM;
+    } else if (found == CM_NO_FRAME) {
+        err = evict(entry, &victim, &nevicted);  // il pageout daemon non ha tenuto il passo: swap-out sincrono
+        if (err)
+            return err;
+        found = victim;
     }
-    kprintf("get_user_frame: Not enough space \n");
+    *ret = (paddr_t)(found * PAGE_SIZE);
+    if (zero && num == 1)
+        inc_counter(zeroed ? zero_pool_hits : zero_pool_misses);
+    if (zero && !zeroed)
+        bzero((void*)PADDR_TO_KVADDR(*ret), PAGE_SIZE*num);
     return 0;
 }
 
+/*
+ * Un'allocazione, iniziata quando frame_events valeva seen, non ha trovato né frame liberi né vittime: attende che un frame venga
+ * liberato o reso swappable. Ritorna false senza attendere se nessun frame user è temporaneamente fixed (fault, swap-out o
+ * fault-around in corso, contati da frame_holds): nessun evento è garantito e l'allocazione fallisce.
+ */
+static bool wait_for_frame(unsigned int seen) {
+    spinlock_acquire(&coremap_lock);
+    if (frame_events == seen) {
+        if (frame_holds == 0 || frame_wchan == NULL) {
+            spinlock_release(&coremap_lock);
+            return false;
+        }
+        frame_waiters++;
+        wchan_sleep(frame_wchan, &coremap_lock);
+        frame_waiters--;
+    }
+    spinlock_release(&coremap_lock);
+    return true;
+}
+
+int get_user_frame(struct pt_entry* entry, bool zero, paddr_t* frame) {
+    unsigned int seen;
+    int err;
+    do {
+        spinlock_acquire(&coremap_lock);
+        seen = frame_events;
+        spinlock_release(&coremap_lock);
+        err = get_n_frames(1, entry, true, zero, frame);
+    } while (err == ENOMEM && wait_for_frame(seen));
+    if (err)
+        kprintf("get_user_frame: %s\n", strerror(err));
+    return err;
+}
+
+paddr_t get_free_user_frame(struct pt_entry* entry) {
+    paddr_t ret;
+    if (get_n_frames(1, entry, false, false, &ret))
+        return 0;
+    return ret;
+}
+
 paddr_t get_kernel_frame(unsigned int num) {
     paddr_t ret;
-    for (int i = 0; i < MAX_ATTEMPTS; i++){
-        ret = get_n_frames(num, NULL);
-        if (ret)
-            return ret;
-        thread_yield();
+    unsigned int seen;
+    int err;
+    // kmalloc può essere invocata con spinlock acquisiti o da un interrupt handler: in tal caso non si può attendere
+    bool can_sleep = curcpu->c_spinlocks == 0 && !curthread->t_in_interrupt;
+    do {
+        spinlock_acquire(&coremap_lock);
+        seen = frame_events;
+        spinlock_release(&coremap_lock);
+        err = get_n_frames(num, NULL, true, true, &ret);
+    } while (err == ENOMEM && can_sleep && wait_for_frame(seen));
+    if (err) {
+        kprintf("get_kernel_frame: %s\n", strerror(err));
+        return 0;
     }
-    kprintf("get_user_frame: Not enough space \n");
-    return 0;
+    return ret;
 }
 
-void free_frame(paddr_t addr) {
+/*
+ * Rilascia il frame singolo page, con coremap_lock acquisito. Ritorna true se il frame va inserito nel magazine dal chiamante, dopo
+ * aver rilasciato coremap_lock e l'eventuale porzione dello swap file restituita tramite swap_slot.
+ */
+static bool put_frame(unsigned int page, int32_t* swap_slot) {
+    *swap_slot = CM_NO_SLOT;
+    KASSERT(coremap[page].nframes == 1 && coremap[page].sharers == NULL);  // i frame condivisi vengono rilasciati da free_user_frame
+    if (coremap[page].pt_entry != NULL && coremap[page].pt_entry->swapping) {  // se si sta effettuando lo swap-out della pagina contenuta nel frame questi campi devono rimanere invariati
+        coremap[page].fixed = true;
+        coremap[page].pt_entry = NULL;
+        return false;
+    }
+    if (coremap[page].pt_entry != NULL)
+        policy->on_free(coremap, page);
+    if (coremap[page].pt_entry != NULL && coremap[page].fixed)  // per esempio dopo un errore durante il fault che lo ha allocato
+        hold_released();
+    coremap[page].fixed = true;
+    coremap[page].pt_entry = NULL;
+    *swap_slot = coremap[page].swap_slot;
+    coremap[page].swap_slot = CM_NO_SLOT;
+    frame_available();
+    return true;
+}
 
-    uint32_t i, next, page = addr / PAGE_SIZE, mysize;
+void free_frame(paddr_t addr) {
 
-    int spl = splhigh();
+    uint32_t page = addr / PAGE_SIZE, mysize;
+    int32_t swap_slot;
+    bool put;
 
-    if(coremap == NULL){
+    if(coremap == NULL || page < first_page){  // i frame rubati durante il bootstrap non vengono restituiti
         return;
     }
+    spinlock_acquire(&coremap_lock);
     mysize = coremap[page].nframes;
     KASSERT(mysize>0);
-    if (coremap[page].pt_entry != NULL && coremap[page].pt_entry->swapping) {  // se si sta effettuando lo swap-out della pagina contenuta nel frame questi campi devono rimanere invariati
-        KASSERT(coremap[page].nframes == 1);
-        coremap[page].fixed = true;
-        coremap[page].pt_entry = NULL;
-        splx(spl);
+    if (mysize == 1) {  // i frame singoli tornano nel magazine della cpu corrente
+        put = put_frame(page, &swap_slot);
+        spinlock_release(&coremap_lock);
+        if (swap_slot != CM_NO_SLOT)  // la copia della pagina nello swap file non serve più
+            swap_get((vaddr_t) NULL, swap_slot);
+        if (put)
+            magazine_put(page);
         return;
     }
 
-    for (i = 0; i < mysize; i++) {
-        coremap[page + i].occ = false;
-        coremap[page + i].fixed = false;
-        coremap[page + i].pt_entry = NULL;
-    }
-    i = 0;
-    next = coremap[i].nframes;
-    while (next < npages) {
-        if (!coremap[i].occ) {
-            while (next < npages && !coremap[next].occ) {
-                uint32_t size = coremap[next].nframes;
-                coremap[i].nframes += size;
-                coremap[next].nframes = 0;
-                next += size;
-            }
-            if (next >= npages) break;
-        }
-        i = next;
-        next += coremap[next].nframes;
-    }
-    splx(spl);
+    free_range(page, mysize);
+    frame_available();
+    spinlock_release(&coremap_lock);
 }
 
+void free_user_frame(struct pt_entry* entry) {
+    struct cm_sharer* nodes = NULL;
+    int32_t swap_slot = CM_NO_SLOT;
+    unsigned int index;
+    bool put = false;
+
+    /*
+     * La entry va letta con coremap_lock acquisito: lo swap-out di una pagina pulita la rende invalida (o la fa puntare alla sua
+     * copia nello swap file) e assegna il frame a un'altra pagina in un'unica sezione critica.
+     */
+    spinlock_acquire(&coremap_lock);
+    index = entry->frame_no;
+    if (entry->valid && entry->swp)
+        swap_slot = index;
+    else if (entry->valid && index != zero_frame) {
+        if (coremap[index].pt_entry != entry)  // il frame è condiviso copy-on-write con altri address space
+            nodes = drop_sharer(index, entry);
+        else
+            put = put_frame(index, &swap_slot);
+    }
+    entry->valid = false;
+    spinlock_release(&coremap_lock);
+
+    free_sharers(nodes);
+    if (swap_slot != CM_NO_SLOT)
+        swap_get((vaddr_t) NULL, swap_slot);
+    if (put)
+        magazine_put(index);
+}
 
 void coremap_shutdown() {
+    unsigned int i;
+    for (i = 0; i < MAXCPUS; i++) {
+        add_counter(frame_cache_hits, magazines[i].hits);
+        add_counter(frame_cache_misses, magazines[i].misses);
+    }
+    kprintf("\nPage replacement policy: %s\n", policy->name);
     npages = 0;
     coremap = NULL;    
     first_page = 0;
 }
 
 void coremap_set_fixed(unsigned int index) {
-    KASSERT(curthread->t_iplhigh_count > 0);
+    spinlock_acquire(&coremap_lock);
+    KASSERT(!coremap[index].fixed);
     coremap[index].fixed = true;
+    frame_holds++;
+    spinlock_release(&coremap_lock);
 }
 
 void coremap_set_unfixed(unsigned int index) {
-    KASSERT(curthread->t_iplhigh_count > 0);
-    coremap[index].fixed = false;
-}
\ No newline at end of file
+    spinlock_acquire(&coremap_lock);
+    unpin(index);
+    frame_available();
+    spinlock_release(&coremap_lock);
+}
+
+void coremap_set_mapped(unsigned int index) {
+    spinlock_acquire(&coremap_lock);
+    unpin(index);
+    policy->on_access(coremap, index);
+    frame_available();
+    spinlock_release(&coremap_lock);
+}
+
+// va invocata con coremap_lock acquisito su una pagina valida in memoria che non sia vittima di uno swap-out
+static void fix_resident(struct pt_entry* entry) {
+    if (entry->frame_no == zero_frame)  // non appartiene ad alcuna pagina e non è swappable
+        return;
+    frame_holds++;
+    if (coremap[entry->frame_no].refs > 1)  // più fault, in address space diversi, possono fissare il frame condiviso
+        coremap[entry->frame_no].pins++;
+    else {
+        KASSERT(coremap[entry->frame_no].pt_entry == entry);
+        coremap[entry->frame_no].fixed = true;  // da questo momento in poi il frame non è swappable
+    }
+}
+
+bool coremap_fix_resident(struct pt_entry* entry) {
+    spinlock_acquire(&coremap_lock);
+    // finché la pagina è vittima di uno swap-out frame_no indica ancora il suo frame, sulla cui wait channel swapout_done sveglia
+    while (entry->swapping)
+        wchan_sleep(swapout_wchans[entry->frame_no % CM_SWAPOUT_WCHANS], &coremap_lock);
+    if (!entry->valid || entry->swp) {  // la pagina è stata scritta nello swap file oppure scartata
+        spinlock_release(&coremap_lock);
+        return false;
+    }
+    fix_resident(entry);
+    policy->on_access(coremap, entry->frame_no);  // TLB reload: la pagina è stata referenziata
+    spinlock_release(&coremap_lock);
+    return true;
+}
+
+bool coremap_try_fix_resident(struct pt_entry* entry) {
+    bool resident;
+    spinlock_acquire(&coremap_lock);
+    resident = entry->valid && !entry->swp && !entry->swapping;
+    if (resident)  // la pagina non è stata referenziata: il bit di riferimento rimane invariato
+        fix_resident(entry);
+    spinlock_release(&coremap_lock);
+    return resident;
+}
+
+int coremap_share(struct pt_entry* entry, struct pt_entry* copy) {
+    unsigned int index = entry->frame_no;
+    struct cm_sharer *first, *s;
+
+    if (index == zero_frame)  // il frame azzerato è già condiviso da tutti gli address space
+        return 0;
+    // alla prima condivisione vanno registrate entrambe le pagine; la lista viene allocata senza coremap_lock
+    first = kmalloc(sizeof(struct cm_sharer));
+    s = kmalloc(sizeof(struct cm_sharer));
+    spinlock_acquire(&coremap_lock);
+    KASSERT(entry->valid && !entry->swp && copy->frame_no == index);
+    if (s == NULL || (first == NULL && coremap[index].pt_entry != NULL)) {
+        unpin(index);
+        frame_available();
+        spinlock_release(&coremap_lock);
+        kfree(first);
+        kfree(s);
+        return ENOMEM;
+    }
+    if (coremap[index].pt_entry != NULL) {  // il frame rimane nella politica di sostituzione: ora può essere scelto come vittima
+        KASSERT(coremap[index].pt_entry == entry && coremap[index].refs == 1 && coremap[index].fixed);
+        first->entry = entry;
+        first->next = NULL;
+        coremap[index].sharers = first;
+        coremap[index].pt_entry = NULL;
+        first = NULL;
+    }
+    s->entry = copy;
+    s->next = coremap[index].sharers;
+    coremap[index].sharers = s;
+    coremap[index].refs++;
+    unpin(index);  // rilascia il frame fissato da coremap_fix_resident: fixed se era di entry, altrimenti uno dei pins
+    frame_available();
+    spinlock_release(&coremap_lock);
+    kfree(first);
+    return 0;
+}
+
+bool coremap_is_shared(unsigned int index) {
+    bool shared;
+    if (index == zero_frame)
+        return true;
+    spinlock_acquire(&coremap_lock);
+    shared = coremap[index].refs > 1;
+    spinlock_release(&coremap_lock);
+    return shared;
+}
+
+int coremap_copy_on_write(struct pt_entry* entry) {
+    unsigned int index = entry->frame_no;
+    struct cm_sharer* nodes;
+    paddr_t frame;
+    int err;
+
+    if (index == zero_frame) {  // il nuovo frame è già azzerato
+        err = get_user_frame(entry, true, &frame);
+        if (err)
+            return err;
+        entry->frame_no = frame >> 12;
+        entry->dirty = true;
+        return 0;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    if (coremap[index].refs == 1) {  // nessun altro address space condivide più il frame: entry ne è già proprietaria
+        KASSERT(coremap[index].pt_entry == entry && coremap[index].fixed);
+        spinlock_release(&coremap_lock);
+        return 0;
+    }
+    spinlock_release(&coremap_lock);
+
+    err = get_user_frame(entry, false, &frame);  // il frame condiviso è fissato dal fault: il suo contenuto non cambia
+    if (err)
+        return err;
+    memcpy((void *)PADDR_TO_KVADDR(frame), (void *)PADDR_TO_KVADDR(index * PAGE_SIZE), PAGE_SIZE);
+    spinlock_acquire(&coremap_lock);
+    if (coremap[index].refs == 1) {
+        // gli altri address space hanno rilasciato il frame durante la copia: entry ne è tornata proprietaria, la copia non serve
+        KASSERT(coremap[index].pt_entry == entry && coremap[index].fixed);
+        spinlock_release(&coremap_lock);
+        free_frame(frame);
+        return 0;
+    }
+    unpin(index);  // prima di drop_sharer: il fault di entry non fissa più il frame condiviso
+    nodes = drop_sharer(index, entry);
+    entry->frame_no = frame >> 12;
+    entry->dirty = true;  // il nuovo frame non ha una copia nello swap file
+    inc_counter(cow_faults);
+    frame_available();
+    spinlock_release(&coremap_lock);
+    free_sharers(nodes);
+    return 0;
+}
+
+void coremap_map_zero(struct pt_entry* entry) {
+    entry->frame_no = zero_frame;
+    entry->dirty = false;
+    entry->swp = false;
+    entry->valid = true;
+    inc_counter(zero_page_mappings);
+}
+
+void coremap_set_swap_copy(unsigned int index, unsigned int slot) {
+    spinlock_acquire(&coremap_lock);
+    KASSERT(coremap[index].swap_slot == CM_NO_SLOT);
+    coremap[index].swap_slot = slot;
+    spinlock_release(&coremap_lock);
+}
+
+void coremap_set_dirty(struct pt_entry* entry) {
+    int32_t swap_slot;
+    spinlock_acquire(&coremap_lock);
+    KASSERT(entry->valid && !entry->swp);
+    KASSERT(coremap[entry->frame_no].fixed);
+    entry->dirty = true;
+    swap_slot = coremap[entry->frame_no].swap_slot;
+    coremap[entry->frame_no].swap_slot = CM_NO_SLOT;
+    spinlock_release(&coremap_lock);
+    if (swap_slot != CM_NO_SLOT)  // la copia nello swap file non è più aggiornata
+        swap_get((vaddr_t) NULL, swap_slot);
+}
+
+int coremap_set_policy(const char* name) {
+    unsigned int i;
+    for (i = 0; cm_policies[i] != NULL; i++) {
+        if (!strcmp(cm_policies[i]->name, name))
+            break;
+    }
+    if (cm_policies[i] == NULL)
+        return EINVAL;
+    spinlock_acquire(&coremap_lock);
+    policy = cm_policies[i];
+    if (coremap != NULL)
+        policy->activate(coremap, npages);
+    spinlock_release(&coremap_lock);
+    return 0;
+}
+
+const char* coremap_get_policy(void) {
+    return policy->name;
+}
+
+/*
+ * Pageout daemon: attende che i frame liberi scendano sotto low_watermark ed effettua lo swap-out di vittime, restituendo
+ * i loro frame al buddy allocator, finché i frame liberi non raggiungono high_watermark. In questo modo get_user_frame
+ * trova di solito un frame libero senza attendere la scrittura nello swap file.
+ */
+static void pageout(void* data1, unsigned long data2) {
+    unsigned int frame, nevicted;
+    (void)data1;
+    (void)data2;
+
+    spinlock_acquire(&coremap_lock);
+    while (pageout_state == PAGEOUT_RUNNING) {
+        if (nfree < low_watermark) {
+            inc_counter(pageout_wakeups);
+            while (pageout_state == PAGEOUT_RUNNING && nfree < high_watermark) {
+                spinlock_release(&coremap_lock);
+                if (evict(NULL, &frame, &nevicted)) {  // nessuna vittima: si attende la prossima allocazione
+                    spinlock_acquire(&coremap_lock);
+                    break;
+                }
+                spinlock_acquire(&coremap_lock);
+                free_range(frame, 1);
+                frame_available();
+                add_counter(pageout_pages, nevicted);
+            }
+        }
+        if (pageout_state == PAGEOUT_RUNNING)
+            wchan_sleep(pageout_wchan, &coremap_lock);
+    }
+    if (--daemons == 0)
+        pageout_state = PAGEOUT_STOPPED;
+    wchan_wakeall(pageout_done_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ * Thread pagezero: mantiene pieno il pool di frame azzerati, così che get_user_frame non debba azzerare il frame sul percorso
+ * critico di un page fault. Preleva solo frame in eccesso rispetto a high_watermark, per non causare swap-out, e cede la cpu
+ * dopo ogni frame azzerato in modo da girare quando gli altri thread non ne hanno bisogno.
+ */
+static void pagezero(void* data1, unsigned long data2) {
+    int page;
+    (void)data1;
+    (void)data2;
+
+    spinlock_acquire(&coremap_lock);
+    while (pageout_state == PAGEOUT_RUNNING) {
+        while (pageout_state == PAGEOUT_RUNNING && zero_pool_n < CM_ZERO_POOL_SIZE && nfree > high_watermark &&
+               (page = alloc_range(1)) != CM_NO_FRAME) {
+            reserve_frames(page, 1, NULL);
+            spinlock_release(&coremap_lock);
+            bzero((void*)PADDR_TO_KVADDR(page * PAGE_SIZE), PAGE_SIZE);
+            spinlock_acquire(&coremap_lock);
+            zero_pool[zero_pool_n++] = page;
+            spinlock_release(&coremap_lock);
+            thread_yield();
+            spinlock_acquire(&coremap_lock);
+        }
+        if (pageout_state == PAGEOUT_RUNNING)
+            wchan_sleep(zero_wchan, &coremap_lock);
+    }
+    if (--daemons == 0)
+        pageout_state = PAGEOUT_STOPPED;
+    wchan_wakeall(pageout_done_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+}
+
+int coremap_start_pageout(void) {
+    unsigned int i;
+    int err;
+    pageout_wchan = wchan_create("pageout");
+    pageout_done_wchan = wchan_create("pageout_done");
+    zero_wchan = wchan_create("pagezero");
+    frame_wchan = wchan_create("frame");
+    if (pageout_wchan == NULL || pageout_done_wchan == NULL || zero_wchan == NULL || frame_wchan == NULL)
+        return ENOMEM;
+    for (i = 0; i < CM_SWAPOUT_WCHANS; i++) {
+        swapout_wchans[i] = wchan_create("swapout");
+        if (swapout_wchans[i] == NULL)
+            return ENOMEM;
+    }
+    spinlock_acquire(&coremap_lock);
+    pageout_state = PAGEOUT_RUNNING;
+    daemons = 2;
+    spinlock_release(&coremap_lock);
+    err = thread_fork("pageout", NULL, pageout, NULL, 0);
+    if (err) {
+        spinlock_acquire(&coremap_lock);
+        pageout_state = PAGEOUT_NONE;
+        daemons = 0;
+        spinlock_release(&coremap_lock);
+        return err;
+    }
+    err = thread_fork("pagezero", NULL, pagezero, NULL, 0);
+    if (err) {  // la coremap funziona anche senza pool di frame azzerati
+        spinlock_acquire(&coremap_lock);
+        daemons--;
+        spinlock_release(&coremap_lock);
+    }
+    return 0;
+}
+
+void coremap_stop_pageout(void) {
+    spinlock_acquire(&coremap_lock);
+    if (pageout_state == PAGEOUT_RUNNING) {
+        pageout_state = PAGEOUT_STOPPING;
+        wchan_wakeall(pageout_wchan, &coremap_lock);
+        wchan_wakeall(zero_wchan, &coremap_lock);
+        while (pageout_state != PAGEOUT_STOPPED)
+            wchan_sleep(pageout_done_wchan, &coremap_lock);
+    }
+    spinlock_release(&coremap_lock);
+}
+
+int coremap_set_watermarks(unsigned int low, unsigned int high) {
+    if (low > high)
+        return EINVAL;
+    spinlock_acquire(&coremap_lock);
+    low_watermark = low;
+    high_watermark = high;
+    if (nfree < low_watermark && pageout_state == PAGEOUT_RUNNING)
+        wchan_wakeone(pageout_wchan, &coremap_lock);
+    spinlock_release(&coremap_lock);
+    return 0;
+}
+
+void coremap_get_watermarks(unsigned int* low, unsigned int* high, unsigned int* free) {
+    spinlock_acquire(&coremap_lock);
+    *low = low_watermark;
+    *high = high_watermark;
+    *free = nfree;
+    spinlock_release(&coremap_lock);
+}
+
+unsigned int coremap_get_discards(void) {
+    unsigned int ret;
+    spinlock_acquire(&coremap_lock);
+    ret = discards;
+    spinlock_release(&coremap_lock);
+    return ret;
+}
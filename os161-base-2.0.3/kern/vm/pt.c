@@ -13,6 +13,13 @@
 
 static struct spinlock spinlock_faults_from_disk = SPINLOCK_INITIALIZER;
 
+#define PT_ROWS_INIT 4 /* capacità iniziale dell'indice delle Page Table di secondo livello */
+
+#define ROW_TEST(row, i)  ((row)->map[(i) / 32] & (1U << ((i) % 32)))
+#define ROW_SET(row, i)   ((row)->map[(i) / 32] |= (1U << ((i) % 32)))
+#define ROW_CLEAR(row, i) ((row)->map[(i) / 32] &= ~(1U << ((i) % 32)))
+
+
 
 struct pt* pt_create(){
     struct pt* ret;
@@ -25,59 +32,200 @@ struct pt* pt_create(){
         kfree(ret);
         return NULL;
     }
+    bzero(ret->table, sizeof(struct pt_entry*) * TABLE_SIZE);
+    ret->rows = kmalloc(sizeof(struct pt_row) * PT_ROWS_INIT);
+    if (ret->rows == NULL) {
+        kfree(ret->table);
+        kfree(ret);
+        return NULL;
+    }
+    ret->nrows = 0;
+    ret->rows_size = PT_ROWS_INIT;
     char name[16] = "pt_lock";
     snprintf(name, 16, "pt_lock_%d", id++);
     ret->pt_lock = lock_create(name);
     if (ret->pt_lock == NULL) {
+        kfree(ret->rows);
+        kfree(ret->table);
+        kfree(ret);
+        return NULL;
+    }
+    ret->busy_cv = cv_create(name);
+    if (ret->busy_cv == NULL) {
+        lock_destroy(ret->pt_lock);
+        kfree(ret->rows);
         kfree(ret->table);
         kfree(ret);
         return NULL;
     }
+    ret->nbusy = 0;
+    ret->trim_discards = coremap_get_discards();
     return ret;
 }
 
+static bool is_busy(struct pt* table, vaddr_t page) {
+    unsigned int i;
+    for (i = 0; i < table->nbusy; i++) {
+        if (table->busy[i] == page)
+            return true;
+    }
+    return false;
+}
+
+// marca come occupata la pagina page: eventuali altri fault sulla stessa pagina attendono su busy_cv
+static void set_busy(struct pt* table, vaddr_t page) {
+    KASSERT(table->nbusy < PT_MAX_BUSY);
+    table->busy[table->nbusy++] = page;
+}
+
+static void clear_busy(struct pt* table, vaddr_t page) {
+    unsigned int i;
+    for (i = 0; i < table->nbusy; i++) {
+        if (table->busy[i] == page) {
+            table->busy[i] = table->busy[--table->nbusy];
+            return;
+        }
+    }
+    panic("clear_busy: page 0x%x is not busy\n", page);
+}
+
+static struct pt_row* find_row(struct pt* table, unsigned int index) {
+    unsigned int i;
+    for (i = 0; i < table->nrows; i++) {
+        if (table->rows[i].index == index)
+            return &table->rows[i];
+    }
+    return NULL;
+}
+
+// marca come popolata la entry inte della Page Table di secondo livello exte
+static void set_live(struct pt* table, unsigned int exte, unsigned int inte) {
+    struct pt_row* row = find_row(table, exte);
+    KASSERT(row != NULL);
+    if (!ROW_TEST(row, inte)) {
+        ROW_SET(row, inte);
+        row->live++;
+    }
+}
+
+// dealloca la Page Table di secondo livello row, sostituendola nell'indice con l'ultima
+static void free_row(struct pt* table, struct pt_row* row) {
+    KASSERT(row->live == 0);
+    kfree(table->table[row->index]);
+    table->table[row->index] = NULL;
+    *row = table->rows[--table->nrows];
+}
+
+/*
+ * Toglie dalle entry popolate quelle rese invalide dallo swap-out di una pagina pulita e libera le Page Table di secondo livello
+ * rimaste vuote. Va invocata con pt_lock acquisito e senza fault in corso, che modificano le entry senza pt_lock; lo swap-out può
+ * rendere invalida una entry in ogni momento, ma nessuno tranne il processo la rende di nuovo valida.
+ */
+static void pt_trim(struct pt* table) {
+    unsigned int i, j, w, index;
+    struct pt_row* row;
+    KASSERT(lock_do_i_hold(table->pt_lock) && table->nbusy == 0);
+    table->trim_discards = coremap_get_discards();
+    // a ritroso: free_row sposta nella posizione liberata l'ultima Page Table dell'indice, già visitata
+    for (i = table->nrows; i-- > 0; ) {
+        row = &table->rows[i];
+        index = row->index;
+        for (w = 0; w < TABLE_SIZE / 32; w++) {
+            if (row->map[w] == 0)
+                continue;
+            for (j = w * 32; j < (w + 1) * 32; j++) {
+                if (ROW_TEST(row, j) && !table->table[index][j].valid) {
+                    ROW_CLEAR(row, j);
+                    row->live--;
+                }
+            }
+        }
+        if (row->live == 0)
+            free_row(table, row);
+    }
+}
+
 void pt_destroy(struct pt* table){ 
-    int i = 0;
+    unsigned int i, j, w;
+    struct pt_entry* entries;
     if (table == NULL) return;
 
     lock_acquire(swap_lock);
-    for (; i < TABLE_SIZE; i++) {
-        if (table->table[i] != NULL) {
-            int j = 0;
-            for(; j < TABLE_SIZE; j++) {
-                if (table->table[i][j].valid && !table->table[i][j].swp)
-                    free_frame(table->table[i][j].frame_no << 12); 
-                if (table->table[i][j].valid && table->table[i][j].swp)
-                    swap_get((vaddr_t)NULL, table->table[i][j].frame_no);  // libera l'entry relativa a tale pagina nello swap
+    for (i = 0; i < table->nrows; i++) {
+        entries = table->table[table->rows[i].index];
+        for (w = 0; w < TABLE_SIZE / 32; w++) {
+            if (table->rows[i].map[w] == 0)  // nessuna entry popolata in questo gruppo
+                continue;
+            for (j = w * 32; j < (w + 1) * 32; j++) {
+                if (!ROW_TEST(&table->rows[i], j))
+                    continue;
+                // l'evictor può modificare la entry in ogni momento: viene letta da free_user_frame con coremap_lock acquisito
+                free_user_frame(&entries[j]);
             }
-            kfree(table->table[i]);  // dealloco i blocchi utilizzati per contenere e entry
         }
+        kfree(entries);  // dealloco i blocchi utilizzati per contenere e entry
     }
+    kfree(table->rows);
     kfree(table->table);
+    KASSERT(table->nbusy == 0);
+    cv_destroy(table->busy_cv);
     lock_destroy(table->pt_lock);
     kfree(table);
     lock_release(swap_lock);
 }
 
 static int init_rows(struct pt* table, unsigned int index) {
+    struct pt_row* rows;
     index = GET_EXT_INDEX(index);
+    if (table->nrows == table->rows_size) {  // l'indice è pieno: ne raddoppio la capacità
+        rows = kmalloc(sizeof(struct pt_row) * table->rows_size * 2);
+        if (rows == NULL) {
+            kprintf("init_rows: No space left for pt entry creation \n");
+            return ENOMEM;
+        }
+        memcpy(rows, table->rows, sizeof(struct pt_row) * table->nrows);
+        kfree(table->rows);
+        table->rows = rows;
+        table->rows_size *= 2;
+    }
     table->table[index] = kmalloc(sizeof(struct pt_entry)*TABLE_SIZE);
     if (table->table[index] == NULL) {
         kprintf("init_rows: No space left for pt entry creation \n");
         return ENOMEM;
     }
+    COMPILE_ASSERT(sizeof(struct pt_entry) * TABLE_SIZE == PAGE_SIZE);
+    KASSERT(table->table[index] == PT_ROW_BASE(table->table[index]));  // richiesto da PT_ROW_BASE
+    bzero(table->table[index], PAGE_SIZE);
+    table->rows[table->nrows].index = index;
+    table->rows[table->nrows].live = 0;
+    bzero(table->rows[table->nrows].map, sizeof(table->rows[table->nrows].map));
+    table->nrows++;
     return 0;
 }
 
-static int load_frame(struct pt* table, unsigned int exte, unsigned int inte, vaddr_t fault_addr) {
+static int load_frame(struct pt* table, unsigned int exte, unsigned int inte, vaddr_t fault_addr, bool write) {
     static struct spinlock spinlock_zeroed_stats = SPINLOCK_INITIALIZER;
-    int err = 0;
-    table->table[exte][inte].frame_no = get_user_frame(&table->table[exte][inte]) >> 12;
-    if (table->table[exte][inte].frame_no == 0)
-        return ENOMEM;
+    paddr_t frame;
+    unsigned int file_size = as_page_file_size(proc_getas(), fault_addr);
+    int err;
+
+    if (!write && file_size == 0) {
+        // lettura di una pagina anonima: il frame verrà allocato solo alla prima scrittura, tramite copy-on-write
+        coremap_map_zero(&table->table[exte][inte]);
+        spinlock_acquire(&spinlock_zeroed_stats);
+        inc_counter(page_faults_zeroed);
+        spinlock_release(&spinlock_zeroed_stats);
+        return 0;
+    }
+    // il frame va azzerato a meno che load_page non lo sovrascriva interamente
+    err = get_user_frame(&table->table[exte][inte], file_size < PAGE_SIZE, &frame);
+    if (err)
+        return err;
+    table->table[exte][inte].frame_no = frame >> 12;
+    table->table[exte][inte].dirty = false;  // il contenuto coincide con quello del file ELF (o è azzerato)
     table->table[exte][inte].valid = true;
     if (fault_addr < PROJECT_STACK_MIN_ADDRESS){ //l'indirizzo si trova al di fuori dello stack ma dentro un segmento valido
-        err = load_page(proc_getas(), fault_addr); 
+        err = load_page(proc_getas(), fault_addr, frame);
         if (!err) {
         spinlock_acquire(&spinlock_faults_from_disk);
         inc_counter(page_faults_from_elf);
@@ -94,109 +242,191 @@ static int load_frame(struct pt* table, unsigned int exte, unsigned int inte, va
     return err;
 }
 
-int pt_get_frame_from_page(struct pt* table, vaddr_t fault_addr, paddr_t* frame_addr) {
-    unsigned int exte, inte;
+// risolve il fault sulla pagina occupata dal thread corrente, senza mantenere pt_lock; se ha successo il frame è fixed
+static int resolve_fault(struct pt* table, unsigned int exte, unsigned int inte, vaddr_t fault_addr, bool write, unsigned int ahead) {
+    struct pt_entry* entry = &table->table[exte][inte];
+    int err = 0;
+
+    if (entry->valid && coremap_fix_resident(entry)) {
+        // da questo momento in poi sino alla scrittura in tlb il frame non è swappable
+        inc_counter(tlb_reloads);
+    } else if (entry->valid == false) {  // primo accesso oppure pagina pulita scartata durante uno swap-out
+        //il frame è fixed in quanto appena uscito da una load quindi sono sicuro che nessuno abbia effettuato swap-out
+        err = load_frame(table, exte, inte, fault_addr, write);
+    } else {  // swap-in
+        err = load_from_swap(entry, ahead);
+        if (!err) {
+            spinlock_acquire(&spinlock_faults_from_disk);
+            inc_counter(page_faults_from_swap);
+            inc_counter(page_faults_disk);
+            spinlock_release(&spinlock_faults_from_disk);
+        }
+    }
+
+    if (err)
+        return err;
+    if (write) {
+        // una pagina condivisa con un altro address space dopo una fork viene copiata prima di essere modificata
+        err = coremap_copy_on_write(entry);
+        if (err)
+            return err;
+        if (!entry->dirty)  // il frame è fixed: la pagina non può essere rimossa dalla memoria
+            coremap_set_dirty(entry);
+    }
+    return 0;
+}
+
+int pt_get_frame_from_page(struct pt* table, vaddr_t fault_addr, bool write, paddr_t* frame_addr, bool* writable) {
+    unsigned int exte, inte, ahead = 0, k;
+    struct pt_entry* entry;
+    vaddr_t page = fault_addr & PAGE_FRAME;
     int err = 0;
     exte = GET_EXT_INDEX(fault_addr);
     inte = GET_INT_INDEX(fault_addr);
-    bool lock_hold = false;
-
 
     KASSERT(fault_addr < MIPS_KSEG0);
+    KASSERT(!lock_do_i_hold(table->pt_lock));  // load_page scrive nel frame tramite il suo indirizzo kernel: nessun fault annidato
 
-    if(lock_do_i_hold(table->pt_lock)){ //sono in fase di load
-        KASSERT(table->table[exte] != NULL); // ho già una page table di secondo livello
-        KASSERT(table->table[exte][inte].valid); //ho già ottenuto un frame
-        KASSERT(table->table[exte][inte].frame_no != 0);
-        lock_hold = true;
-    }
-
-    if (!lock_hold)lock_acquire(table->pt_lock);
+    lock_acquire(table->pt_lock);
+    // lo swap-out ha scartato molte pagine pulite: alcune Page Table di secondo livello possono essere rimaste vuote
+    if (table->nbusy == 0 && coremap_get_discards() - table->trim_discards >= PT_TRIM_DISCARDS)
+        pt_trim(table);
     // inizializzazione riga di secondo livello
     if (table->table[exte] == NULL)
         err = init_rows(table, fault_addr);
     if (err) {
-        if (!lock_hold) lock_release(table->pt_lock);
+        lock_release(table->pt_lock);
         return err;
     }
-    
-    if (table->table[exte][inte].valid == false) {
-        err = load_frame(table, exte, inte, fault_addr);
-        if (err) {
-            lock_release(table->pt_lock);
-            return err;
+    // un altro fault sulla stessa pagina è in corso: attendo che termini e trovo la pagina già in memoria
+    while (table->nbusy == PT_MAX_BUSY || is_busy(table, page))
+        cv_wait(table->busy_cv, table->pt_lock);
+    set_busy(table, page);
+    entry = &table->table[exte][inte];
+    if (entry->valid && entry->swp) {
+        // le pagine successive possono essere lette in anticipo dallo swap file: vanno occupate anch'esse
+        while (ahead < SWAP_CLUSTER - 1 && inte + ahead + 1 < TABLE_SIZE && table->nbusy < PT_MAX_BUSY &&
+               !is_busy(table, page + (ahead + 1) * PAGE_SIZE)) {
+            set_busy(table, page + (ahead + 1) * PAGE_SIZE);
+            ahead++;
         }
-        //il frame è fixed in quanto appena uscito da una load quindi sono sicuro che nessuno abbia effettuato swap-out
-        *frame_addr = table->table[exte][inte].frame_no << 12;
-        lock_release(table->pt_lock);
-        return 0;
-    }
-    int spl = splhigh();
-    while(table->table[exte][inte].swapping) { //busy wait finché non termina la procedura di swap-out della pagina
-        splx(spl);
-        thread_yield();
-        spl = splhigh();
     }
-    if (table->table[exte][inte].swp) {  // swap-in
-        splx(spl);
-        err = load_from_swap(&table->table[exte][inte]);
-        if (!err) {
-            spinlock_acquire(&spinlock_faults_from_disk);
-            inc_counter(page_faults_from_swap);
-            inc_counter(page_faults_disk);
-            spinlock_release(&spinlock_faults_from_disk);
+    lock_release(table->pt_lock);
+
+    // la entry è occupata: nessun altro thread la modifica, né pt_copy o pt_destroy ne liberano la Page Table di secondo livello
+    err = resolve_fault(table, exte, inte, fault_addr, write, ahead);
+    if (!err) {
+        // il frame non è swappable: l'evictor non modifica la entry
+        if (entry->prefetched) {  // la entry caricata in anticipo è stata rimossa dalla TLB
+            entry->prefetched = false;
+            inc_counter(tlb_prefetch_refaults);
         }
-    } else { //imposto il frame come fixed
-        coremap_set_fixed(table->table[exte][inte].frame_no);  // da questo momento in poi sino alla scrittura in tlb il frame non è swappable
-        inc_counter(tlb_reloads);
-        splx(spl);
+        *frame_addr = entry->frame_no << 12;
+        *writable = entry->dirty && !coremap_is_shared(entry->frame_no);
     }
 
-    if (err) {
-        if (!lock_hold) lock_release(table->pt_lock);
+    lock_acquire(table->pt_lock);
+    if (entry->valid)  // anche se load_page fallisce il frame va liberato da pt_destroy
+        set_live(table, exte, inte);
+    for (k = 0; k <= ahead; k++)
+        clear_busy(table, page + k * PAGE_SIZE);
+    cv_broadcast(table->busy_cv, table->pt_lock);
+    lock_release(table->pt_lock);
+    return err;
+}
+
+unsigned int pt_fix_resident_pages(struct pt* table, vaddr_t addr, unsigned int n, vaddr_t* pages, paddr_t* frames, bool* writable) {
+    unsigned int exte, inte, last, count = 0;
+    struct pt_entry* entry;
+    exte = GET_EXT_INDEX(addr);
+    inte = GET_INT_INDEX(addr);
+    last = inte + n < TABLE_SIZE ? inte + n : TABLE_SIZE - 1;
+
+    lock_acquire(table->pt_lock);
+    KASSERT(table->table[exte] != NULL);  // la riga contiene la pagina che ha causato il fault
+    while (inte++ < last) {
+        entry = &table->table[exte][inte];
+        // una pagina occupata è modificata dal fault in corso che la riguarda
+        if (is_busy(table, (exte << 22) | (inte << 12)))
+            continue;
+        if (!entry->valid || entry->swp || !coremap_try_fix_resident(entry))
+            continue;
+        entry->prefetched = true;  // il frame non è swappable: l'evictor non modifica la entry
+        pages[count] = (exte << 22) | (inte << 12);
+        frames[count] = entry->frame_no << 12;
+        writable[count] = entry->dirty && !coremap_is_shared(entry->frame_no);
+        count++;
+    }
+    lock_release(table->pt_lock);
+    return count;
+}
+
+// copia nella entry new del figlio la pagina descritta dalla entry old del padre
+static int pt_copy_entry(struct pt_entry* old, struct pt_entry* new) {
+    int err;
+    if (!old->valid)
+        return 0;
+    if (!old->swp && coremap_fix_resident(old)) {  // il frame del padre non può essere scelto come vittima durante la condivisione
+        // padre e figlio condividono il frame, mappandolo in sola lettura sino alla prima scrittura
+        new->frame_no = old->frame_no;  // da coremap_share in poi uno swap-out del frame aggiorna anche new
+        new->dirty = old->dirty;
+        new->valid = true;
+        err = coremap_share(old, new);
+        if (err)
+            new->valid = false;
         return err;
     }
-    *frame_addr = table->table[exte][inte].frame_no << 12;
-    if (!lock_hold) lock_release(table->pt_lock);
+    // la pagina si trova nello swap file oppure è stata scartata e verrà ricaricata dal file ELF
+    if (old->valid && old->swp) {
+        swap_inc_ref(old->frame_no);
+        new->frame_no = old->frame_no;
+        new->swp = true;
+        new->valid = true;
+    }
     return 0;
 }
 
 int pt_copy(struct pt* old, struct pt* new) {
-    int i = 0;
+    unsigned int i, j, w, index;
+    struct pt_row* row;
+    int err;
     lock_acquire(old->pt_lock);
-    lock_acquire(swap_lock);  
-    for (; i < TABLE_SIZE; i++) {
-        if (old->table[i] != NULL) {
-            if (init_rows(new, i << 22)) {
-                lock_release(swap_lock);
-                return ENOMEM;
+    // i fault in corso modificano le entry senza pt_lock: attendo che terminino, nessun altro può iniziare finché mantengo il lock
+    while (old->nbusy > 0)
+        cv_wait(old->busy_cv, old->pt_lock);
+    // a ritroso: free_row sposta nella posizione liberata l'ultima Page Table dell'indice, già visitata
+    for (i = old->nrows; i-- > 0; ) {
+        row = &old->rows[i];
+        index = row->index;
+        if (init_rows(new, index << 22)) {
+            lock_release(old->pt_lock);
+            return ENOMEM;
+        }
+        for (w = 0; w < TABLE_SIZE / 32; w++) {
+            if (row->map[w] == 0)
+                continue;
+            for (j = w * 32; j < (w + 1) * 32; j++) {
+                if (!ROW_TEST(row, j))
+                    continue;
+                if (!old->table[index][j].valid) {  // pagina pulita scartata: la entry non è più popolata
+                    ROW_CLEAR(row, j);
+                    row->live--;
+                    continue;
+                }
+                err = pt_copy_entry(&old->table[index][j], &new->table[index][j]);
+                if (err) {
+                    lock_release(old->pt_lock);
+                    return err;
+                }
+                if (new->table[index][j].valid)
+                    set_live(new, index, j);
             }
-            int j = 0;
-            for(; j < TABLE_SIZE; j++) 
-                if (old->table[i][j].valid) {
-                    new->table[i][j].swp = old->table[i][j].swp;
-                    new->table[i][j].valid = old->table[i][j].valid;
-                    if (new->table[i][j].swp) {
-                        new->table[i][j].frame_no = old->table[i][j].frame_no; 
-                        swap_inc_ref(new->table[i][j].frame_no);
-                    }
-                    else {
-                        int spl;
-                        new->table[i][j].frame_no = get_user_frame(&new->table[i][j]) >> 12;
-                        if (new->table[i][j].frame_no == 0) {
-                            lock_release(swap_lock);
-                            return ENOMEM;
-                        }
-                        spl = splhigh();
-                        memcpy((void *) PADDR_TO_KVADDR(new->table[i][j].frame_no << 12), 
-                            (void *) PADDR_TO_KVADDR(old->table[i][j].frame_no << 12), 4096);
-                        coremap_set_unfixed(new->table[i][j].frame_no);
-                        splx(spl);
-                    }
-                } 
+        }
+        if (row->live == 0) {  // la Page Table non contiene più pagine: viene liberata in entrambi i processi
+            free_row(new, find_row(new, index));
+            free_row(old, row);
         }
     }
-    lock_release(swap_lock);
     lock_release(old->pt_lock);
     return 0;
-}
\ No newline at end of file
+}
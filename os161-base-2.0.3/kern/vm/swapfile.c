@@ -12,13 +12,135 @@
 #include <coremap.h>
 #include <pt.h>
 #include <vm_stats.h>
+#include <bitmap.h>
+#include <clock.h>
+#include <kern/stat.h>
 
 static struct swap_file* swap;
 static bool init = false;
 
+// tutte le porzioni del gruppo group sono occupate?
+static bool group_is_full(unsigned int group) {
+    unsigned int i;
+    for (i = group * SWAP_GROUP_SIZE; i < (group + 1) * SWAP_GROUP_SIZE && i < swap->nslots; i++) {
+        if (!bitmap_isset(swap->slots, i))
+            return false;
+    }
+    return true;
+}
+
+static void mark_slot(unsigned int index) {
+    bitmap_mark(swap->slots, index);
+    if (group_is_full(index / SWAP_GROUP_SIZE))
+        bitmap_mark(swap->full, index / SWAP_GROUP_SIZE);
+    swap->used++;
+    if (swap->used > swap->peak)
+        swap->peak = swap->used;
+}
+
+/*
+ * Riserva n porzioni libere e contigue del file, ritorna ENOSPC se non esistono. La ricerca parte dal primo gruppo non
+ * pieno a partire dall'ultimo utilizzato: nel caso comune la prima porzione libera trovata è seguita da altre porzioni libere.
+ */
+static int alloc_slots(unsigned int n, unsigned int* index) {
+    unsigned int group, pos, first, k, scanned = 0;
+    if (bitmap_find_clear(swap->full, swap->hint, &group))
+        return ENOSPC;
+    pos = group * SWAP_GROUP_SIZE;
+    while (scanned < swap->nslots) {
+        if (bitmap_find_clear(swap->slots, pos, &first))
+            return ENOSPC;
+        scanned += (first + swap->nslots - pos) % swap->nslots;  // porzioni occupate saltate
+        for (k = 1; k < n && first + k < swap->nslots && !bitmap_isset(swap->slots, first + k); k++);
+        if (k == n) {
+            for (k = 0; k < n; k++)
+                mark_slot(first + k);
+            swap->hint = (first + n - 1) / SWAP_GROUP_SIZE;
+            *index = first;
+            return 0;
+        }
+        scanned += k;
+        pos = (first + k) % swap->nslots;
+    }
+    return ENOSPC;
+}
+
+static void free_slot(unsigned int index) {
+    bitmap_unmark(swap->slots, index);
+    if (bitmap_isset(swap->full, index / SWAP_GROUP_SIZE))
+        bitmap_unmark(swap->full, index / SWAP_GROUP_SIZE);
+    swap->used--;
+}
+
+/*
+ * Apre il backend name e alloca le strutture che ne descrivono le porzioni, tutte libere. Il file di swap viene troncato,
+ * mentre un disco viene aperto tramite il suo dispositivo raw e ne vengono utilizzate tante porzioni quante ne contiene.
+ */
+static int open_backend(const char* name) {
+    char path[32];
+    struct stat st;
+    struct vnode* file;
+    unsigned int nslots;
+    int err;
+
+    if (strlen(name) >= sizeof(swap->backend))
+        return EINVAL;
+    if (strcmp(name, SWAP_BACKEND_FILE) == 0) {
+        strcpy(path, SWAP_FILE_NAME);  // vfs_open può modificare il percorso
+        err = vfs_open(path, O_CREAT | O_RDWR | O_TRUNC, 0664, &file);
+        if (err)
+            return err;
+        nslots = SWAP_MAX;
+    } else {
+        snprintf(path, sizeof(path), "%sraw:", name);
+        err = vfs_open(path, O_RDWR, 0, &file);
+        if (err)
+            return err;
+        err = VOP_STAT(file, &st);
+        if (err) {
+            vfs_close(file);
+            return err;
+        }
+        nslots = st.st_size / PAGE_SIZE;  // d_blocks * d_blocksize
+        if (nslots > SWAP_DEVICE_MAX)
+            nslots = SWAP_DEVICE_MAX;
+        if (nslots == 0) {
+            vfs_close(file);
+            return ENOSPC;
+        }
+    }
+
+    swap->refs = kmalloc(nslots);
+    swap->slots = bitmap_create(nslots);
+    swap->full = bitmap_create((nslots + SWAP_GROUP_SIZE - 1) / SWAP_GROUP_SIZE);
+    if (swap->refs == NULL || swap->slots == NULL || swap->full == NULL) {
+        if (swap->refs != NULL)
+            kfree(swap->refs);
+        if (swap->slots != NULL)
+            bitmap_destroy(swap->slots);
+        if (swap->full != NULL)
+            bitmap_destroy(swap->full);
+        vfs_close(file);
+        return ENOMEM;
+    }
+    bzero(swap->refs, nslots);
+    swap->file = file;
+    swap->nslots = nslots;
+    strcpy(swap->backend, name);
+    swap->hint = swap->used = swap->peak = 0;
+    return 0;
+}
+
+static void close_backend(void) {
+    vfs_close(swap->file);
+    kfree(swap->refs);
+    bitmap_destroy(swap->slots);
+    bitmap_destroy(swap->full);
+}
+
 //ritorna 0 se non ci sono stati errori
 int swap_init() {
-    char name[] = "emu0:/SWAPFILE";
+    int err;
     swap = kmalloc(sizeof(struct swap_file));
     if (swap == NULL) {
         panic("swap_init: OUT OF MEMORY");
@@ -31,19 +153,83 @@ int swap_init() {
         return ENOMEM;
     }
     lock_acquire(swap_lock);
+    err = open_backend(SWAP_BACKEND_FILE);
+    if (err) {
+        lock_release(swap_lock);
+        return err;
+    }
     init = true;
-    vfs_open(name, O_CREAT | O_RDWR | O_TRUNC, 0664, &swap->file);
     lock_release(swap_lock);
     return 0;
 }
 
+int swap_set_backend(const char* name) {
+    char old[sizeof(swap->backend)];
+    int err;
+
+    lock_acquire(swap_lock);
+    if (!init) {
+        lock_release(swap_lock);
+        return EPERM;
+    }
+    if (swap->used > 0) {  // le pagine nello swap non vengono trasferite nel nuovo backend
+        lock_release(swap_lock);
+        return EBUSY;
+    }
+    strcpy(old, swap->backend);
+    close_backend();
+    err = open_backend(name);
+    if (err && open_backend(old))  // il backend precedente è stato appena chiuso: riaprirlo non dovrebbe fallire
+        panic("swap_set_backend: cannot reopen the %s backend\n", old);
+    lock_release(swap_lock);
+    return err;
+}
+
+const char* swap_get_backend(unsigned int* nslots) {
+    lock_acquire(swap_lock);
+    *nslots = swap->nslots;
+    lock_release(swap_lock);
+    return swap->backend;
+}
+
+// tempo trascorso tra before e l'istante attuale, in nanosecondi
+static unsigned long long elapsed_ns(const struct timespec* before) {
+    struct timespec after, duration;
+    gettime(&after);
+    timespec_sub(&after, before, &duration);
+    return duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+}
+
+// prepara ku per trasferire n pagine, agli indirizzi logici del kernel addresses, dalle/nelle porzioni contigue che iniziano da index
+static void swap_uio_init(struct iovec* iov, struct uio* ku, vaddr_t* addresses, unsigned int n, unsigned int index, enum uio_rw rw) {
+    unsigned int k;
+    KASSERT(n > 0 && n <= SWAP_CLUSTER);
+    for (k = 0; k < n; k++) {
+        iov[k].iov_kbase = (void *)addresses[k];
+        iov[k].iov_len = PAGE_SIZE;
+    }
+    ku->uio_iov = iov;
+    ku->uio_iovcnt = n;
+    ku->uio_offset = (off_t)index * PAGE_SIZE;
+    ku->uio_resid = n * PAGE_SIZE;
+    ku->uio_segflg = UIO_SYSSPACE;
+    ku->uio_rw = rw;
+    ku->uio_space = NULL;
+}
+
 // ritorna 0 se non ci sono stati errori
 int swap_get(vaddr_t address, unsigned int index) {
-    struct iovec iov;
-	struct uio ku;
-    int err = 0;
-    
-    bool lock_hold = lock_do_i_hold(swap_lock);
+    bool lock_hold;
+    int err;
+
+    //se address è null significa che voglio liberare la pagina dello swap e non fare swap-in, e.g. durante una pt destroy
+    if ((void *)address != NULL) {
+        err = swap_get_cluster(&address, index, 1);
+        if (err)
+            return err;
+    }
+
+    lock_hold = lock_do_i_hold(swap_lock);
     if(!lock_hold) lock_acquire(swap_lock);
 
     if (!init) {
@@ -53,16 +239,37 @@ int swap_get(vaddr_t address, unsigned int index) {
 
     KASSERT(swap->refs[index] > 0);
     swap->refs[index]--;
-    //se address è null significa che voglio liberare la pagina dello swap e non fare swap-in, e.g. durante una pt destroy
+    if (swap->refs[index] == 0)
+        free_slot(index);
+
+    if (!lock_hold) lock_release(swap_lock);
+    return 0;
+}
+
+// ritorna 0 se non ci sono stati errori
+int swap_get_cluster(vaddr_t* addresses, unsigned int index, unsigned int n) {
+    struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+    struct timespec before;
+    unsigned int k;
+    int err = 0;
     
-    if ((void *)address == NULL) {
+    bool lock_hold = lock_do_i_hold(swap_lock);
+    if(!lock_hold) lock_acquire(swap_lock);
+
+    if (!init) {
         if (!lock_hold) lock_release(swap_lock);
-        return 0;
+        return EPERM;
     }
-    
 
-    uio_kinit(&iov, &ku, (void *)address, PAGE_SIZE, index*PAGE_SIZE, UIO_READ);
+    for (k = index; k < index + n; k++)
+        KASSERT(swap->refs[k] > 0);
+    swap_uio_init(iov, &ku, addresses, n, index, UIO_READ);
+    gettime(&before);
     err = VOP_READ(swap->file, &ku);
+    add_counter(swap_read_ns, elapsed_ns(&before));
+    if (!err)
+        add_counter(swap_file_reads, n);
 
     if(!lock_hold)
         lock_release(swap_lock);
@@ -72,9 +279,15 @@ int swap_get(vaddr_t address, unsigned int index) {
 
 // ritorna 0 se non ci sono stati errori
 int swap_set(vaddr_t address, unsigned int* ret_index) {
-    struct iovec iov;
+    return swap_set_cluster(&address, 1, ret_index);
+}
+
+// ritorna 0 se non ci sono stati errori
+int swap_set_cluster(vaddr_t* addresses, unsigned int n, unsigned int* ret_index) {
+    struct iovec iov[SWAP_CLUSTER];
 	struct uio ku;
-    unsigned int index = 0;
+    struct timespec before;
+    unsigned int index, k;
     int err = 0;
     
     bool lock_hold = lock_do_i_hold(swap_lock);
@@ -83,18 +296,28 @@ int swap_set(vaddr_t address, unsigned int* ret_index) {
         if (!lock_hold) lock_release(swap_lock);
         return EPERM;
     }
-    for(; index < SWAP_MAX && swap->refs[index] > 0; index++);   
-    if (index == SWAP_MAX) {
+    err = alloc_slots(n, &index);
+    if (err) {
         if (!lock_hold)  lock_release(swap_lock);
-        panic("swap_init: Out of swap space");
-        return ENOSPC;
+        return err;
     }
-    swap->refs[index] = 1;
+    for (k = index; k < index + n; k++)
+        swap->refs[k] = 1;
     
-    uio_kinit(&iov, &ku, (void *)address, PAGE_SIZE, index*PAGE_SIZE, UIO_WRITE);
+    swap_uio_init(iov, &ku, addresses, n, index, UIO_WRITE);
+    gettime(&before);
     err = VOP_WRITE(swap->file, &ku);
+    add_counter(swap_write_ns, elapsed_ns(&before));
     *ret_index = index;
-    if (!err) inc_counter(swap_file_writes);
+    if (!err) {
+        add_counter(swap_file_writes, n);
+        inc_counter(swap_cluster_writes);
+    } else {  // le porzioni non contengono le pagine: vengono restituite
+        for (k = index; k < index + n; k++) {
+            swap->refs[k] = 0;
+            free_slot(k);
+        }
+    }
     if(!lock_hold)
         lock_release(swap_lock);
     return err;
@@ -104,37 +327,71 @@ void swap_close() {
     lock_acquire(swap_lock);
     if (init) {
     init = false;
-    vfs_close(swap->file);
+    add_counter(swap_slots_used, swap->used);
+    add_counter(swap_slots_peak, swap->peak);
+    kprintf("\nSwap backend: %s (%u slots)\n", swap->backend, swap->nslots);
+    close_backend();
     kfree(swap);
     swap = NULL;
     }
     lock_release(swap_lock);
 }
 
-int load_from_swap(struct pt_entry* entry){
+int load_from_swap(struct pt_entry* entry, unsigned int ahead){
 
     int err;
-    paddr_t frame;    
-    
+    paddr_t frames[SWAP_CLUSTER];
+    vaddr_t addresses[SWAP_CLUSTER];
+    struct pt_entry* row = PT_ROW_BASE(entry);
+    unsigned int pos = PT_ROW_INDEX(entry), n, k;
 
     KASSERT(entry->swp);
-    frame = get_user_frame(entry);
-    if(frame == 0){
-        return ENOMEM;
+    err = get_user_frame(entry, false, &frames[0]);  // il frame viene sovrascritto dalla lettura
+    if (err) {
+        return err;
+    }
+    addresses[0] = PADDR_TO_KVADDR(frames[0]);
+
+    /*
+     * Read-ahead: le pagine successive della stessa Page Table di secondo livello che si trovano nelle porzioni successive
+     * dello swap file (scritte dallo stesso cluster) vengono lette con la stessa operazione, ma solo in frame già liberi.
+     * Sono considerate solo le ahead pagine successive, occupate dal chiamante nella Page Table.
+     */
+    for (n = 1; n <= ahead && n < SWAP_CLUSTER && pos + n < TABLE_SIZE; n++) {
+        if (!row[pos + n].valid || !row[pos + n].swp || row[pos + n].frame_no != entry->frame_no + n)
+            break;
+        frames[n] = get_free_user_frame(&row[pos + n]);
+        if (frames[n] == 0)
+            break;
+        addresses[n] = PADDR_TO_KVADDR(frames[n]);
     }
 
-    err = swap_get(PADDR_TO_KVADDR(frame), entry->frame_no);
+    err = swap_get_cluster(addresses, entry->frame_no, n);
      
     if(!err){
-        entry->frame_no = frame >> 12;
-        entry->swp = false;
+        /*
+         * Le porzioni lette rimangono riservate: finché le pagine non vengono modificate sono copie aggiornate
+         * e uno swap-out successivo non dovrà riscriverle.
+         */
+        for (k = 0; k < n; k++) {
+            coremap_set_swap_copy(frames[k] >> 12, entry->frame_no + k);
+            row[pos + k].frame_no = frames[k] >> 12;
+            row[pos + k].swp = false;
+            row[pos + k].dirty = false;
+        }
+        for (k = 1; k < n; k++)  // le pagine lette in anticipo possono essere scelte come vittime
+            coremap_set_unfixed(frames[k] >> 12);
+        add_counter(swap_pages_read_ahead, n - 1);
+    } else {
+        for (k = 0; k < n; k++)
+            free_frame(frames[k]);
     }
 
     return err;
 }
 
 void swap_inc_ref(unsigned int index) {
-    KASSERT(index < SWAP_MAX);
+    KASSERT(index < swap->nslots);
     if (!lock_do_i_hold(swap_lock)) {
         lock_acquire(swap_lock);
         swap->refs[index]++;
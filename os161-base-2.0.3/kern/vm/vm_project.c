@@ -85,11 +85,17 @@ void vm_bootstrap(void) {
     }
     init = true;
     spinlock_release(&vm_lock);
+    tlb_bootstrap();
     err = swap_init();
     if (err) {
         panic("vm_bootstrap: Error during swap init: %s\n", strerror(err));
         return;
     }
+    err = coremap_start_pageout();
+    if (err) {
+        panic("vm_bootstrap: Cannot start the pageout daemon: %s\n", strerror(err));
+        return;
+    }
 }
 
 static paddr_t
@@ -132,17 +138,29 @@ void free_kpages(vaddr_t addr) {
 
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts) {
-    (void)ts;
-    panic("vm_project tried to do tlb shootdown?!\n");
-}
 
+// ritorna 1 se vaddr non appartiene né a un segmento dell'address space né allo stack, altrimenti indica in read_only se sia in sola lettura
+static int find_segment(struct addrspace *as, vaddr_t vaddr, uint8_t *read_only) {
+    int i;
+    *read_only = 0;
+    for (i = 0; i < N_SEGMENTS; i++) {
+        if (vaddr >= as->segments[i].p_vaddr && vaddr < as->segments[i].p_vaddr + as->segments[i].p_memsz) {
+            *read_only = !(as->segments[i].writable);
+            return 0;
+        }
+    }
+    return vaddr < PROJECT_STACK_MIN_ADDRESS;
+}
 
 int vm_fault(int faulttype, vaddr_t faultaddress) {
     paddr_t paddr;
-    uint32_t ehi, elo;
-    int i, spl, e_fault = 1;
-    uint8_t read_only = 0;
+    vaddr_t pages[TLB_FAULT_AROUND_MAX];
+    paddr_t frames[TLB_FAULT_AROUND_MAX];
+    bool writables[TLB_FAULT_AROUND_MAX];
+    unsigned int k, n = 0;
+    int spl;
+    uint8_t read_only = 0, page_read_only;
+    bool write, writable;
     struct addrspace *as;
 
     spinlock_acquire(&vm_lock);
@@ -179,14 +197,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
         return EFAULT;
     }
     
-    for(i=0; i<N_SEGMENTS && e_fault; i++){
-        if (faultaddress >= as->segments[i].p_vaddr && faultaddress < as->segments[i].p_vaddr + as->segments[i].p_memsz) {
-            e_fault = 0;
-            read_only = !(as->segments[i].writable);
-        }
-    }
-
-    if ( e_fault && faultaddress < PROJECT_STACK_MIN_ADDRESS ) {    // outside stack
+    if (find_segment(as, faultaddress, &read_only)) {    // outside stack
         kprintf("\nvm_fault: %s\nThe address: %p, is out of the defined memory segments\n", strerror(EFAULT), (void *)faultaddress);
         sys__exit(EFAULT);
     }
@@ -196,16 +207,22 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 
     switch (faulttype) {
         case VM_FAULT_READONLY:
-            kprintf("\nvm_fault: %s\nAttempt to write into a read-only memory segment: %p\n", strerror(EFAULT), (void *)faultaddress);
-            sys__exit(EFAULT);
+            if (read_only) {
+                kprintf("\nvm_fault: %s\nAttempt to write into a read-only memory segment: %p\n", strerror(EFAULT), (void *)faultaddress);
+                sys__exit(EFAULT);
+            }
+            // prima scrittura in una pagina pulita o condivisa copy-on-write di un segmento scrivibile, mappata in sola lettura
+            break;
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
             break;
         default:
             return EINVAL;
     }
-    
-    int err = pt_get_frame_from_page(as->page_table, faultaddress, &paddr);
+
+    // durante il caricamento dal file ELF la pagina rimane pulita
+    write = faulttype != VM_FAULT_READ && !read_only && !as->ignore_permissions;
+    int err = pt_get_frame_from_page(as->page_table, faultaddress, write, &paddr, &writable);
     if (err != 0) {
         kprintf("\nvm_fault: get_frame failed %s\n", strerror(err));
         sys__exit(err);
@@ -215,41 +232,36 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
     /* make sure it's page-aligned */
     KASSERT((paddr & PAGE_FRAME) == paddr);
 
+    // fault-around: le pagine successive già in memoria vengono caricate in TLB evitando i relativi fault
+    if (!as->ignore_permissions && tlb_get_fault_around() > 0)
+        n = pt_fix_resident_pages(as->page_table, faultaddress, tlb_get_fault_around(), pages, frames, writables);
+
     /* Disable interrupts on this CPU while frobbing the TLB. */
     spl = splhigh();
 
-    for (i = 0; i < NUM_TLB; i++) {
-        tlb_read(&ehi, &elo, i);
-        if (ehi == faultaddress && ((elo & PAGE_FRAME) == paddr)) { // se ho effettuato una load questa entry potrebbe già esiste
-            inc_counter(tlb_faults_with_replace);
-            goto write;
-        }
-        if (elo & TLBLO_VALID) {
-            continue;
-        }
-        inc_counter(tlb_faults_with_free);
-        goto write;
-    }
-
-    i = tlb_get_rr_victim();
-    inc_counter(tlb_faults_with_replace);
-write:
     inc_counter(tlb_faults);
-    ehi = faultaddress;
-    if (read_only && !as->ignore_permissions)
-        elo = paddr | TLBLO_VALID;
+    if (tlb_insert(faultaddress, paddr, !read_only && writable))
+        inc_counter(tlb_faults_with_free);
     else
-        elo = paddr | TLBLO_DIRTY | TLBLO_VALID; 
+        inc_counter(tlb_faults_with_replace);
     DEBUG(DB_VM, "vm_project: 0x%x -> 0x%x\n", faultaddress, paddr);
-    tlb_write(ehi, elo, i);
     if (!as->ignore_permissions) // se sono in fase di load il frame non è swappable
-        coremap_set_unfixed(paddr >> 12);
+        coremap_set_mapped(paddr >> 12);
+
+    for (k = 0; k < n; k++) {
+        if (find_segment(as, pages[k], &page_read_only))  // non può accadere: la pagina è in memoria
+            page_read_only = 1;
+        tlb_insert(pages[k], frames[k], !page_read_only && writables[k]);
+        inc_counter(tlb_prefetches);
+        coremap_set_unfixed(frames[k] >> 12);  // il bit di riferimento verrà impostato da un eventuale TLB reload
+    }
     splx(spl);
     return 0;
 }
 
 void vm_shutdown(void){
 
+    coremap_stop_pageout();  // il daemon non deve effettuare swap-out dopo la chiusura dello swap file
     swap_close(); 
     spinlock_acquire(&vm_lock);
 
@@ -1,11 +1,12 @@
 #include <types.h>
 #include <vm_stats.h>
 #include <lib.h>
+#include <vm.h>
 
 
-static unsigned long long counters[10] = {0};
+static unsigned long long counters[VM_STATS_N] = {0};
 
-static const char* messages[10] = {
+static const char* messages[VM_STATS_N] = {
     "tlb_faults                :",
     "tlb_faults_with_free      :",
     "tlb_faults_with_replace   :",
@@ -15,16 +16,45 @@ static const char* messages[10] = {
     "page_faults_disk          :",
     "page_faults_from_elf      :",
     "page_faults_from_swap     :",
-    "swap_file_writes          :"
+    "swap_file_writes          :",
+    "frame_cache_hits          :",
+    "frame_cache_misses        :",
+    "swap_slots_used           :",
+    "swap_slots_peak           :",
+    "swap_cluster_writes       :",
+    "swap_pages_read_ahead     :",
+    "pageout_wakeups           :",
+    "pageout_pages             :",
+    "swap_writes_avoided       :",
+    "cow_faults                :",
+    "tlb_prefetches            :",
+    "tlb_prefetch_refaults     :",
+    "zero_page_mappings        :",
+    "zero_pool_hits            :",
+    "zero_pool_misses          :",
+    "swap_file_reads           :",
+    "swap_read_ns              :",
+    "swap_write_ns             :",
+    "tlb_shootdowns            :"
 };
 
+// KB trasferiti al secondo leggendo o scrivendo pages pagine in ns nanosecondi
+static unsigned long long throughput(unsigned long long pages, unsigned long long ns) {
+    return ns == 0 ? 0 : pages * (PAGE_SIZE / 1024) * 1000000000ULL / ns;
+}
+
 
 void inc_counter(unsigned int position){
-    KASSERT( position < 10 );
+    KASSERT( position < VM_STATS_N );
     counters[position]++;
 
 }
 
+void add_counter(unsigned int position, unsigned long long value){
+    KASSERT( position < VM_STATS_N );
+    counters[position] += value;
+}
+
 void print_stats(void){
 
 
@@ -41,6 +71,27 @@ void print_stats(void){
     kprintf("%s %lld\n", messages[page_faults_from_elf],     counters[page_faults_from_elf]);
     kprintf("%s %lld\n", messages[page_faults_from_swap],    counters[page_faults_from_swap]);
     kprintf("%s %lld\n", messages[swap_file_writes],         counters[swap_file_writes]);
+    kprintf("%s %lld\n", messages[frame_cache_hits],         counters[frame_cache_hits]);
+    kprintf("%s %lld\n", messages[frame_cache_misses],       counters[frame_cache_misses]);
+    kprintf("%s %lld\n", messages[swap_slots_used],          counters[swap_slots_used]);
+    kprintf("%s %lld\n", messages[swap_slots_peak],          counters[swap_slots_peak]);
+    kprintf("%s %lld\n", messages[swap_cluster_writes],      counters[swap_cluster_writes]);      /* swap_file_writes / swap_cluster_writes = dimensione media di un cluster */
+    kprintf("%s %lld\n", messages[swap_pages_read_ahead],    counters[swap_pages_read_ahead]);
+    kprintf("%s %lld\n", messages[pageout_wakeups],          counters[pageout_wakeups]);
+    kprintf("%s %lld\n", messages[pageout_pages],            counters[pageout_pages]);
+    kprintf("%s %lld\n", messages[swap_writes_avoided],      counters[swap_writes_avoided]);
+    kprintf("%s %lld\n", messages[cow_faults],               counters[cow_faults]);
+    kprintf("%s %lld\n", messages[tlb_prefetches],           counters[tlb_prefetches]);
+    kprintf("%s %lld\n", messages[tlb_prefetch_refaults],    counters[tlb_prefetch_refaults]);
+    kprintf("%s %lld\n", messages[zero_page_mappings],       counters[zero_page_mappings]);
+    kprintf("%s %lld\n", messages[zero_pool_hits],           counters[zero_pool_hits]);             /* zero_pool_hits / (zero_pool_hits + zero_pool_misses) = hit rate del pool */
+    kprintf("%s %lld\n", messages[zero_pool_misses],         counters[zero_pool_misses]);
+    kprintf("%s %lld\n", messages[swap_file_reads],          counters[swap_file_reads]);
+    kprintf("%s %lld\n", messages[swap_read_ns],             counters[swap_read_ns]);
+    kprintf("%s %lld\n", messages[swap_write_ns],            counters[swap_write_ns]);
+    kprintf("%s %lld\n", messages[tlb_shootdowns],           counters[tlb_shootdowns]);
+    kprintf("swap read throughput      : %llu KB/s\n", throughput(counters[swap_file_reads], counters[swap_read_ns]));
+    kprintf("swap write throughput     : %llu KB/s\n", throughput(counters[swap_file_writes], counters[swap_write_ns]));
 
 
     if(counters[tlb_faults] != counters[tlb_faults_with_free] + counters[tlb_faults_with_replace]){
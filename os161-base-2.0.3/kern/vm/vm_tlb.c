@@ -2,6 +2,78 @@
 #include <vm.h>
 #include <spl.h>
 #include <current.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm_stats.h>
+#include <platform/maxcpus.h>
+#include <kern/errno.h>
+
+static unsigned int fault_around = TLB_FAULT_AROUND_DEFAULT;
+
+/*
+ * ASID: l'ASID 0 non viene assegnato, così che un address space appena creato (generazione 0) ne riceva sempre uno alla prima
+ * attivazione. Un ASID rimane dell'address space finché gli ASID della generazione corrente non si esauriscono: solo allora la TLB
+ * di ogni cpu viene svuotata, alla prima attivazione successiva di un address space su quella cpu.
+ * Un address space che viene attivato su una cpu diversa da quella precedente riceve un nuovo ASID: le entry che ha lasciato nella
+ * TLB dell'altra cpu non possono più essere usate, quindi quelle valide si trovano solo nella TLB della cpu su cui è attivo e le
+ * modifiche ai suoi mapping fatte da quella cpu (copy on write, tlb_invalidate_as) non richiedono IPI.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;     /* generazione corrente degli ASID */
+static unsigned int next_asid = 1;       /* prossimo ASID libero della generazione corrente */
+
+static struct {
+    uint32_t generation;  /* generazione degli ASID presenti nella TLB della cpu */
+    uint32_t entryhi;     /* ASID attivo sulla cpu, nel campo PID di EntryHi */
+} tlb_cpus[MAXCPUS];
+
+void tlb_activate(struct addrspace* as) {
+    bool flush;
+    int i, spl;
+
+    spinlock_acquire(&asid_lock);
+    if (as->asid_generation != asid_generation || as->asid_cpu != curcpu->c_number) {  // ASID riassegnato oppure as cambia cpu
+        if (next_asid == NUM_TLBPID) {  // ASID esauriti: inizia una nuova generazione
+            asid_generation++;
+            next_asid = 1;
+        }
+        as->asid = next_asid++;
+        as->asid_generation = asid_generation;
+        as->asid_cpu = curcpu->c_number;
+    }
+    flush = tlb_cpus[curcpu->c_number].generation != asid_generation;
+    tlb_cpus[curcpu->c_number].generation = asid_generation;
+    spinlock_release(&asid_lock);
+
+    /* Disable interrupts on this CPU while frobbing the TLB. */
+    spl = splhigh();
+    if (flush) {  // la TLB potrebbe contenere entry con un ASID ora assegnato a un altro address space
+        inc_counter(tlb_invalidations);
+        for (i = 0; i < NUM_TLB; i++) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    tlb_cpus[curcpu->c_number].entryhi = as->asid << TLBHI_PIDSHIFT;
+    tlb_setentryhi(tlb_cpus[curcpu->c_number].entryhi);
+    splx(spl);
+}
+
+void tlb_invalidate_as(struct addrspace* as) {
+    uint32_t ehi, elo;
+    int i, spl;
+
+    spl = splhigh();
+    for (i = 0; i < NUM_TLB; i++) {
+        tlb_read(&ehi, &elo, i);
+        if ((elo & TLBLO_VALID) && (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == as->asid)
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setentryhi(tlb_cpus[curcpu->c_number].entryhi);  // tlb_read e tlb_write sovrascrivono EntryHi
+    splx(spl);
+}
+
 int tlb_get_rr_victim(void) {
     KASSERT(curthread->t_iplhigh_count > 0);
 
@@ -12,6 +84,35 @@ int tlb_get_rr_victim(void) {
     return victim;
 }
 
+bool tlb_insert(vaddr_t vaddr, paddr_t paddr, bool writable) {
+    uint32_t ehi, elo;
+    bool free = false;
+    int i;
+
+    KASSERT(curthread->t_iplhigh_count > 0);
+
+    // dopo una load, oppure alla prima scrittura in una pagina mappata in sola lettura, la entry potrebbe già esistere
+    ehi = vaddr | tlb_cpus[curcpu->c_number].entryhi;
+    i = tlb_probe(ehi, 0);
+    if (i < 0) {
+        for (i = 0; i < NUM_TLB; i++) {
+            tlb_read(&ehi, &elo, i);
+            if (!(elo & TLBLO_VALID)) {
+                free = true;
+                break;
+            }
+        }
+        if (!free)
+            i = tlb_get_rr_victim();
+    }
+    ehi = vaddr | tlb_cpus[curcpu->c_number].entryhi;
+    elo = paddr | TLBLO_VALID;
+    if (writable)  // altrimenti una scrittura causerà VM_FAULT_READONLY
+        elo |= TLBLO_DIRTY;
+    tlb_write(ehi, elo, i);  // EntryHi contiene di nuovo l'ASID attivo
+    return free;
+}
+
 void invalidate_entry_by_paddr(paddr_t paddr) {
     int i;
 
@@ -20,9 +121,77 @@ void invalidate_entry_by_paddr(paddr_t paddr) {
     for (i = 0; i < NUM_TLB; i++) {
         uint32_t ehi, elo;
         tlb_read(&ehi, &elo, i);
-        if (paddr == (elo & PAGE_FRAME)) {
+        if ((elo & TLBLO_VALID) && paddr == (elo & PAGE_FRAME))  // il frame può essere mappato da più address space
             tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-            break;
-        }
     }
+    tlb_setentryhi(tlb_cpus[curcpu->c_number].entryhi);  // tlb_read e tlb_write sovrascrivono EntryHi
+}
+
+/*
+ * TLB shootdown: ogni cpu destinataria invalida le entry del frame in vm_tlbshootdown e lo segnala in done; la cpu che lo ha richiesto
+ * attende con gli interrupt abilitati, così da servire a sua volta le richieste delle altre cpu.
+ * Gli shootdown sono serializzati da shootdown_lock: la coda di ogni cpu (TLBSHOOTDOWN_MAX richieste) contiene al più una richiesta,
+ * qualunque sia il numero di cpu e di thread che effettuano swap-out contemporaneamente.
+ */
+static struct lock* shootdown_lock = NULL;
+
+void tlb_bootstrap(void) {
+    shootdown_lock = lock_create("tlb_shootdown");
+    if (shootdown_lock == NULL)
+        panic("tlb_bootstrap: Cannot create the shootdown lock\n");
+}
+
+struct tlbshootdown_ack {
+    struct spinlock lock;
+    unsigned int done;    /* cpu che hanno già invalidato le entry */
+};
+
+void tlb_shootdown(paddr_t paddr) {
+    struct tlbshootdown ts;
+    struct tlbshootdown_ack ack;
+    unsigned int n;
+    bool wait;
+    int spl;
+
+    // una cpu in attesa di uno spinlock ha gli interrupt disabilitati e non potrebbe rispondere
+    KASSERT(curcpu->c_spinlocks == 0);
+    KASSERT(shootdown_lock != NULL);
+
+    spl = splhigh();
+    invalidate_entry_by_paddr(paddr);
+    splx(spl);
+
+    spinlock_init(&ack.lock);
+    ack.done = 0;
+    ts.ts_paddr = paddr;
+    ts.ts_ack = &ack;
+    lock_acquire(shootdown_lock);
+    n = ipi_tlbshootdown_broadcast(&ts);
+    if (n > 0)
+        inc_counter(tlb_shootdowns);
+    do {
+        spinlock_acquire(&ack.lock);
+        wait = ack.done < n;
+        spinlock_release(&ack.lock);
+    } while (wait);
+    lock_release(shootdown_lock);
+    spinlock_cleanup(&ack.lock);
+}
+
+void vm_tlbshootdown(const struct tlbshootdown* ts) {
+    invalidate_entry_by_paddr(ts->ts_paddr);  // interprocessor_interrupt possiede c_ipi_lock, gli interrupt sono disabilitati
+    spinlock_acquire(&ts->ts_ack->lock);
+    ts->ts_ack->done++;
+    spinlock_release(&ts->ts_ack->lock);
+}
+
+int tlb_set_fault_around(unsigned int n) {
+    if (n > TLB_FAULT_AROUND_MAX)
+        return EINVAL;
+    fault_around = n;
+    return 0;
+}
+
+unsigned int tlb_get_fault_around(void) {
+    return fault_around;
 }
\ No newline at end of file
@@ -139,7 +139,8 @@ readsb(void)
 	struct sfs_superblock sb;
 
 	diskread(&sb, SFS_SUPER_BLOCK);
-	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
+	if (SWAP32(sb.sb_magic) != SFS_MAGIC &&
+	    SWAP32(sb.sb_magic) != SFS_MAGIC_FEATURES) {
 		errx(1, "Not an sfs filesystem");
 	}
 	return SWAP32(sb.sb_nblocks);
@@ -163,6 +164,9 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_DIRINDEX) ?
+		 " (directory index)" : "");
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -476,6 +480,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	if (sfi.sfi_dirindex != 0) {
+		printf("    Directory index: %u (0x%x)\n",
+		       SWAP32(sfi.sfi_dirindex), SWAP32(sfi.sfi_dirindex));
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
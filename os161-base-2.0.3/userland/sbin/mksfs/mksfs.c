@@ -73,6 +73,8 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirbucket)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -121,11 +123,12 @@ initfreemap(uint32_t fsblocks)
 }
 
 /*
- * Initialize and write out the superblock.
+ * Initialize and write out the superblock. FEATURES are the
+ * SFS_FEATURE_* bits the volume uses.
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features)
 {
 	struct sfs_superblock sb;
 
@@ -137,9 +140,10 @@ writesuper(const char *volname, uint32_t nblocks)
 	}
 
 	/* Initialize the superblock structure */
-	sb.sb_magic = SWAP32(SFS_MAGIC);
+	sb.sb_magic = SWAP32(features ? SFS_MAGIC_FEATURES : SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_features = SWAP32(features);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -165,11 +169,37 @@ writefreemap(uint32_t fsblocks)
 }
 
 /*
- * Write out the root directory inode.
+ * Write out an empty directory index for the root directory, in the
+ * first block past the freemap, and return its block number.
+ */
+static
+uint32_t
+writerootindex(uint32_t fsblocks)
+{
+	struct sfs_dirindex sdi;
+	uint32_t block;
+
+	block = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+	if (block >= fsblocks) {
+		errx(1, "Volume too small for a directory index");
+	}
+	allocblock(block);
+
+	bzero((void *)&sdi, sizeof(sdi));
+	sdi.sdi_magic = SWAP32(SFS_DIRIDX_MAGIC);
+	sdi.sdi_dirsize = SWAP32(0);
+
+	diskwrite(&sdi, block);
+	return block;
+}
+
+/*
+ * Write out the root directory inode. DIRINDEX is the block of its
+ * directory index, or 0 for none.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t dirindex)
 {
 	struct sfs_dinode sfi;
 
@@ -178,6 +208,7 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	sfi.sfi_dirindex = SWAP32(dirindex);
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -189,15 +220,22 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, dirindex;
 	char *volname, *s;
+	int index = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==4 && !strcmp(argv[1], "-i")) {
+		/* -i: give the root directory a hashed index */
+		index = 1;
+		argc--;
+		argv++;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-i] device/diskfile volume-name");
 	}
 
 	check();
@@ -230,9 +268,10 @@ main(int argc, char **argv)
 
 	/* Write out the on-disk structures */
 	initfreemap(size);
-	writesuper(volname, size);
+	dirindex = index ? writerootindex(size) : 0;
+	writesuper(volname, size, index ? SFS_FEATURE_DIRINDEX : 0);
 	writefreemap(size);
-	writerootdir();
+	writerootdir(dirindex);
 
 	closedisk();
 
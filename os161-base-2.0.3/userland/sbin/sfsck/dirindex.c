@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "utils.h"
+#include "sfs.h"
+#include "sb.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "main.h"
+
+/*
+ * Must match sfs_dirhash() in the kernel.
+ */
+static
+uint32_t
+dirindex_hash(const char *name)
+{
+	uint32_t hash = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= SFS_DIRHASH_PRIME;
+	}
+	return hash;
+}
+
+////////////////////////////////////////////////////////////
+// structure
+
+/*
+ * Blocks of the index being checked, one bit per volume block, so
+ * that a chain that loops or runs into another chain is caught.
+ */
+static uint8_t *seenblocks;
+
+static
+int
+dirindex_seeblock(uint32_t block)
+{
+	uint8_t mask = ((uint8_t)1) << (block % CHAR_BIT);
+
+	if (block <= SFS_ROOTDIR_INO || block >= sb_totalblocks()) {
+		return -1;
+	}
+	if (seenblocks[block / CHAR_BIT] & mask) {
+		return -1;
+	}
+	seenblocks[block / CHAR_BIT] |= mask;
+	return 0;
+}
+
+/*
+ * Check the blocks of the chain starting at HEAD. Returns nonzero if
+ * it is damaged.
+ */
+static
+int
+dirindex_checkchain(uint32_t head)
+{
+	struct sfs_dirbucket sdb;
+	uint32_t block;
+
+	for (block = head; block != 0; block = sdb.sdb_next) {
+		if (dirindex_seeblock(block)) {
+			return -1;
+		}
+		sfs_readdirbucket(block, &sdb);
+		if (sdb.sdb_count == 0 ||
+		    sdb.sdb_count > SFS_DIRBUCKET_NENTRIES) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+dirindex_checkblocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_dirindex sdi;
+	uint32_t nbytes, i;
+	uint8_t bits;
+	int bad, j;
+
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+
+	if (!isdir) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: file has a directory index (cleared)",
+		      (unsigned long) ino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+	if (!sb_hasfeature(SFS_FEATURE_DIRINDEX)) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: directory index on a volume without "
+		      "the feature (cleared)", (unsigned long) ino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	nbytes = (sb_totalblocks() + CHAR_BIT - 1) / CHAR_BIT;
+	seenblocks = domalloc(nbytes);
+	memset(seenblocks, 0, nbytes);
+
+	bad = 0;
+	if (dirindex_seeblock(sfi->sfi_dirindex)) {
+		bad = 1;
+	}
+	else {
+		sfs_readdirindex(sfi->sfi_dirindex, &sdi);
+		if (sdi.sdi_magic != SFS_DIRIDX_MAGIC) {
+			bad = 1;
+		}
+	}
+	for (i=0; !bad && i<SFS_DIRIDX_NBUCKETS; i++) {
+		if (dirindex_checkchain(sdi.sdi_buckets[i])) {
+			bad = 1;
+		}
+	}
+	if (!bad && dirindex_checkchain(sdi.sdi_freeslots)) {
+		bad = 1;
+	}
+
+	/*
+	 * Record the blocks we saw: in use if the index is good, to be
+	 * freed (quietly, we complain below) if it is being dropped.
+	 */
+	for (i=0; i<nbytes; i++) {
+		bits = seenblocks[i];
+		for (j=0; bits != 0; j++, bits >>= 1) {
+			if ((bits & 1) == 0) {
+				continue;
+			}
+			if (bad) {
+				freemap_blockfree(i*CHAR_BIT + j);
+			}
+			else {
+				freemap_blockinuse(i*CHAR_BIT + j,
+						   B_DIRINDEX, ino);
+			}
+		}
+	}
+	free(seenblocks);
+	seenblocks = NULL;
+
+	if (bad) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: directory index damaged (removed)",
+		      (unsigned long) ino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// contents
+
+/*
+ * Check the slots listed in the chain starting at HEAD against the
+ * directory entries D. BUCKET is the bucket number, or -1 for the
+ * free-slot chain. SEEN has one byte per slot. Returns nonzero on
+ * mismatch.
+ */
+static
+int
+dirindex_checkslots(uint32_t head, int bucket, const struct sfs_direntry *d,
+		    unsigned nd, uint8_t *seen)
+{
+	struct sfs_dirbucket sdb;
+	struct sfs_dirbucket_entry *e;
+	uint32_t block, i;
+
+	for (block = head; block != 0; block = sdb.sdb_next) {
+		sfs_readdirbucket(block, &sdb);
+		for (i=0; i<sdb.sdb_count; i++) {
+			e = &sdb.sdb_entries[i];
+			if (e->sdbe_slot >= nd || seen[e->sdbe_slot]) {
+				return -1;
+			}
+			seen[e->sdbe_slot] = 1;
+			if (bucket < 0) {
+				if (d[e->sdbe_slot].sfd_ino != SFS_NOINO) {
+					return -1;
+				}
+				continue;
+			}
+			if (d[e->sdbe_slot].sfd_ino == SFS_NOINO ||
+			    e->sdbe_hash % SFS_DIRIDX_NBUCKETS != (unsigned)bucket ||
+			    e->sdbe_hash != dirindex_hash(d[e->sdbe_slot].sfd_name)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+dirindex_checkentries(const char *path, const struct sfs_dinode *sfi,
+		      const struct sfs_direntry *d, unsigned nd, int dchanged)
+{
+	struct sfs_dirindex sdi;
+	uint8_t *seen;
+	unsigned i;
+	int bad;
+
+	if (sfi->sfi_dirindex == 0) {
+		return;
+	}
+	if (dchanged) {
+		dirindex_markstale(sfi);
+		return;
+	}
+
+	sfs_readdirindex(sfi->sfi_dirindex, &sdi);
+	if (sdi.sdi_flags & SFS_DIRIDX_STALE) {
+		/* already waiting to be rebuilt */
+		return;
+	}
+
+	seen = domalloc(nd + 1);
+	memset(seen, 0, nd + 1);
+
+	bad = sdi.sdi_dirsize != sfi->sfi_size;
+	for (i=0; !bad && i<SFS_DIRIDX_NBUCKETS; i++) {
+		if (dirindex_checkslots(sdi.sdi_buckets[i], i, d, nd, seen)) {
+			bad = 1;
+		}
+	}
+	if (!bad && dirindex_checkslots(sdi.sdi_freeslots, -1, d, nd, seen)) {
+		bad = 1;
+	}
+	for (i=0; !bad && i<nd; i++) {
+		if (!seen[i]) {
+			bad = 1;
+		}
+	}
+	free(seen);
+
+	if (bad) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: index does not match entries "
+		      "(marked for rebuild)", path);
+		dirindex_markstale(sfi);
+	}
+}
+
+void
+dirindex_markstale(const struct sfs_dinode *sfi)
+{
+	struct sfs_dirindex sdi;
+
+	if (sfi->sfi_dirindex == 0) {
+		return;
+	}
+	sfs_readdirindex(sfi->sfi_dirindex, &sdi);
+	sdi.sdi_flags |= SFS_DIRIDX_STALE;
+	sfs_writedirindex(sfi->sfi_dirindex, &sdi);
+}
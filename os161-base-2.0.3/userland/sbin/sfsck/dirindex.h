@@ -0,0 +1,39 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+/*
+ * The dirindex module checks the hashed index of directories that
+ * have one (see kern/sfs.h). Structural damage (bad block numbers,
+ * blocks used twice, bad counts) causes the index to be dropped; an
+ * index that is intact but does not match the directory entries is
+ * marked stale, and the kernel rebuilds it the next time the
+ * directory is used.
+ */
+
+#include <stdint.h>
+
+struct sfs_dinode;
+struct sfs_direntry;
+
+/*
+ * Check the index blocks of inode INO, loaded into SFI, and record
+ * them in the freemap. Regular files must not have an index, nor may
+ * anything on a volume without SFS_FEATURE_DIRINDEX. Returns
+ * nonzero if SFI has been modified and needs to be written back.
+ */
+int dirindex_checkblocks(uint32_t ino, struct sfs_dinode *sfi, int isdir);
+
+/*
+ * Check that the index of directory SFI matches its entries D, which
+ * has ND slots; PATH is used for messages. If DCHANGED is set the
+ * entries have been changed on disk and the index is marked stale
+ * without checking it.
+ */
+void dirindex_checkentries(const char *path, const struct sfs_dinode *sfi,
+			   const struct sfs_direntry *d, unsigned nd,
+			   int dchanged);
+
+/* Mark the index of SFI stale, after its directory has been changed. */
+void dirindex_markstale(const struct sfs_dinode *sfi);
+
+#endif /* DIRINDEX_H */
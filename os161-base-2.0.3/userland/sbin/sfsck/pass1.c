@@ -43,6 +43,7 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "dirindex.h"
 #include "inode.h"
 #include "passes.h"
 #include "main.h"
@@ -281,6 +282,10 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (dirindex_checkblocks(ino, sfi, isdir)) {
+		changed = 1;
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
@@ -438,6 +443,8 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
 	}
+	dirindex_checkentries(pathsofar, &sfi, direntries, ndirentries,
+			      dchanged);
 
 	free(direntries);
 }
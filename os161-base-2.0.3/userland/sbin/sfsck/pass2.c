@@ -43,6 +43,7 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "dirindex.h"
 #include "inode.h"
 #include "passes.h"
 #include "main.h"
@@ -303,6 +304,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+		dirindex_markstale(&sfi);
 	}
 
 	if (ichanged) {
@@ -51,9 +51,14 @@ void
 sb_load(void)
 {
 	sfs_readsb(SFS_SUPER_BLOCK, &sb);
-	if (sb.sb_magic != SFS_MAGIC) {
+	if (sb.sb_magic != SFS_MAGIC && sb.sb_magic != SFS_MAGIC_FEATURES) {
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
+	if (sb.sb_magic == SFS_MAGIC_FEATURES &&
+	    (sb.sb_features & ~SFS_FEATURES_KNOWN) != 0) {
+		errx(EXIT_FATAL, "Unsupported features 0x%lx",
+		     (unsigned long)(sb.sb_features & ~SFS_FEATURES_KNOWN));
+	}
 
 	assert(sb.sb_nblocks > 0);
 	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
@@ -83,6 +88,13 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_magic == SFS_MAGIC && sb.sb_features != 0) {
+		warnx("Features set without the features magic number "
+		      "(cleared)");
+		setbadness(EXIT_RECOV);
+		sb.sb_features = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -95,6 +107,16 @@ sb_check(void)
 	}
 }
 
+/*
+ * Return nonzero if the volume uses FEATURE (an SFS_FEATURE_* bit).
+ */
+int
+sb_hasfeature(uint32_t feature)
+{
+	return sb.sb_magic == SFS_MAGIC_FEATURES &&
+		(sb.sb_features & feature) != 0;
+}
+
 /*
  * Return the total number of blocks in the volume.
  */
@@ -51,6 +51,8 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirbucket)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +64,7 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
 }
 
 static
@@ -97,6 +100,8 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_dirindex = SWAP32(sfi->sfi_dirindex);
 }
 
 static
@@ -116,6 +121,37 @@ swapindir(uint32_t *entries)
 	}
 }
 
+static
+void
+swapdirindex(struct sfs_dirindex *sdi)
+{
+	int i;
+
+	sdi->sdi_magic = SWAP32(sdi->sdi_magic);
+	sdi->sdi_flags = SWAP32(sdi->sdi_flags);
+	sdi->sdi_dirsize = SWAP32(sdi->sdi_dirsize);
+	sdi->sdi_freeslots = SWAP32(sdi->sdi_freeslots);
+	for (i=0; i<SFS_DIRIDX_NBUCKETS; i++) {
+		sdi->sdi_buckets[i] = SWAP32(sdi->sdi_buckets[i]);
+	}
+}
+
+static
+void
+swapdirbucket(struct sfs_dirbucket *sdb)
+{
+	int i;
+
+	sdb->sdb_next = SWAP32(sdb->sdb_next);
+	sdb->sdb_count = SWAP32(sdb->sdb_count);
+	for (i=0; i<SFS_DIRBUCKET_NENTRIES; i++) {
+		sdb->sdb_entries[i].sdbe_hash =
+			SWAP32(sdb->sdb_entries[i].sdbe_hash);
+		sdb->sdb_entries[i].sdbe_slot =
+			SWAP32(sdb->sdb_entries[i].sdbe_slot);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // bmap()
 
@@ -264,6 +300,32 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  directory index and bucket blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readdirindex(uint32_t blocknum, struct sfs_dirindex *sdi)
+{
+	diskread(sdi, blocknum);
+	swapdirindex(sdi);
+}
+
+void
+sfs_writedirindex(uint32_t blocknum, struct sfs_dirindex *sdi)
+{
+	swapdirindex(sdi);
+	diskwrite(sdi, blocknum);
+	swapdirindex(sdi);
+}
+
+void
+sfs_readdirbucket(uint32_t blocknum, struct sfs_dirbucket *sdb)
+{
+	diskread(sdb, blocknum);
+	swapdirbucket(sdb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -0,0 +1,117 @@
+/*
+ * dirtyswap - check that pages evicted without being written to swap
+ * come back with the right contents.
+ *
+ * The array is larger than physical memory (2M in the default
+ * sys161.conf), so scanning it evicts pages. A page that has not been
+ * written since it was last loaded is dropped instead of being
+ * written again: it is reloaded from its existing swap copy. If that
+ * copy were stale, or if a write to a page mapped read-only did not
+ * make it dirty again, an old generation of the data would show up.
+ *
+ * After a run, swap_writes_avoided in the VM statistics should be
+ * well above zero.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 768			/* 3M */
+#define WORDS (PAGE / sizeof(unsigned))
+
+static unsigned pages[NPAGES][WORDS];
+static unsigned char gen[NPAGES];	/* generation last written */
+
+static
+unsigned
+tag(unsigned page, unsigned g)
+{
+	return (g << 24) | (page << 4) | 0x5;
+}
+
+/*
+ * Write generation g to every page whose number is a multiple of step.
+ */
+static
+void
+writepages(unsigned step, unsigned g)
+{
+	unsigned i, j;
+
+	for (i=0; i<NPAGES; i+=step) {
+		for (j=0; j<WORDS; j+=WORDS/4) {
+			pages[i][j] = tag(i, g);
+		}
+		pages[i][WORDS-1] = tag(i, g);
+		gen[i] = g;
+	}
+}
+
+/*
+ * Read every page, which only loads it, and check its generation.
+ */
+static
+void
+checkpages(const char *what)
+{
+	unsigned i, j;
+
+	for (i=0; i<NPAGES; i++) {
+		for (j=0; j<WORDS; j+=WORDS/4) {
+			if (pages[i][j] != tag(i, gen[i])) {
+				errx(1, "%s: page %u word %u is 0x%x, "
+				     "expected 0x%x", what, i, j,
+				     pages[i][j], tag(i, gen[i]));
+			}
+		}
+		if (pages[i][WORDS-1] != tag(i, gen[i])) {
+			errx(1, "%s: page %u last word is 0x%x, "
+			     "expected 0x%x", what, i,
+			     pages[i][WORDS-1], tag(i, gen[i]));
+		}
+	}
+}
+
+int
+main(void)
+{
+	int pid, status;
+
+	/* Every page is dirty once and goes to swap. */
+	writepages(1, 1);
+	checkpages("first pass");
+
+	/* Pages swapped back in are clean: they are dropped this time. */
+	checkpages("clean pass");
+	printf("dirtyswap: clean pages passed\n");
+
+	/* Dirty some clean pages again; their old swap copies are stale. */
+	writepages(3, 2);
+	checkpages("after rewrite");
+	checkpages("after rewrite, second pass");
+	printf("dirtyswap: rewritten pages passed\n");
+
+	/* Pages shared after fork are swapped out for both processes. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		checkpages("child");
+		writepages(2, 3);
+		checkpages("child after rewrite");
+		_exit(0);
+	}
+	checkpages("parent while child runs");
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (status != 0) {
+		errx(1, "child failed");
+	}
+	checkpages("parent after child");
+	printf("dirtyswap: passed\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * faultaround - check that TLB entries loaded ahead of a fault carry
+ * the right permissions.
+ *
+ * On a TLB fault the kernel also loads the entries of the next few
+ * resident pages. Those entries must be read-only whenever the page
+ * itself is: for pages that are clean, shared with another process
+ * after fork, or in the text segment. Otherwise writes through them
+ * would be lost on eviction, would show up in the other process, or
+ * would modify the program.
+ *
+ * After a run, tlb_prefetches in the VM statistics should be well
+ * above zero.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 64
+#define WORDS (PAGE / sizeof(unsigned))
+
+static unsigned pages[NPAGES][WORDS];
+
+/*
+ * Read one word per page, in order.
+ */
+static
+unsigned
+scan(void)
+{
+	volatile unsigned *p;
+	unsigned i, sum = 0;
+
+	for (i=0; i<NPAGES; i++) {
+		p = pages[i];
+		sum += p[0];
+	}
+	return sum;
+}
+
+static
+void
+fill(unsigned val)
+{
+	unsigned i, j;
+
+	for (i=0; i<NPAGES; i++) {
+		for (j=0; j<WORDS; j+=WORDS/4) {
+			pages[i][j] = val + i;
+		}
+	}
+}
+
+static
+void
+check(const char *what, unsigned val)
+{
+	unsigned i, j;
+
+	for (i=0; i<NPAGES; i++) {
+		for (j=0; j<WORDS; j+=WORDS/4) {
+			if (pages[i][j] != val + i) {
+				errx(1, "%s: page %u word %u is 0x%x, "
+				     "expected 0x%x", what, i, j,
+				     pages[i][j], val + i);
+			}
+		}
+	}
+}
+
+/*
+ * Fork a child that runs func and wait for it. Return its status.
+ */
+static
+int
+runchild(void (*func)(void))
+{
+	int pid, status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		func();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	return status;
+}
+
+static
+void
+writeshared(void)
+{
+	/* Load the shared pages into the TLB, then write all of them. */
+	scan();
+	fill(0x2000);
+	check("child", 0x2000);
+}
+
+static
+void
+writetext(void)
+{
+	volatile char *text;
+	char c;
+
+	/* The page of this function is read, then written. */
+	text = (volatile char *)((uintptr_t)writetext & ~(uintptr_t)(PAGE-1));
+	c = text[0];
+	text[0] = c;
+}
+
+int
+main(void)
+{
+	/* Pages mapped on the zero frame, then written in order. */
+	scan();
+	fill(0x1000);
+	check("zero pages", 0x1000);
+	scan();
+	check("zero pages after rescan", 0x1000);
+	printf("faultaround: zero pages passed\n");
+
+	/* Shared pages written by a child must not change here. */
+	if (runchild(writeshared) != 0) {
+		errx(1, "writer child failed");
+	}
+	check("parent after child write", 0x1000);
+	printf("faultaround: shared pages passed\n");
+
+	/* A write to the text segment must kill the child. */
+	if (runchild(writetext) == 0) {
+		errx(1, "child wrote to its text segment");
+	}
+	printf("faultaround: passed\n");
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * zeroshare - check that writing to an anonymous page does not leak
+ * into other processes.
+ *
+ * BSS and stack pages that are read before they are written all map
+ * the same zeroed frame, read-only. The first write to such a page must
+ * give it a private frame. If the shared frame were mapped writable,
+ * the write would show up in every other process that still reads the
+ * page as zero.
+ *
+ * Each process reads its pages first, so that they are mapped on the
+ * shared frame, then a child writes to them and the parent (and a
+ * second child) check that they still read zeros.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 4
+#define PATTERN 0xa5
+
+static char bss_pages[NPAGES * PAGE];
+static char bss_other[NPAGES * PAGE];
+
+/*
+ * Read one word per page, which maps the page without writing to it.
+ */
+static
+unsigned
+touch(volatile char *p, unsigned len)
+{
+	unsigned i, sum = 0;
+
+	for (i=0; i<len; i+=PAGE) {
+		sum += p[i];
+	}
+	return sum;
+}
+
+/*
+ * Make sure every byte of the region is zero.
+ */
+static
+void
+checkzero(const char *what, volatile char *p, unsigned len)
+{
+	unsigned i;
+
+	for (i=0; i<len; i++) {
+		if (p[i] != 0) {
+			errx(1, "%s: byte %u (address %p) is 0x%x, not zero",
+			     what, i, &p[i], (unsigned char)p[i]);
+		}
+	}
+}
+
+static
+void
+fill(volatile char *p, unsigned len)
+{
+	unsigned i;
+
+	for (i=0; i<len; i++) {
+		p[i] = PATTERN;
+	}
+}
+
+/*
+ * Fork a child that runs func and wait for it; fail if it fails.
+ */
+static
+void
+runchild(const char *what, void (*func)(void))
+{
+	int pid, status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		func();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (status != 0) {
+		errx(1, "%s: child failed", what);
+	}
+}
+
+static
+void
+writebss(void)
+{
+	touch(bss_pages, sizeof(bss_pages));
+	fill(bss_pages, sizeof(bss_pages));
+}
+
+static
+void
+readbss(void)
+{
+	checkzero("child bss", bss_pages, sizeof(bss_pages));
+}
+
+static
+void
+readother(void)
+{
+	/* The first page was written by the parent before the fork. */
+	checkzero("child bss", bss_other + PAGE, sizeof(bss_other) - PAGE);
+}
+
+/*
+ * Only the deepest NPAGES pages of buf are used: the pages above them
+ * are reused by the frames of runchild and of the system calls it
+ * makes, which are not zero.
+ */
+static
+void
+stackpages(int write)
+{
+	volatile char buf[(NPAGES + 2) * PAGE];
+
+	touch(buf, NPAGES * PAGE);
+	if (write) {
+		fill(buf, NPAGES * PAGE);
+	}
+	else {
+		checkzero("stack", buf, NPAGES * PAGE);
+	}
+}
+
+static
+void
+writestack(void)
+{
+	stackpages(1);
+}
+
+int
+main(void)
+{
+	/* Map the BSS pages on the zero frame, then let a child write. */
+	touch(bss_pages, sizeof(bss_pages));
+	runchild("bss writer", writebss);
+	checkzero("parent bss", bss_pages, sizeof(bss_pages));
+	runchild("bss reader", readbss);
+	printf("zeroshare: bss passed\n");
+
+	/* Same for a stack page never written by anyone. */
+	stackpages(0);
+	runchild("stack writer", writestack);
+	stackpages(0);
+	printf("zeroshare: stack passed\n");
+
+	/* Now the parent writes and a fresh child must still read zeros. */
+	touch(bss_other, sizeof(bss_other));
+	fill(bss_other, PAGE);
+	checkzero("parent bss", bss_other + PAGE, sizeof(bss_other) - PAGE);
+	runchild("bss reader after parent write", readother);
+	printf("zeroshare: passed\n");
+	return 0;
+}